@@ -0,0 +1,347 @@
+/*
+ * CaiShell-bench - microbenchmarks of the hot paths of CaiShell
+ *
+ *     CaiShell-bench [-s scale] [-o file.json]
+ *
+ * Times the lexer, alias expansion, the PATH lookup, variables, the
+ * job table, starting and reaping a program, command substitution and
+ * the throughput of pipelines, and writes the results as JSON so runs of different
+ * versions can be compared. scale multiplies the iteration counts
+ * (default 1).
+ *
+ * The shell itself is compiled in, so the real functions are measured.
+ */
+#define CAISHELL_NO_MAIN
+#include "CaiShell.c"
+
+FILE *json;                 /* where the results go */
+int nresult = 0;
+double scale = 1;
+
+/* now_ns - CLOCK_MONOTONIC in nanoseconds */
+static double now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* iters - An iteration count times the scale, at least 1 */
+static long iters(long n) {
+    return (n * scale >= 1) ? (long) (n * scale) : 1;
+}
+
+/*
+ * result - Write one result. bytes is the data handled per iteration,
+ *     0 if a throughput makes no sense for it.
+ */
+static void result(const char *name, long n, double ns, double bytes) {
+    fprintf(json, "%s\n    {\"name\": \"%s\", \"iterations\": %ld, \"ns_per_op\": %.1f",
+            nresult++ ? "," : "", name, n, ns / n);
+    if (bytes > 0)
+        fprintf(json, ", \"mb_per_s\": %.1f", bytes * n / (ns / 1e9) / 1e6);
+    fprintf(json, "}");
+    fflush(json);
+}
+
+/*
+ * bench_parseline - Lex a typical command line and a long one
+ */
+static void bench_parseline(void) {
+    char *line = "ls -l 'a quoted arg' \"$HOME/x\" | grep -v foo\\ bar > out 2>&1 &\n";
+    char *big;
+    char **argv;
+    long n;
+    double t;
+    size_t len = 0;
+
+    n = iters(1000000);
+    t = now_ns();
+    for (long i = 0; i < n; i++) {
+        struct arena_mark_t m = arena_mark(&cmd_arena);
+        parseline(line, &argv);
+        arena_release(&cmd_arena, m);
+    }
+    result("parseline_short", n, now_ns() - t, strlen(line));
+
+    big = (char *) malloc(1 << 20);
+    while (len < (1 << 20) - 64)
+        len += sprintf(big + len, "word%zu 'quoted %zu' | ", len, len);
+    big[len] = '\0';
+    n = iters(200);
+    t = now_ns();
+    for (long i = 0; i < n; i++) {
+        struct arena_mark_t m = arena_mark(&cmd_arena);
+        parseline(big, &argv);
+        arena_release(&cmd_arena, m);
+    }
+    result("parseline_1mb", n, now_ns() - t, len);
+    free(big);
+}
+
+/*
+ * bench_alias - Expand aliases out of a table of 10000, some of them
+ *     expanding to further aliases
+ */
+static void bench_alias(void) {
+    char name[32], value[64];
+    char **argv;
+    long n;
+    double t;
+
+    for (int i = 0; i < 10000; i++) {
+        snprintf(name, sizeof(name), "al%d", i);
+        if (i % 10 == 0 && i > 0)
+            snprintf(value, sizeof(value), "al%d --opt%d", i - 1, i);
+        else
+            snprintf(value, sizeof(value), "/bin/echo a%d b%d c%d", i, i, i);
+        alias_define(name, value);
+    }
+
+    n = iters(500000);
+    t = now_ns();
+    for (long i = 0; i < n; i++) {
+        struct arena_mark_t m = arena_mark(&cmd_arena);
+        parseline("al10 x | al5000 y ; al9990 z & nothere w\n", &argv);
+        rebulid_command(&argv);
+        arena_release(&cmd_arena, m);
+    }
+    result("rebulid_command_10000_aliases", n, now_ns() - t, 0);
+    alias_free();
+}
+
+/*
+ * bench_path - Resolve a command found only in the last of 64 PATH
+ *     directories, with an empty hash and with the hash filled
+ */
+static void bench_path(void) {
+    char dir[64], file[128], *argv[2];
+    char tmpl[] = "/tmp/caibench.XXXXXX";
+    char *base = mkdtemp(tmpl);
+    long n;
+    double t;
+    int fd;
+
+    if (base == NULL)
+        return;
+    npath = 0;
+    for (int i = 0; i < 64; i++) {
+        snprintf(dir, sizeof(dir), "%s/d%d", base, i);
+        mkdir(dir, 0755);
+        path_add(dir, strlen(dir));
+    }
+    snprintf(file, sizeof(file), "%s/d63/benchcmd", base);
+    if ((fd = open(file, O_WRONLY | O_CREAT, 0755)) >= 0)
+        close(fd);
+
+    n = iters(20000);
+    t = now_ns();
+    for (long i = 0; i < n; i++) {
+        argv[0] = "benchcmd";
+        argv[1] = NULL;
+        hash_reset();
+        is_accessable(argv);
+    }
+    result("is_accessable_64_dirs_cold", n, now_ns() - t, 0);
+
+    n = iters(2000000);
+    t = now_ns();
+    for (long i = 0; i < n; i++) {
+        argv[0] = "benchcmd";
+        is_accessable(argv);
+    }
+    result("is_accessable_64_dirs_hashed", n, now_ns() - t, 0);
+
+    hash_reset();
+    unlink(file);
+    for (int i = 0; i < 64; i++) {
+        snprintf(dir, sizeof(dir), "%s/d%d", base, i);
+        rmdir(dir);
+    }
+    rmdir(base);
+    npath = 0;
+}
+
+/*
+ * bench_vars - With 500 variables exported, set one, lay two prefix
+ *     assignments over the environment and take them off, and expand
+ *     the variables of a command line
+ */
+static void bench_vars(void) {
+    char name[32], value[64];
+    char *assign[] = {"BENCHVAR7=x", "NEWVAR=y"};
+    struct envsave_t save[2];
+    char **argv;
+    long n;
+    double t;
+
+    for (int i = 0; i < 500; i++) {
+        snprintf(name, sizeof(name), "BENCHVAR%d", i);
+        snprintf(value, sizeof(value), "value of variable %d", i);
+        var_set(name, strlen(name), value, VAR_EXPORT);
+    }
+
+    n = iters(2000000);
+    t = now_ns();
+    for (long i = 0; i < n; i++)
+        var_set("BENCHVAR250", 11, (i & 1) ? "odd" : "even", 0);
+    result("var_set_exported_500", n, now_ns() - t, 0);
+
+    n = iters(2000000);
+    t = now_ns();
+    for (long i = 0; i < n; i++) {
+        env_overlay(assign, 2, save);
+        env_restore(2, save);
+    }
+    result("env_overlay_restore_500", n, now_ns() - t, 0);
+
+    n = iters(500000);
+    t = now_ns();
+    for (long i = 0; i < n; i++) {
+        struct arena_mark_t m = arena_mark(&cmd_arena);
+        parseline("echo $BENCHVAR1 \"${BENCHVAR2}\" x$BENCHVAR3.y\n", &argv);
+        expand_words(argv);
+        arena_release(&cmd_arena, m);
+    }
+    result("parseline_expand_words", n, now_ns() - t, 0);
+
+    for (int i = 0; i < 500; i++) {
+        snprintf(name, sizeof(name), "BENCHVAR%d", i);
+        var_unset(name);
+    }
+}
+
+/*
+ * bench_jobs - Add 1000 three-stage jobs, find every pid, delete them.
+ *     The pids are above any pid_max, so no pidfd is opened.
+ */
+static void bench_jobs(void) {
+    const int njob = 1000;
+    pid_t base = 5000000;
+    long n = iters(200);
+    double t;
+
+    t = now_ns();
+    for (long i = 0; i < n; i++) {
+        for (int j = 0; j < njob; j++)
+            for (int k = 0; k < 3; k++)
+                addjob(base + 3 * j + k, base + 3 * j, BG, "bench job\n");
+        for (int j = 0; j < 3 * njob; j++)
+            if (getjobpid(base + j) == NULL)
+                app_error("bench_jobs: job lost");
+        for (int j = 0; j < njob; j++)
+            deletejob(base + 3 * j);
+    }
+    /* one op is an addjob, a getjobpid and a third of a deletejob */
+    result("addjob_getjobpid_deletejob", n * 3 * njob, now_ns() - t, 0);
+}
+
+/*
+ * bench_launch - Start /bin/true in the foreground and reap it, the
+ *     way a command line does, with both launchers
+ */
+static void bench_launch(void) {
+    static const char *name[] = {"launch_reap_spawn", "launch_reap_fork"};
+    int modes[] = {LAUNCH_SPAWN, LAUNCH_FORK};
+    long n = iters(2000);
+    double t;
+
+    for (int m = 0; m < 2; m++) {
+        launcher = modes[m];
+        t = now_ns();
+        for (long i = 0; i < n; i++)
+            eval("/bin/true\n");
+        result(name[m], n, now_ns() - t, 0);
+    }
+    launcher = LAUNCH_SPAWN;
+}
+
+/*
+ * bench_subst - Capture the output of a builtin and of a program in a
+ *     command substitution
+ */
+static void bench_subst(void) {
+    static const char *cmd[] = {"echo hello world", "/bin/echo hello world"};
+    static const char *name[] = {"subst_builtin", "subst_program"};
+    long count[] = {iters(500000), iters(2000)};
+    double t;
+
+    for (int k = 0; k < 2; k++) {
+        t = now_ns();
+        for (long i = 0; i < count[k]; i++) {
+            struct arena_mark_t m = arena_mark(&cmd_arena);
+            if (strcmp(subst(cmd[k], strlen(cmd[k])), "hello world"))
+                app_error("bench_subst: wrong output");
+            arena_release(&cmd_arena, m);
+        }
+        result(name[k], count[k], now_ns() - t, 0);
+    }
+}
+
+/*
+ * bench_pipeline - Push 256 MB through pipelines of 1 to 8 cat stages
+ */
+static void bench_pipeline(void) {
+    long bytes = (long) (256 * 1048576 * scale);
+    char line[512], name[64];
+    double t;
+    int len;
+
+    if (bytes < 1048576)
+        bytes = 1048576;
+    for (int stages = 1; stages <= 8; stages *= 2) {
+        len = snprintf(line, sizeof(line), "/usr/bin/head -c %ld /dev/zero", bytes);
+        for (int i = 0; i < stages; i++)
+            len += snprintf(line + len, sizeof(line) - len, " | /bin/cat");
+        snprintf(line + len, sizeof(line) - len, " > /dev/null\n");
+
+        snprintf(name, sizeof(name), "pipeline_%d_stages", stages);
+        t = now_ns();
+        eval(line);
+        result(name, 1, now_ns() - t, bytes);
+    }
+}
+
+int main(int argc, char **argv) {
+    char c;
+    char *out = NULL;
+
+    while ((c = getopt(argc, argv, "s:o:")) != EOF) {
+        switch (c) {
+            case 's':
+                scale = atof(optarg);
+                break;
+            case 'o':
+                out = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: CaiShell-bench [-s scale] [-o file.json]\n");
+                exit(1);
+        }
+    }
+    if (out == NULL)
+        json = stdout;
+    else if ((json = fopen(out, "w")) == NULL)
+        unix_error(out);
+
+    Signal(SIGINT, SIG_IGN);
+    Signal(SIGTSTP, SIG_IGN);
+    Signal(SIGQUIT, SIG_IGN);
+    initjobs();
+    events_init();
+
+    fprintf(json, "{\n  \"benchmark\": \"CaiShell\",\n  \"scale\": %g,\n  \"results\": [", scale);
+    bench_parseline();
+    bench_alias();
+    bench_path();
+    bench_vars();
+    bench_jobs();
+    bench_launch();
+    bench_subst();
+    bench_pipeline();
+    fprintf(json, "\n  ]\n}\n");
+
+    if (json != stdout)
+        fclose(json);
+    exit(0);
+}
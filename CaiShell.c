@@ -3,6 +3,7 @@
  * 
  * <Put your name and login ID here>
  */
+#define _GNU_SOURCE         /* F_SETPIPE_SZ */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -13,14 +14,128 @@
 #include <sys/wait.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/inotify.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <time.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <sched.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <getopt.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <poll.h>
+#include <fnmatch.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 
 /* Misc manifest constants */
 #define MAXLINE    1024   /* max line size */
 #define MAXARGS     128   /* max args on a command line */
-#define MAXJOBS      16   /* max jobs at any point in time */
-#define MAXJOBPS      16   /* max jobs at any point in time */
 #define MAXJID    1<<16   /* max job ID */
+#define HASHSIZE    256   /* buckets of the command hash table */
+#define INBUF     65536   /* stdin is read in blocks of this size */
+#define ARENA_CHUNK 65536 /* default chunk of an arena */
+#define HISTBLOCK 4096    /* bytes of history per block of its index */
+#define HISTBITS  8192    /* trigram bits of an index block */
+#define ESCWAIT     50    /* ms to wait for the rest of an escape sequence */
+#define SERVE_MAXFRAME (1 << 20) /* largest frame a client may send */
+#define SERVE_MAXOUT   (1 << 20) /* output queued for a client before its workers wait */
+#define TRACE_EVENTS 65536 /* events kept by the tracer, a power of 2 */
+#define NDONE        64   /* finished background jobs wait can still report */
+
+/* Launchers of external programs */
+#define LAUNCH_SPAWN 0 /* posix_spawn */
+#define LAUNCH_FORK  1 /* fork and execve */
+
+/* Sources of events in the epoll set */
+#define EV_INPUT   1 /* stdin */
+#define EV_SIGCHLD 2 /* the signalfd */
+#define EV_PIDFD   3 /* pidfd of a child, the low half is its pid */
+#define EV_FD      4 /* a file descriptor of watchfd(), the low half is the fd */
+#define EV_TAG(type, val) (((uint64_t) (type) << 32) | (uint32_t) (val))
+#define EV_TYPE(data) ((int) ((data) >> 32))
+
+/* Operators of the command line. parseline() puts these pointers in
+ * argv, so they are told from words by address, never with strcmp */
+#define OP_PIPE   (&lex_ops[0])  /* | */
+#define OP_AMP    (&lex_ops[2])  /* & */
+#define OP_SEMI   (&lex_ops[4])  /* ; */
+#define OP_IN     (&lex_ops[6])  /* < */
+#define OP_OUT    (&lex_ops[8])  /* > */
+#define OP_APPEND (&lex_ops[10]) /* >> */
+#define OP_DUP    (&lex_ops[13]) /* >& */
+#define OP_DUPIN  (&lex_ops[16]) /* <& */
+#define OP_IONUM  (&lex_ops[19]) /* the next word is the fd of the redirection after it */
+#define OP_FANOUT (&lex_ops[20]) /* |> */
+#define OP_COMMA  (&lex_ops[23]) /* , between the branches of |> */
+#define IS_OP(w)  ((w) >= lex_ops && (w) < lex_ops + sizeof(lex_ops))
+
+/* Characters that end a run of plain characters in a word */
+#define LEX_SPECIAL " \t\n\r'\"\\|&;<>$`"
+#define IS_BLANK(c)    ((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\r')
+#define IS_OPERATOR(c) ((c) == '|' || (c) == '&' || (c) == ';' || (c) == '<' || (c) == '>')
+
+/* parseline() leaves a $name in a word as one of these, the name and
+ * CTL_END, and expand_words() puts in the value when the command runs.
+ * A $(command) or `command` is left the same way, with its text */
+#define CTL_VAR  '\001' /* outside quotes, the value is split into fields */
+#define CTL_QVAR '\002' /* in double quotes */
+#define CTL_END  '\003'
+#define CTL_SUB  '\004' /* command substitution, split like CTL_VAR */
+#define CTL_QSUB '\005' /* in double quotes */
+#define CTL_VARS "\001\002\004\005"
+
+/* Nodes of a compiled script, see compile() */
+#define N_CMD      1 /* a command of a list, its words in argv, maybe ending in & */
+#define N_IF       2 /* cond, body, and alt: the elif (an N_IF) or else part */
+#define N_WHILE    3 /* cond, body */
+#define N_UNTIL    4 /* cond, body */
+#define N_FOR      5 /* the variable in name, the words in argv, body */
+#define N_CASE     6 /* the word in name, the N_ITEMs in body */
+#define N_ITEM     7 /* an item of case: the patterns in argv, body */
+#define N_BREAK    8 /* count loops */
+#define N_CONTINUE 9
+#define N_ERROR   10 /* a syntax error, the message in name */
+
+/* Flags of var_set() */
+#define VAR_EXPORT 1 /* put it in the environment of programs */
+
+/* Keys of the line editor beyond the bytes 0-255 */
+#ifndef CTRL                   /* sys/ttydefaults.h has it */
+#define CTRL(c)    ((c) & 0x1f)
+#endif
+#define KEY_UP     256
+#define KEY_DOWN   257
+#define KEY_RIGHT  258
+#define KEY_LEFT   259
+#define KEY_HOME   260
+#define KEY_END    261
+#define KEY_DEL    262
+#define KEY_WRIGHT 263 /* a word right */
+#define KEY_WLEFT  264 /* a word left */
+
+/* Frames of --serve: SERVE_ENV, SERVE_CWD and SERVE_CMD come from the
+ * client, SERVE_CMD starting the request; the others are the answer */
+#define SERVE_ENV  1 /* NAME=value for the environment of the request */
+#define SERVE_CWD  2 /* directory to run the request in */
+#define SERVE_CMD  3 /* the command lines */
+#define SERVE_OUT  4 /* output of the request on stdout */
+#define SERVE_ERR  5 /* output of the request on stderr */
+#define SERVE_EXIT 6 /* a serve_exit_t, the last frame of the request */
 
 /* Job states */
 #define UNDEF 0 /* undefined */
@@ -42,29 +157,360 @@
 extern char **environ;      /* defined in libc */
 char prompt[] = "CaiShell> ";    /* command line prompt (DO NOT CHANGE) */
 int verbose = 0;            /* if true, print additional output */
-int nextjid = 1;            /* next job ID to allocate */
+int last_status = 0;        /* exit status of the last foreground job */
 char sbuf[MAXLINE];         /* for composing sprintf messages */
 
 pid_t Fpgid;
+int pipe_size = 0;          /* F_SETPIPE_SZ of pipeline pipes, 0 = kernel default */
+int launcher = LAUNCH_SPAWN; /* how external programs are started */
 
 char PATH[MAXARGS][MAXLINE];
+int npath = 0;              /* entries in PATH */
+int path_wd[MAXARGS];       /* inotify watch of each PATH entry */
+int inotify_fd = -1;        /* watches the PATH directories */
+char *conf_file = NULL;     /* config file given with -f */
+
+struct conf_t {             /* what parsing the config files produced */
+    char **src;             /* the files read */
+    struct stat *srcst;
+    int nsrc;
+    char **var;             /* NAME=value settings */
+    int nvar;
+};
+
+#define SNAP_MAGIC "CAISNAP1"
+
+/* A config snapshot is this header, a snapsrc_t per source file and
+ * the NUL-terminated strings: the source names, the PATH entries, the
+ * alias name/value pairs and the NAME=value variables */
+struct snap_t {
+    char magic[8];          /* SNAP_MAGIC */
+    uint64_t size;          /* of the whole file */
+    uint32_t nsrc, npath;
+    uint32_t nalias, nvar;
+    int32_t pipe_size, launcher;
+};
+
+struct snapsrc_t {          /* a file a snapshot was made from */
+    int64_t mtime_sec, mtime_nsec;
+    int64_t size;           /* -1 if it did not exist */
+};
 
 struct alias_t {
-    char new_command[MAXLINE];
-    char old_command[MAXLINE];
+    char *name;             /* the new command */
+    char *value;            /* the command it stands for, as typed */
+    char **argv;            /* value split into words */
+    int argc;
+    int expanding;          /* set while it is expanded */
     struct alias_t *next;
 };
 
+struct hash_t {             /* resolved command, like the hash of bash */
+    char *name;             /* command name */
+    char *path;             /* absolute path of the program */
+    int hits;               /* times the entry was used */
+    struct hash_t *next;
+};
+
+struct chunk_t {            /* a block of an arena */
+    struct chunk_t *next;
+    size_t size;
+    char data[];
+};
+
+struct arena_t {            /* bump allocator, freed all at once */
+    struct chunk_t *first;
+    struct chunk_t *cur;    /* chunk being allocated from */
+    char *ptr, *end;        /* free space of cur */
+    char *last;             /* last allocation, may still grow in place */
+};
+
+struct arena_mark_t {       /* position of an arena */
+    struct chunk_t *cur;
+    char *ptr;
+};
+
+struct redir_t {            /* a redirection, applied in the order typed */
+    int fd;                 /* descriptor of the program */
+    char *op;               /* OP_IN, OP_OUT, OP_APPEND, OP_DUP or OP_DUPIN */
+    char *word;             /* file name, or the fd copied by OP_DUP/OP_DUPIN */
+    int saved;              /* copy of the replaced fd while a builtin runs */
+    struct redir_t *next;
+};
+
+struct sched_t {            /* options of the pin builtin */
+    int setcpus, setnice, setpolicy; /* which of these are set */
+    cpu_set_t cpus;         /* CPU affinity */
+    int nice;
+    int policy;             /* SCHED_OTHER, SCHED_FIFO, ... */
+    int prio;               /* static priority of SCHED_FIFO/SCHED_RR */
+};
+
+struct stage_t {            /* one command of a pipeline */
+    char **argv;            /* NULL-terminated argument list */
+    struct redir_t *redir;  /* its redirections */
+    struct sched_t *sched;  /* set by the pin prefix, NULL if none */
+    char **assign;          /* the NAME=value words before the command */
+    int nassign;
+    int branch;             /* branch of |> it is in (1, 2, ...), 0 before |> */
+};
+
+struct stagetime_t {        /* what the time prefix reports of a stage */
+    char name[32];          /* program name */
+    struct timespec end;    /* when it was reaped, 0 while it runs */
+    struct rusage ru;       /* from wait4 */
+};
+
 struct job_t {              /* The job struct */
-    pid_t pid[MAXJOBPS];              /* job PID */
+    pid_t *pid;             /* PIDs of the stages */
+    int npid;               /* stages started */
+    int maxpid;             /* room in pid */
     pid_t pgid;                /* job group pid */
     int jid;                /* job ID [1, 2, ...] */
+    int nlive;              /* stages not reaped yet */
+    int status;             /* exit status of the last stage */
 
     int state;              /* UNDEF, BG, FG, or ST */
-    char cmdline[MAXLINE];  /* command line */
+    char *cmdline;          /* command line */
+    struct job_t *pgnext;   /* next job in the same pgid bucket */
+    void (*ondone)(struct job_t *job); /* called when the job is deleted */
+    void *arg;              /* for ondone */
+    struct stagetime_t *times; /* per stage, like pid; set by the time prefix */
+    struct timespec start;  /* when the time prefix started it */
+    struct rusage ru;       /* of the stages reaped so far */
+    uint64_t traced;        /* trace_now() when it was added, 0 if not traced */
+};
+
+struct parjob_t {           /* an item of the parallel builtin */
+    pid_t pid;              /* its job, 0 once reaped */
+    int status;             /* exit status */
+    int fd;                 /* read end of its stdout, -1 at EOF */
+    char *out;              /* the output so far */
+    size_t len, size;
+};
+
+struct test_t {             /* expression of the test builtin being evaluated */
+    char **argv;
+    int argc;
+    int i;                  /* next argument */
+    int err;                /* set on a syntax error */
+};
+
+struct histblock_t {        /* a block of the history index */
+    size_t first;           /* its first entry */
+    uint64_t bits[HISTBITS / 64]; /* hashes of the trigrams of its entries */
+};
+
+struct edit_t {             /* the line editor */
+    char *buf;              /* the line, NUL-terminated */
+    size_t len, size;
+    size_t pos;             /* the cursor, a byte offset of buf */
+    char *shown;            /* the line as it is on the screen */
+    size_t shownlen, shownsize;
+    size_t shownpos;        /* where the cursor is on the screen */
+    const char *prompt;
+    size_t pcols;           /* columns of the prompt */
+    size_t cols;            /* width of the terminal */
+    size_t hist;            /* history entry being edited */
+    size_t nhist;           /* hist_n when the line was started, the new line */
+    char *saved;            /* the new line while the history is browsed */
+    int tabs;               /* Tabs pressed in a row */
+    char *out;              /* escape sequences and text of the next write */
+    size_t outlen, outsize;
+    unsigned char in[256];  /* keys read but not handled yet */
+    size_t instart, inend;
+};
+
+struct frame_t {            /* header of a frame of --serve, in host byte order */
+    uint32_t type;          /* SERVE_ENV, ... */
+    uint32_t id;            /* the request, numbered by the client */
+    uint32_t len;           /* bytes of data after the header */
+};
+
+struct serve_exit_t {       /* data of SERVE_EXIT */
+    int32_t status;         /* exit status of the last command, 128 + signal if killed */
+    int32_t pad;
+    int64_t real_us, user_us, sys_us;
+    int64_t maxrss_kb, minflt, majflt, nvcsw, nivcsw;
+};
+
+struct req_t {              /* a request of a client of --serve */
+    struct conn_t *conn;
+    uint32_t id;
+    char **env;             /* NAME=value overrides */
+    int nenv;
+    char *cwd;
+    pid_t pid;              /* its worker, 0 until SERVE_CMD, -1 once reaped */
+    int out, err;           /* read ends of its stdout and stderr, -1 at EOF */
+    int paused;             /* out and err are not read while the client is behind */
+    int status;
+    struct rusage ru;
+    struct timespec start;
+    struct req_t *next;
+};
+
+struct conn_t {             /* a client of --serve */
+    int fd;                 /* -1 once the client is gone */
+    char *in;               /* frames read but not handled yet */
+    size_t inlen, insize;
+    char *out;              /* frames not sent yet */
+    size_t outlen, outsize;
+    struct req_t *req;      /* its requests */
+    struct conn_t *next;
+};
+
+struct trace_t {            /* an event of the tracer, one cache line */
+    uint64_t seq;           /* its number + 1 once written, 0 while it is written */
+    uint64_t ts;            /* CLOCK_MONOTONIC in ns */
+    int64_t dur;            /* ns, -1 for an instant */
+    const char *name;       /* a string constant: "parse", "fork", ... */
+    pid_t pid;              /* the process it is about, 0 for the shell */
+    int jid;                /* its job, 0 if none yet */
+    char arg[24];           /* program name, status, ... */
+};
+
+struct tracebuf_t {         /* the ring, shared with forked children */
+    uint64_t head;          /* events ever recorded */
+    char pad[56];
+    struct trace_t ev[TRACE_EVENTS];
+};
+
+struct var_t {              /* a shell variable */
+    char *entry;            /* "name=value", what env_vec points to */
+    size_t namelen;
+    int envi;               /* its slot in env_vec, -1 if not exported */
+    struct var_t *next;
+};
+
+struct envsave_t {          /* a slot of env_vec covered by env_overlay() */
+    int slot;
+    char *old;
+};
+
+struct node_t {             /* a node of a compiled script */
+    int type;               /* N_CMD, ... */
+    int line;               /* where it starts */
+    char **argv;            /* NULL-terminated words, see N_CMD, ... */
+    int argc;
+    char *name;
+    int count;              /* of N_BREAK and N_CONTINUE */
+    char **redir;           /* redirections after a compound command, NULL if none */
+    struct node_t *cond, *body, *alt;
+    struct node_t *next;    /* the next command of the list */
 };
-struct job_t jobs[MAXJOBS]; /* The job list */
-struct alias_t *alias_p = NULL;
+
+struct compile_t {          /* state of compile() */
+    char **tok;             /* the words of the lines, tok_newline after each */
+    int *line;              /* line of each word, NULL if there is one line */
+    int i, n;               /* next word, number of words */
+    struct arena_t *a;      /* where the nodes go */
+    const char *file;       /* for errors, NULL if none */
+    struct node_t *err;     /* the first syntax error */
+};
+
+struct script_t {           /* a compiled script file */
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;  /* of the file that was compiled */
+    off_t size;
+    struct arena_t arena;   /* the nodes and words */
+    struct node_t *prog;
+    int compiled;
+    int running;            /* runs in progress, the arena cannot go */
+    struct script_t *next;
+};
+
+struct capture_t {          /* the output of a command substitution being run */
+    char *buf;              /* what was written so far */
+    size_t len, size;
+    int fd;                 /* read end of the pipe on fd 1, -1 until a program is started */
+    int saved;              /* fd 1 of the shell before the pipe */
+    int redirected;         /* redirections of fd 1 applied by the shell itself */
+    pid_t pid;              /* the shell; a forked child writes to its fd 1 */
+    FILE *out;              /* stdout before the substitution */
+    struct capture_t *prev; /* the substitution this one is in */
+};
+
+struct fdwatch_t {          /* callback of a watched file descriptor */
+    void (*func)(int fd, void *arg);
+    void *arg;
+};
+
+struct jobpid_t {           /* entry of the pid -> job index */
+    pid_t pid;
+    int pidfd;              /* in the epoll set, -1 if none */
+    struct job_t *job;
+    struct jobpid_t *next;
+};
+
+struct done_t {             /* a background job that finished, for wait */
+    pid_t pgid;
+    pid_t last;             /* pid of its last stage, what $! was */
+    int jid;
+    int status;
+    int waited;             /* wait has reported it */
+};
+
+struct job_t **jobs;        /* The job list, indexed by jid */
+int maxjobs;                /* room in jobs */
+int topjid = 0;             /* largest allocated job ID */
+int njobs = 0;              /* jobs in the list */
+struct done_t done_ring[NDONE]; /* the last finished background jobs */
+unsigned long ndone = 0;    /* entries ever put in done_ring */
+pid_t last_bg = 0;          /* $!, the last stage of the last background job */
+struct job_t **pgid_hash;   /* pgid -> job */
+int pgid_size;
+struct jobpid_t **pid_hash; /* pid -> job, for every stage */
+int pid_size;
+int npids = 0;
+struct job_t *fgjob = NULL; /* the foreground job */
+int epoll_fd = -1;          /* the event loop */
+int sigchld_fd = -1;        /* signalfd of SIGCHLD */
+int input_ready = 0;        /* stdin cannot be polled and is always ready */
+int input_armed = 0;        /* stdin is polled for input */
+sigset_t child_mask;        /* signal mask of started programs */
+struct fdwatch_t *fd_watch = NULL; /* indexed by fd */
+int nfd_watch = 0;
+struct alias_t *alias_hash[HASHSIZE]; /* name -> alias */
+int nalias = 0;
+struct arena_t cmd_arena;   /* memory of the command line being evaluated */
+char lex_ops[] = "|\0&\0;\0<\0>\0>>\0>&\0<&\0\0|>\0,"; /* text of the operators */
+char lex_special[256];      /* LEX_SPECIAL as a table */
+size_t (*lex_scan)(const char *cmdline, size_t i, size_t len); /* first special character */
+struct hash_t *cmd_hash[HASHSIZE]; /* command name -> path */
+int hist_fd = -1;           /* the history file, opened O_APPEND */
+char *hist_map = NULL;      /* the history file mapped in */
+size_t hist_mapsize = 0;
+size_t hist_len = 0;        /* bytes of it split into entries */
+uint64_t *hist_off = NULL;  /* start of each entry, and hist_len after the last */
+size_t hist_n = 0, hist_max = 0;
+struct histblock_t *hist_block = NULL; /* trigram index, built by the first search */
+size_t hist_nblock = 0, hist_maxblock = 0;
+size_t hist_indexed = 0;    /* entries in the index */
+char **cmd_index = NULL;    /* names of the programs in PATH, sorted */
+size_t ncmd_index = 0, maxcmd_index = 0;
+int cmd_indexed = 0;        /* cmd_index has been built */
+struct termios tty_cooked;  /* the terminal settings outside the line editor */
+int tty_raw = 0;            /* the line editor has the terminal in raw mode */
+int serve_fd = -1;          /* listening socket of --serve */
+struct conn_t *serve_conns = NULL; /* its clients */
+struct var_t *var_hash[HASHSIZE]; /* name -> variable */
+int nvars = 0;
+int vars_loaded = 0;        /* environ has been imported */
+char **env_vec = NULL;      /* envp of programs: the exported variables and a NULL */
+int env_n = 0, env_max = 0;
+char tok_newline[] = "\n";  /* the end of a line in the words given to compile() */
+struct script_t *scripts = NULL; /* compiled script files */
+int loop_depth = 0;         /* loops being run */
+int loop_break = 0;         /* loops a break still has to leave */
+int loop_continue = 0;      /* the same for continue */
+struct capture_t *capture = NULL; /* the innermost command substitution being run */
+long nsubst = 0;            /* command substitutions run, for the status of an assignment */
+int tracing = 0;            /* trace on */
+struct tracebuf_t *trace_buf = NULL; /* mapped by the first trace on */
+char *builtin_names[] = {"quit", "jobs", "bg", "fg", "parallel", "hash", "alias", "history", "echo",
+                         "printf", "test", "[", "cd", "pwd", "true", "false", "export", "unset", "trace",
+                         "source", ".", "wait", NULL};
 /* End global variables */
 
 
@@ -75,34 +521,308 @@ void init(void);
 
 int myStrchr(char *p, char ch);
 
+int conf_parse(char *file, struct conf_t *c, int depth);
+
+void conf_free(struct conf_t *c);
+
+int snap_load(char *file);
+
+void snap_save(char *file, struct conf_t *c);
+
+void path_add(char *dir, int len);
+
+void path_watch(void);
+
+unsigned int strhash(const char *str);
+
+struct hash_t *hash_lookup(char *name, int add);
+
+void hash_check(void);
+
+void hash_remove(char *name);
+
+void hash_reset(void);
+
+int do_hash(char **argv);
+
 void eval(char *cmdline);
 
-int is_pipe(char **argv);
+void eval_argv(char *cmdline);
+
+void eval_words(char **argv, char *cmdline);
+
+void eval_list(char **argv, char *cmdline);
+
+void eval_command(char **argv, int bg, char *cmdline);
+
+char *join_words(char **argv, int bg);
 
-int is_pipe2(char **argv, char **argv1, int *index);
+int is_builtin(char *name);
+
+int count_pipes(char **argv);
+
+int split_pipeline(char **argv, struct stage_t *stage);
+
+int parse_redirs(struct stage_t *stage);
+
+int redir_flags(char *op);
+
+int redirect(struct redir_t *redir, int save);
+
+void unredirect(struct redir_t *redir);
+
+pid_t run_pipeline(struct stage_t *stage, int nstage, int bg, char *cmdline);
+
+pid_t launch(struct stage_t *stage, pid_t pgid, int in, int out);
+
+pid_t fanout_start(int in, int *out, int nout, int *fd, int nfd);
+
+int fanout(int in, int *out, int nout);
 
 int builtin_cmd(char **argv);
 
-void do_bgfg(char **argv);
+int do_bgfg(char **argv);
+
+int do_wait(char **argv);
+
+int do_echo(char **argv);
+
+int do_printf(char **argv);
+
+int unescape(const char *s, int *len);
+
+int do_test(char **argv);
+
+int test_or(struct test_t *t);
 
-void alias_add(char **argv);
+int test_and(struct test_t *t);
+
+int test_not(struct test_t *t);
+
+int test_primary(struct test_t *t);
+
+int test_unary(int op, char *arg);
+
+int test_binary(struct test_t *t, char *a, char *op, char *b);
+
+char **pin_parse(char **argv, struct sched_t *sched);
+
+int cpulist_parse(char *list, cpu_set_t *set);
+
+char *cpulist_format(cpu_set_t *set, char *buf, size_t size);
+
+int sched_apply(pid_t tid, struct sched_t *sched);
+
+int do_pin(char **argv, struct sched_t *sched);
+
+int do_cd(char **argv);
+
+int do_pwd(char **argv);
+
+int do_export(char **argv);
+
+void builtin_error(const char *fmt, ...);
+
+int do_parallel(char **argv);
+
+struct parjob_t *parallel_start(char **cmd, int ncmd, char *arg, int nullin);
+
+void parallel_read(int fd, void *arg);
+
+void parallel_done(struct job_t *job);
+
+int alias_add(char **argv);
 
 void alias_free(void);
 
-void rebulid_command(char **argv);
+struct alias_t *alias_find(char *name);
+
+void alias_define(char *name, char *value);
+
+int alias_load(char *filename);
+
+void alias_parse_line(char *name, char *filename, int lineno);
+
+void rebulid_command(char ***argvp);
 
 int is_accessable(char **argv);
 
 void waitfg(pid_t pid);
 
-void sigchld_handler(int sig);
+void var_init(void);
+
+struct var_t *var_lookup(const char *name, size_t n);
+
+char *var_get(const char *name);
+
+void var_set(const char *name, size_t n, const char *value, int flags);
+
+int var_assign(const char *word, int flags);
+
+int var_export(const char *name);
+
+void var_unset(const char *name);
+
+size_t var_name_len(const char *s);
+
+int is_assignment(const char *word);
+
+char **var_push(char **assign, int n);
+
+void var_pop(char **assign, int n, char **old);
+
+char **var_envp(void);
+
+void env_overlay(char **assign, int n, struct envsave_t *save);
+
+void env_restore(int n, struct envsave_t *save);
+
+char **expand_words(char **argv);
+
+char *subst(const char *text, size_t n);
+
+void capture_pipe(void);
+
+void capture_read(int fd, void *arg);
+
+int do_unset(char **argv);
+
+int is_compound(char **argv);
+
+struct node_t *compile(char **tok, int *line, int n, struct arena_t *a, const char *file);
+
+struct node_t *compile_text(const char *text, size_t len, struct arena_t *a, const char *file);
+
+void run_node(struct node_t *n);
+
+void run_list(struct node_t *n);
+
+int do_source(char **argv);
+
+void hist_open(void);
+
+void hist_sync(void);
+
+void hist_add(const char *line);
+
+char *hist_entry(size_t i, size_t *len);
+
+void hist_index(void);
+
+long hist_search(const char *q, long before);
+
+int do_history(char **argv);
+
+void cmdindex_build(void);
+
+void cmdindex_update(char *name);
+
+void cmdindex_free(void);
+
+size_t cmdindex_lower(const char *name);
+
+char *edit_line(const char *prompt);
+
+void edit_restore(void);
+
+void edit_refresh(struct edit_t *ed);
+
+void edit_prompt(struct edit_t *ed, const char *prompt);
+
+int edit_key(struct edit_t *ed);
+
+int edit_search(struct edit_t *ed);
+
+void edit_complete(struct edit_t *ed);
+
+void serve(char *path);
+
+void serve_accept(int fd, void *arg);
+
+void serve_conn(int fd, void *arg);
+
+void serve_frame(struct conn_t *c, struct frame_t *f, char *data);
+
+void serve_start(struct req_t *r, char *cmd, size_t len);
+
+void serve_output(int fd, void *arg);
+
+void serve_done(struct job_t *job);
+
+void serve_finish(struct req_t *r);
+
+void serve_queue(struct conn_t *c, uint32_t type, uint32_t id, const void *data, size_t len);
+
+void serve_flush(struct conn_t *c);
+
+void serve_pause(struct conn_t *c, int pause);
+
+void serve_close(struct conn_t *c);
+
+uint64_t trace_now(void);
+
+void trace_span(const char *name, uint64_t start, pid_t pid, int jid, const char *arg);
+
+void trace_mark(const char *name, pid_t pid, int jid, const char *arg);
+
+long trace_dump(char *file);
+
+int do_trace(char **argv);
+
+void events_init(void);
+
+void events_reset(void);
+
+int watchpid(pid_t pid);
+
+int event_wait(int input);
+
+void watchfd(int fd, void (*func)(int fd, void *arg), void *arg);
+
+void watchfd_write(int fd, int on);
+
+void unwatchfd(int fd);
+
+void reap(void);
+
+double timespec_diff(struct timespec *a, struct timespec *b);
+
+double timeval_sec(struct timeval *tv);
+
+void rusage_add(struct rusage *a, struct rusage *b);
+
+void rusage_sub(struct rusage *a, struct rusage *b);
+
+void print_time(char *label, double real, struct rusage *ru, char *name);
+
+void report_time(struct job_t *job);
+
+char *getcmdline(void);
+
+void eval_lines(const char *text, size_t len);
+
+int run_script(char *filename);
 
 void sigtstp_handler(int sig);
 
 void sigint_handler(int sig);
 
 /* Here are helper routines that we've provided for you */
-int parseline(const char *cmdline, char **argv);
+int parseline(const char *cmdline, char ***argvp);
+
+void lex_init(void);
+
+void *arena_alloc(struct arena_t *a, size_t n);
+
+void *arena_grow(struct arena_t *a, void *p, size_t old, size_t n);
+
+char *arena_strndup(struct arena_t *a, const char *s, size_t n);
+
+struct arena_mark_t arena_mark(struct arena_t *a);
+
+void arena_release(struct arena_t *a, struct arena_mark_t m);
+
+void arena_free(struct arena_t *a);
 
 void sigquit_handler(int sig);
 
@@ -114,7 +834,11 @@ int maxjid(void);
 
 int addjob(pid_t pid, pid_t pgid, int state, char *cmdline);
 
-int deletejob(pid_t pid);
+int deletejob(pid_t pgid);
+
+int deletepid(pid_t pid);
+
+void setjobstate(struct job_t *job, int state);
 
 pid_t fgpgid(void);
 
@@ -122,6 +846,8 @@ struct job_t *getjobpid(pid_t pid);
 
 struct job_t *getjobjid(int jid);
 
+struct job_t *getjobpgid(pid_t pgid);
+
 int pid2jid(pid_t pid);
 
 void listjobs(void);
@@ -154,21 +880,31 @@ Note by caizi
 
 
 
+/* CaiShell-bench.c includes this file for the functions below */
+#ifndef CAISHELL_NO_MAIN
 /*
  * main - The shell's main routine 
  */
 int main(int argc, char **argv) {
     char c;
-    char cmdline[MAXLINE + 1];
+    char *cmdline;
+    char *command = NULL; /* -c argument */
+    char *script = NULL;  /* script file argument */
+    char *serve_path = NULL; /* --serve socket */
+    static struct option longopts[] = {
+        {"serve", required_argument, NULL, 'S'},
+        {NULL, 0, NULL, 0}
+    };
     int emit_prompt = 1; /* emit prompt (default) */
 	int pid,ffd;
+    int editing;          /* read lines with the line editor */
     /* Redirect stderr to stdout (so that driver will get all output
      * on the pipe connected to stdout) */
     dup2(1, 2);
     atexit(alias_free);  /* set the free when exit */
 
     /* Parse the command line */
-    while ((c = getopt(argc, argv, "hvp")) != EOF) {
+    while ((c = getopt_long(argc, argv, "hvpc:f:", longopts, NULL)) != EOF) {
         switch (c) {
             case 'h':             /* print help message */
                 usage();
@@ -179,31 +915,54 @@ int main(int argc, char **argv) {
             case 'p':             /* don't print a prompt */
                 emit_prompt = 0;  /* handy for automatic testing */
                 break;
+            case 'c':             /* run the commands given as argument */
+                command = optarg;
+                break;
+            case 'f':             /* config file instead of myconf */
+                conf_file = optarg;
+                break;
+            case 'S':             /* run the requests of clients */
+                serve_path = optarg;
+                break;
             default:
                 usage();
         }
     }
 
-    /* Create a new section */
-    if ((pid = fork()) < 0)
-        app_error("Create Shell failed!");
-    else if( pid != 0) 
-        exit(0);
-	
-    setsid();
+    if (command == NULL && serve_path == NULL && optind < argc)
+        script = argv[optind];
 
-	if((ffd = open("/dev/tty",O_RDWR))<0)
-	{
-		app_error("open the terminal fail");
-	}
+    /* Create a new section, only for an interactive shell: a script or
+     * -c run from cron must stay the process its caller waits for */
+    if (command == NULL && script == NULL && serve_path == NULL && isatty(STDIN_FILENO)) {
+        if ((pid = fork()) < 0)
+            app_error("Create Shell failed!");
+        else if( pid != 0) 
+            exit(0);
+
+        setsid();
+
+        /* The new session has no controlling terminal, the line editor
+         * works on stdin all the same */
+        if((ffd = open("/dev/tty",O_RDWR))<0 && verbose)
+        {
+            printf("open the terminal fail\n");
+        }
+    }
     /* Initialize the environment*/
     init();
+    /* Only a shell reading stdin lives long enough for the PATH watch to
+     * pay off: closing an inotify fd costs milliseconds at exit */
+    if (command == NULL && script == NULL) {
+        path_watch();
+        if (serve_path == NULL)
+            hist_open();
+    }
     /* Install the signal handlers */
 
     /* These are the ones you will need to implement */
     Signal(SIGINT, SIG_IGN);   /* ctrl-c */
     Signal(SIGTSTP, SIG_IGN);  /* ctrl-z */
-    Signal(SIGCHLD, sigchld_handler);  /* Terminated or stopped child */
 
     /* This one provides a clean way to kill the shell */
     Signal(SIGQUIT, SIG_IGN);
@@ -211,24 +970,44 @@ int main(int argc, char **argv) {
     /* Initialize the job list */
     initjobs();
 
+    /* Terminated or stopped children are read from a signalfd */
+    events_init();
+
+    /* Non-interactive modes */
+    if (command != NULL) {
+        eval_lines(command, strlen(command));
+        exit(last_status);
+    }
+    if (script != NULL)
+        exit(run_script(script));
+    if (serve_path != NULL)
+        serve(serve_path);
+
+    /* Lines typed at a terminal are read with the line editor */
+    editing = isatty(STDIN_FILENO) && isatty(STDOUT_FILENO) &&
+              (var_get("TERM") == NULL || strcmp(var_get("TERM"), "dumb"));
+
     /* Execute the shell's read/eval loop */
     while (1) {
 
         /* Read command line */
-        if (emit_prompt) {
-            printf("%s", prompt);
+        if (editing) {
             fflush(stdout);
+            cmdline = edit_line(emit_prompt ? prompt : "");
+        } else {
+            if (emit_prompt) {
+                printf("%s", prompt);
+                fflush(stdout);
+            }
+            cmdline = getcmdline();
         }
-        if ((fgets(cmdline, MAXLINE + 1, stdin) == NULL) && ferror(stdin))
-            app_error("fgets error");
-        if (strlen(cmdline) == MAXLINE + 1)
-            app_error("too long command");
-        if (feof(stdin)) { /* End of file (ctrl-d) */
+        if (cmdline == NULL) { /* End of file (ctrl-d) */
             fflush(stdout);
             exit(0);
         }
 
         /* Evaluate the command line */
+        hist_add(cmdline);
         eval(cmdline);
         fflush(stdout);
         fflush(stdout);
@@ -236,6 +1015,7 @@ int main(int argc, char **argv) {
 
     exit(0); /* control never reaches here */
 }
+#endif /* CAISHELL_NO_MAIN */
 
 /*
 *	find the index of the ch in the string
@@ -254,169 +1034,630 @@ int myStrchr(char *p, char ch) {
 
 /*
  * initialize the environment of PATH
+ *
+ * The config file is conf_file (-f), else $CAISHELL_CONF, else myconf.
+ * What it sets is kept in a binary snapshot next to it (myconf.snap),
+ * which a later start maps in and applies without parsing anything, as
+ * long as every file it came from still has the same mtime and size.
  */
 void init(void) {
-    char *EnviromentPATH = "myconf";
-    char bashrcLine[MAXLINE], *buf, *delim;
-    int argc, index;
-
-    memset(PATH, 0, sizeof(char) * MAXLINE * MAXARGS);
+    char *conf = conf_file ? conf_file : var_get("CAISHELL_CONF") ? var_get("CAISHELL_CONF") : "myconf";
+    char snap[PATH_MAX];
+    struct conf_t c;
+
+    npath = 0; /* PATH is in bss and still zero, no need to clear 128K of it */
+
+    snprintf(snap, sizeof(snap), "%s.snap", conf);
+    if (!snap_load(snap)) {
+        memset(&c, 0, sizeof(c));
+        if (conf_parse(conf, &c, 0))
+            snap_save(snap, &c);
+        conf_free(&c);
+    }
 
-    FILE *file = fopen(EnviromentPATH, "r");
-    if (file == NULL)
+    if (npath == 0)
         fprintf(stdout, "Fail to initialize the environment PATH!\n");
 
-    argc = 0;
-    while (fgets(bashrcLine, MAXLINE, file)) {
-        /* Find the key word PATH*/
+    fflush(stdout);
+}
+
+/*
+ * conf_parse - Parse a config file into the shell, noting in c the
+ *     files read and the variables set, for the snapshot. Lines are
+ *         PATH=dir1:dir2   PIPESIZE=bytes   LAUNCHER=spawn|fork
+ *         alias name=command   include file   NAME=value
+ *     with an optional "export" before the assignments. An included
+ *     file is relative to the file including it. Returns 0 if file
+ *     cannot be read.
+ */
+int conf_parse(char *file, struct conf_t *c, int depth) {
+    char bashrcLine[MAXLINE], *buf;
+    int index, lineno = 0;
+    struct stat st;
+    FILE *fp;
+
+    if (depth > 8) {
+        fprintf(stderr, "%s: includes nested too deep\n", file);
+        return 0;
+    }
+    if ((fp = fopen(file, "r")) == NULL || fstat(fileno(fp), &st) < 0) {
+        if (fp != NULL)
+            fclose(fp);
+        if (depth == 0)
+            return 0;
+        fprintf(stderr, "%s: %s\n", file, strerror(errno));
+        memset(&st, 0, sizeof(st));
+        st.st_size = -1; /* the snapshot is stale once it appears */
+    }
+    if (c->nsrc % 8 == 0) {
+        c->src = (char **) realloc(c->src, (c->nsrc + 8) * sizeof(char *));
+        c->srcst = (struct stat *) realloc(c->srcst, (c->nsrc + 8) * sizeof(struct stat));
+    }
+    if ((c->src[c->nsrc] = realpath(file, NULL)) == NULL)
+        c->src[c->nsrc] = strdup(file);
+    c->srcst[c->nsrc++] = st;
+    if (fp == NULL)
+        return 0;
+
+    while (fgets(bashrcLine, MAXLINE, fp)) {
+        lineno++;
+        bashrcLine[strcspn(bashrcLine, "\r\n")] = '\0';
         buf = bashrcLine;
-        while (*buf && (*buf == ' ')) buf++;/* ignore leading spaces */
-        char *p = strstr(buf, "export");
-        if (p != NULL) {
-            buf = p + 6;
-            while (*buf && (*buf == ' ')) buf++;
-        }
+        while (*buf && (*buf == ' ' || *buf == '\t')) buf++;/* ignore leading spaces */
+        if (*buf == '\0' || *buf == '#')
+            continue;
 
-        if (buf[0] != 'P' || (buf = strstr(buf, "PATH=")) == NULL) continue;
+        if (!strncmp(buf, "include", 7) && (buf[7] == ' ' || buf[7] == '\t')) {
+            char inc[PATH_MAX], *name = buf + 8 + strspn(buf + 8, " \t"), *slash = strrchr(file, '/');
 
-        /* Fill the PATH array*/
-        buf = buf + 5;
-        index = myStrchr(buf, ':');
+            if (name[0] == '/' || slash == NULL)
+                snprintf(inc, sizeof(inc), "%s", name);
+            else
+                snprintf(inc, sizeof(inc), "%.*s/%s", (int) (slash - file), file, name);
+            conf_parse(inc, c, depth + 1);
+            continue;
+        }
+        if (!strncmp(buf, "alias", 5) && (buf[5] == ' ' || buf[5] == '\t')) {
+            alias_parse_line(buf, file, lineno);
+            continue;
+        }
+        if (!strncmp(buf, "export", 6) && (buf[6] == ' ' || buf[6] == '\t'))
+            buf += 7 + strspn(buf + 7, " \t");
 
-        while (index != -1) {
-            if (index != 0)
-                strncpy(PATH[argc++], buf, index);
-            buf = buf + index + 1;
-            //while (*buf && (*buf == ' ')) /* ignore spaces */
-            //	   buf++;
-            index = myStrchr(buf, ':');
+        if (!strncmp(buf, "PIPESIZE=", 9)) { /* buffer size of pipeline pipes */
+            pipe_size = atoi(buf + 9);
+            continue;
+        }
+        if (!strncmp(buf, "LAUNCHER=", 9)) { /* spawn or fork */
+            launcher = strncmp(buf + 9, "fork", 4) ? LAUNCH_SPAWN : LAUNCH_FORK;
+            continue;
         }
-        if (*buf != '\0')
-            strncpy(PATH[argc++], buf, strlen(buf) - 1);
-        //index = myStrchr(PATH[argc-1],'\"');
-        //PATH[argc-1][index] = NULL;
-    }
 
-    /* test the PATH
-    int i = 0;
-    while (PATH[i][0] != '\0')
-    {
-        fprintf(stdout, "%s/:",PATH[i]);
+        if (!strncmp(buf, "PATH=", 5)) {
+            /* Fill the PATH array*/
+            buf = buf + 5;
+            index = myStrchr(buf, ':');
 
-        i++;
-    }*/
+            while (index != -1) {
+                path_add(buf, index);
+                buf = buf + index + 1;
+                index = myStrchr(buf, ':');
+            }
+            path_add(buf, strlen(buf));
+            continue;
+        }
 
-    if (PATH[0][0] == '\0')
-        fprintf(stdout, "Fail to initialize the environment PATH!\n");
+        /* any other NAME=value is an exported variable */
+        if (is_assignment(buf)) {
+            if (c->nvar % 8 == 0)
+                c->var = (char **) realloc(c->var, (c->nvar + 8) * sizeof(char *));
+            c->var[c->nvar++] = strdup(buf);
+            var_assign(buf, VAR_EXPORT);
+            continue;
+        }
+        fprintf(stderr, "%s:%d: unknown setting\n", file, lineno);
+    }
+    fclose(fp);
+    return 1;
+}
 
+/* conf_free - Free what conf_parse noted */
+void conf_free(struct conf_t *c) {
+    for (int i = 0; i < c->nsrc; i++)
+        free(c->src[i]);
+    for (int i = 0; i < c->nvar; i++)
+        free(c->var[i]);
+    free(c->src);
+    free(c->srcst);
+    free(c->var);
+}
 
-    fflush(stdout);
+/* snap_str - The string at *p of a snapshot ending at end, NULL if it is cut */
+static const char *snap_str(const char **p, const char *end) {
+    const char *s = *p, *nul = (s < end) ? memchr(s, '\0', end - s) : NULL;
+
+    if (nul == NULL)
+        return NULL;
+    *p = nul + 1;
+    return s;
 }
 
 /*
- *  judge if the cmdline contain pipe
+ * snap_load - Apply the config snapshot in file if it is still valid:
+ *     every file it was made from must have the mtime and the size
+ *     noted in it. Returns 0 if it is missing, stale or damaged, and
+ *     nothing has been applied then.
  */
-int is_pipe(char **argv) {
-    for (int i = 0; argv[i] != NULL; i++)
-        if (!strcmp(argv[i], "|"))
-            return 1;
+int snap_load(char *file) {
+    const struct snap_t *h;
+    const struct snapsrc_t *src;
+    const char *data, *p, *end, *s, *v;
+    struct stat st;
+    int fd, ok = 0;
+    size_t nstr;
+
+    if ((fd = open(file, O_RDONLY | O_CLOEXEC)) < 0)
+        return 0;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(struct snap_t) ||
+        (data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return 0;
+    }
+    close(fd);
+
+    h = (const struct snap_t *) data;
+    end = data + st.st_size;
+    src = (const struct snapsrc_t *) (h + 1);
+    /* nsrc is checked before the pointer past the table is formed */
+    if (memcmp(h->magic, SNAP_MAGIC, sizeof(h->magic)) || h->size != (uint64_t) st.st_size ||
+        h->nsrc > (uint64_t) (end - (const char *) src) / sizeof(struct snapsrc_t))
+        goto out;
+    p = (const char *) (src + h->nsrc);
+
+    /* every string must be there before anything is applied */
+    nstr = (size_t) h->nsrc + h->npath + 2 * (size_t) h->nalias + h->nvar;
+    for (size_t i = 0; i < nstr; i++)
+        if (snap_str(&p, end) == NULL)
+            goto out;
+
+    p = (const char *) (src + h->nsrc);
+    for (uint32_t i = 0; i < h->nsrc; i++) {
+        s = snap_str(&p, end);
+        if (stat(s, &st) < 0)
+            st.st_size = -1, st.st_mtim.tv_sec = st.st_mtim.tv_nsec = 0;
+        if (st.st_size != src[i].size ||
+            st.st_mtim.tv_sec != src[i].mtime_sec || st.st_mtim.tv_nsec != src[i].mtime_nsec)
+            goto out;
+    }
+
+    for (uint32_t i = 0; i < h->npath; i++) {
+        s = snap_str(&p, end);
+        path_add((char *) s, strlen(s));
+    }
+    for (uint32_t i = 0; i < h->nalias; i++) {
+        s = snap_str(&p, end);
+        v = snap_str(&p, end);
+        alias_define((char *) s, (char *) v);
+    }
+    for (uint32_t i = 0; i < h->nvar; i++)
+        var_assign(snap_str(&p, end), VAR_EXPORT);
+    pipe_size = h->pipe_size;
+    launcher = h->launcher;
+    ok = 1;
+    if (verbose)
+        printf("config: %s\n", file);
+out:
+    munmap((void *) data, end - data);
+    return ok;
+}
+
+/*
+ * snap_save - Write the config the shell has now into the snapshot
+ *     file. It is written aside and renamed over, so a shell starting at
+ *     the same time sees the old snapshot or the new one, never half of
+ *     one. A snapshot that cannot be written is only skipped.
+ */
+void snap_save(char *file, struct conf_t *c) {
+    struct snap_t h;
+    struct snapsrc_t src;
+    char tmp[PATH_MAX + 32], *data;
+    size_t size;
+    FILE *fp;
+    int fd;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAP_MAGIC, sizeof(h.magic));
+    h.nsrc = c->nsrc;
+    h.npath = npath;
+    h.nalias = nalias;
+    h.nvar = c->nvar;
+    h.pipe_size = pipe_size;
+    h.launcher = launcher;
+
+    if ((fp = open_memstream(&data, &size)) == NULL)
+        return;
+    fwrite(&h, sizeof(h), 1, fp);
+    for (int i = 0; i < c->nsrc; i++) {
+        memset(&src, 0, sizeof(src));
+        src.mtime_sec = c->srcst[i].st_mtim.tv_sec;
+        src.mtime_nsec = c->srcst[i].st_mtim.tv_nsec;
+        src.size = c->srcst[i].st_size;
+        fwrite(&src, sizeof(src), 1, fp);
+    }
+    for (int i = 0; i < c->nsrc; i++)
+        fwrite(c->src[i], strlen(c->src[i]) + 1, 1, fp);
+    for (int i = 0; i < npath; i++)
+        fwrite(PATH[i], strlen(PATH[i]) + 1, 1, fp);
+    for (int i = 0; i < HASHSIZE; i++)
+        for (struct alias_t *a = alias_hash[i]; a != NULL; a = a->next) {
+            fwrite(a->name, strlen(a->name) + 1, 1, fp);
+            fwrite(a->value, strlen(a->value) + 1, 1, fp);
+        }
+    for (int i = 0; i < c->nvar; i++)
+        fwrite(c->var[i], strlen(c->var[i]) + 1, 1, fp);
+    fclose(fp);
+    ((struct snap_t *) data)->size = size;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", file, (int) getpid());
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644)) >= 0) {
+        if (write(fd, data, size) == (ssize_t) size && close(fd) == 0)
+            fd = -1;
+        else
+            close(fd);
+        if (fd >= 0 || rename(tmp, file) < 0)
+            unlink(tmp);
+    } else if (verbose)
+        printf("%s: %s\n", tmp, strerror(errno));
+    free(data);
+}
+
+/*
+ * path_add - append a directory to PATH, dropping empty and duplicate
+ *     entries so a command lookup never probes the same directory twice
+ */
+void path_add(char *dir, int len) {
+    if (len <= 0 || len >= MAXLINE || npath >= MAXARGS)
+        return;
+    for (int i = 0; i < npath; i++)
+        if (!strncmp(PATH[i], dir, len) && PATH[i][len] == '\0')
+            return;
+    strncpy(PATH[npath], dir, len);
+    PATH[npath][len] = '\0';
+    path_wd[npath++] = -1;
+}
+
+/*
+ * path_watch - watch the PATH directories, so the command hash is only
+ *     invalidated when one of them really changes
+ */
+void path_watch(void) {
+    if (inotify_fd < 0 && (inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+        if (verbose)
+            printf("inotify_init1: %s\n", strerror(errno));
+        return;
+    }
+    for (int i = 0; i < npath; i++)
+        path_wd[i] = inotify_add_watch(inotify_fd, PATH[i],
+                                       IN_CREATE | IN_DELETE | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO |
+                                       IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+}
+
+/*
+ * eval_lines - Evaluate every line of a block of text. Lines starting
+ *     with '#' (like the #! of a script) are comments. The text is
+ *     compiled at once, so if, while, ... may span lines.
+ */
+void eval_lines(const char *text, size_t len) {
+    struct arena_mark_t mark = arena_mark(&cmd_arena);
+
+    run_list(compile_text(text, len, &cmd_arena, NULL));
+    arena_release(&cmd_arena, mark);
+    fflush(stdout);
+}
+
+/*
+ * run_script - Evaluate a script file. The file is mapped in and
+ *     compiled into an arena of its own, which is kept: running the
+ *     same file again while it is unchanged, as source does, reuses the
+ *     compiled script. Returns the exit status of the last command.
+ */
+int run_script(char *filename) {
+    struct stat st;
+    struct script_t *s;
+    char *text;
+    int fd;
+
+    if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return 127;
+    }
+
+    for (s = scripts; s != NULL; s = s->next)
+        if (s->dev == st.st_dev && s->ino == st.st_ino)
+            break;
+    if (s != NULL && s->compiled && (s->size != st.st_size || s->mtime.tv_sec != st.st_mtim.tv_sec ||
+                                     s->mtime.tv_nsec != st.st_mtim.tv_nsec)) {
+        if (s->running > 0) { /* changed while it runs: the old one stays for it */
+            s = NULL;
+        } else {
+            arena_free(&s->arena);
+            s->compiled = 0;
+        }
+    }
+    if (s == NULL) {
+        s = (struct script_t *) calloc(1, sizeof(struct script_t));
+        s->dev = st.st_dev;
+        s->ino = st.st_ino;
+        s->next = scripts;
+        scripts = s;
+    }
+
+    if (!s->compiled) {
+        s->prog = NULL;
+        if (st.st_size > 0) {
+            if ((text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+                fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+                close(fd);
+                return 126;
+            }
+            madvise(text, st.st_size, MADV_SEQUENTIAL);
+            s->prog = compile_text(text, st.st_size, &s->arena, filename);
+            munmap(text, st.st_size);
+        }
+        s->mtime = st.st_mtim;
+        s->size = st.st_size;
+        s->compiled = 1;
+    }
+    close(fd);
+
+    s->running++;
+    run_list(s->prog);
+    s->running--;
+    fflush(stdout);
+    return last_status;
+}
+
+/*
+ *  judge if the command is run by builtin_cmd
+ */
+int is_builtin(char *name) {
+    for (int i = 0; builtin_names[i] != NULL; i++)
+        if (!strcmp(name, builtin_names[i]))
+            return 1;
 
     return 0;
 }
 
 /*
-* use the alias list to rebulid the command
+ *  count the pipes of the cmdline, |> and its commas included
+ */
+int count_pipes(char **argv) {
+    int n = 0;
+
+    for (int i = 0; argv[i] != NULL; i++)
+        if (argv[i] == OP_PIPE || argv[i] == OP_FANOUT || argv[i] == OP_COMMA)
+            n++;
+
+    return n;
+}
+
+/*
+* use the alias table to rebulid the command
+*
+* Every word in command position (the first one and the one after a
+* |, ; or &) that names an alias is replaced by the words of the alias, which
+* were split once when the alias was defined. The tail of argv is moved
+* once per expansion. The first word of an expansion is expanded again,
+* except for an alias that is already being expanded, so alias ls =
+* 'ls -F' or a loop of aliases stops. argv is moved to a larger vector
+* of cmd_arena when the expansions need more room.
 */
-void rebulid_command(char **argv) {
+void rebulid_command(char ***argvp) {
+    struct expansion_t {
+        struct alias_t *alias;
+        int end;                /* first word after its expansion */
+    } *stack = NULL;
     struct alias_t *p;
-    int argc = 0, argcM = 0;
-    char *delim;
-    static char array[MAXLINE];
-
-    while (argv[argc] != NULL) argcM++;
-    while (argv[argc] != NULL || strcmp(argv[argc], "|")) argc++;
-
-    p = alias_p;
-    while (p != NULL) {
-        if (!strcmp(p->new_command, argv[0])) {
-            /* Build the argv list */
-            char *buf = array;
-            stpcpy(buf, p->old_command);
-
-            buf[strlen(buf)] = ' ';
-
-            while (*buf && (*buf == ' ')) /* ignore leading spaces */
-                buf++;
-
-            delim = strchr(buf, ' ');
-            argv[0] = buf;
-            *delim = '\0';
-            buf = delim + 1;
-            while (*buf && (*buf == ' ')) /* ignore leading spaces */
-                buf++;
-            delim = strchr(buf, ' ');
-            while (delim) {
-                if (argc == argcM) {
-                    argv[argc++] = buf;
-                    argcM++;
-                } else {
-                    for (int temp = argcM; temp >= argc; temp--)
-                        argv[temp + 1] = argv[temp];
+    char **argv = *argvp;
+    int argc = 0, maxargc, depth = 0, maxdepth = 0, cmdpos = 1;
 
-                    argcM++;
-                    argv[argc++] = buf;
-                }
+    if (nalias == 0)
+        return;
+    while (argv[argc] != NULL) argc++;
+    maxargc = argc;
+
+    for (int i = 0; argv[i] != NULL;) {
+        while (depth > 0 && i >= stack[depth - 1].end)
+            stack[--depth].alias->expanding = 0;
+
+        if (cmdpos && (p = alias_find(argv[i])) != NULL && !p->expanding) {
+            if (argc - 1 + p->argc > maxargc) {
+                int n = 2 * maxargc > argc + p->argc ? 2 * maxargc : argc + p->argc;
+                argv = (char **) arena_grow(&cmd_arena, argv, (maxargc + 1) * sizeof(char *),
+                                            (n + 1) * sizeof(char *));
+                maxargc = n;
+            }
+            if (depth == maxdepth) {
+                maxdepth = maxdepth ? 2 * maxdepth : 8;
+                stack = (struct expansion_t *) arena_grow(&cmd_arena, stack, depth * sizeof(*stack),
+                                                          maxdepth * sizeof(*stack));
+            }
+            /* splice the expansion in place of the word */
+            memmove(&argv[i + p->argc], &argv[i + 1], (argc - i) * sizeof(char *));
+            memcpy(&argv[i], p->argv, p->argc * sizeof(char *));
+            argc += p->argc - 1;
+            for (int k = 0; k < depth; k++)
+                stack[k].end += p->argc - 1;
+            p->expanding = 1;
+            stack[depth].alias = p;
+            stack[depth++].end = i + p->argc;
+            continue;
+        }
+        cmdpos = (argv[i] == OP_PIPE || argv[i] == OP_SEMI || argv[i] == OP_AMP ||
+                  argv[i] == OP_FANOUT || argv[i] == OP_COMMA ||
+                  (cmdpos && !strcmp(argv[i], "time")));
+        i++;
+    }
+    while (depth > 0)
+        stack[--depth].alias->expanding = 0;
+
+    *argvp = argv;
+}
+
+/*
+ * strhash - FNV-1a hash of a string
+ */
+unsigned int strhash(const char *str) {
+    unsigned int h = 2166136261u;
+
+    while (*str) {
+        h ^= (unsigned char) *str++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ * hash_lookup - find the path of a command in the hash table. If it is
+ *     not there and add is set, search PATH and remember the result.
+ *     Returns NULL if the command is not found.
+ */
+struct hash_t *hash_lookup(char *name, int add) {
+    unsigned int h = strhash(name) % HASHSIZE;
+    struct hash_t *p;
+    char path[MAXLINE];
+
+    for (p = cmd_hash[h]; p != NULL; p = p->next)
+        if (!strcmp(p->name, name))
+            return p;
+    if (!add)
+        return NULL;
+
+    for (int i = 0; i < npath; i++) {
+        if (snprintf(path, MAXLINE, "%s/%s", PATH[i], name) >= MAXLINE)
+            continue;
+        if (access(path, X_OK) != -1) {
+            p = (struct hash_t *) malloc(sizeof(struct hash_t));
+            p->name = strdup(name);
+            p->path = strdup(path);
+            p->hits = 0;
+            p->next = cmd_hash[h];
+            cmd_hash[h] = p;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * hash_check - drain the inotify events of the PATH directories and
+ *     forget the commands they touch, updating the completion index
+ *     with them. A directory that is removed or renamed drops both.
+ */
+void hash_check(void) {
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    ssize_t n;
 
-                *delim = '\0';
-                buf = delim + 1;
-                while (*buf && (*buf == ' ')) /* ignore spaces */
-                    buf++;
-                delim = strchr(buf, ' ');
+    if (inotify_fd < 0)
+        return;
+    while ((n = read(inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len) {
+            ev = (struct inotify_event *) p;
+            if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED | IN_Q_OVERFLOW)) {
+                hash_reset();
+                cmdindex_free();
+            } else if (ev->len > 0) {
+                hash_remove(ev->name);
+                cmdindex_update(ev->name);
             }
-            if (argc == argcM)
-                argv[argc] = NULL;
+        }
+    }
+}
 
-            break;
+/*
+ * hash_remove - forget one command
+ */
+void hash_remove(char *name) {
+    struct hash_t **pp = &cmd_hash[strhash(name) % HASHSIZE];
+
+    for (struct hash_t *p = *pp; p != NULL; pp = &p->next, p = p->next) {
+        if (!strcmp(p->name, name)) {
+            *pp = p->next;
+            free(p->name);
+            free(p->path);
+            free(p);
+            return;
+        }
+    }
+}
 
-        } else
-            p = p->next;
+/*
+ * hash_reset - forget all commands
+ */
+void hash_reset(void) {
+    for (int i = 0; i < HASHSIZE; i++) {
+        while (cmd_hash[i] != NULL) {
+            struct hash_t *p = cmd_hash[i]->next;
+            free(cmd_hash[i]->name);
+            free(cmd_hash[i]->path);
+            free(cmd_hash[i]);
+            cmd_hash[i] = p;
+        }
     }
+}
 
-    if (argc != argcM)
-        rebulid_command(&argv[argc]);
-    return;
+/*
+ * do_hash - Execute the builtin hash command
+ *     hash            list the remembered commands
+ *     hash -r         forget all remembered commands
+ *     hash name ...   look the names up now and remember them
+ */
+int do_hash(char **argv) {
+    int status = 0;
+
+    hash_check();
+
+    if (argv[1] == NULL) {
+        printf("hits\tcommand\n");
+        for (int i = 0; i < HASHSIZE; i++)
+            for (struct hash_t *p = cmd_hash[i]; p != NULL; p = p->next)
+                printf("%4d\t%s\n", p->hits, p->path);
+        return 0;
+    }
+    if (!strcmp(argv[1], "-r")) {
+        hash_reset();
+        return 0;
+    }
+    for (int i = 1; argv[i] != NULL && argv[i] != OP_PIPE; i++)
+        if (strchr(argv[i], '/') == NULL && hash_lookup(argv[i], 1) == NULL) {
+            printf("hash: %s: not found\n", argv[i]);
+            status = 1;
+        }
+    return status;
 }
 
 /*
-* if the file executable
+* if the file executable, resolve argv[0] of one pipeline stage
 */
 int is_accessable(char **argv) {
-    int argc = 0;
-    static char argv0[MAXLINE];
-
-    if (access(argv[0], X_OK) != -1 && argv[0][0] == '.' && argv[0][1] == '/') {
-        while (argv[argc] != NULL || strcmp(argv[argc], "|"))
-            argc++;
-        if (argv[argc] != NULL)
-            return is_accessable(&argv[argc + 1]);
-        else
-            return 1;
-    }
+    struct hash_t *p;
 
-    for (int i = 0; i < MAXARGS && PATH[i][0] != '\0'; i++) {
-        strcpy(argv0, PATH[i]);
-        int len = strlen(argv0);
-        argv0[len] = '/';
-        strcpy(&argv0[len + 1], argv[0]);
-        if (access(argv0, X_OK) != -1) {
-            argv[0] = argv0;
-            while (argv[argc] != NULL || strcmp(argv[argc], "|"))
-                argc++;
-            if (argv[argc] != NULL)
-                return is_accessable(&argv[argc + 1]);
-            else
-                return 1;
+    /* a path is run as it is */
+    if (strchr(argv[0], '/') != NULL) {
+        if (access(argv[0], X_OK) != -1)
+            return 1;
+    } else if ((p = hash_lookup(argv[0], 1)) != NULL) {
+        /* unwatched, an entry is checked before use like bash does */
+        if (inotify_fd < 0 && p->hits > 0 && access(p->path, X_OK) < 0) {
+            hash_remove(argv[0]);
+            return is_accessable(argv);
         }
+        p->hits++;
+        argv[0] = p->path;
+        return 1;
     }
     fprintf(stderr, "%s: Command not found\n", argv[0]);
     return 0;
@@ -435,712 +1676,5876 @@ int is_accessable(char **argv) {
  * when we type ctrl-c (ctrl-z) at the keyboard.  
 */
 void eval(char *cmdline) {
-    char *argv[MAXARGS], *argv1[MAXARGS];
-    int bg, flag, index = 0;
-	int pgid = 0;
-    bg = parseline(cmdline, argv);
-    if (argv[0] == NULL) {
+    struct arena_mark_t mark = arena_mark(&cmd_arena);
+
+    eval_argv(cmdline);
+    arena_release(&cmd_arena, mark); /* all memory of the command line */
+}
+
+/*
+ * eval_argv - Parse and run one command line, with all its memory taken
+ *     from cmd_arena
+ */
+void eval_argv(char *cmdline) {
+    char **argv;
+    int argc;
+    uint64_t t = trace_now();
+
+    if ((argc = parseline(cmdline, &argv)) == 0) {
         return; /* Ignore empty lines */
     }
+    trace_span("parse", t, 0, 0, argv[0]);
 
-    rebulid_command(argv);
+    if (is_compound(argv)) /* if, while, ... typed on one line */
+        run_list(compile(argv, NULL, argc, &cmd_arena, NULL));
+    else
+        eval_words(argv, cmdline);
+}
 
-    if (!(flag = builtin_cmd(argv))) /* built-in command */
-        /* program (file) */
-    {
-        if (flag == -1) {
+/*
+ * eval_words - Run the commands of a list of words from parseline(),
+ *     separated by ; and &. The words are from cmd_arena, cmdline is
+ *     their text or NULL.
+ */
+void eval_words(char **argv, char *cmdline) {
+    uint64_t t = trace_now();
+
+    rebulid_command(&argv);
+    trace_span("alias", t, 0, 0, argv[0]);
+    eval_list(argv, cmdline);
+}
+
+/*
+ * eval_list - eval_words() once the aliases are expanded
+ */
+void eval_list(char **argv, char *cmdline) {
+    char *sep;
+    int start, end;
+
+    /* the commands of a list are separated by ; or & */
+    for (start = 0; argv[start] != NULL; start = end + 1) {
+        for (end = start; argv[end] != NULL && argv[end] != OP_SEMI && argv[end] != OP_AMP; end++)
+            ;
+        sep = argv[end];
+        argv[end] = NULL;
+        if (end > start)
+            eval_command(&argv[start], sep == OP_AMP,
+                         (start == 0 && (sep == NULL || argv[end + 1] == NULL)) ? cmdline : NULL);
+        else if (sep != NULL)
+            fprintf(stderr, "syntax error near '%s'\n", sep);
+        if (sep == NULL)
+            break;
+    }
+}
+
+/*
+ * eval_command - Run one command of a list. cmdline is the text for the
+ *     job list, NULL to make it from the words.
+ */
+void eval_command(char **argv, int bg, char *cmdline) {
+    struct stage_t *stage;
+    struct job_t *job;
+    struct timespec start;
+    struct sched_t *sched = NULL;
+    int nstage, timed = 0;
+    long subs = nsubst;         /* without a command, the status is of the last $(...) */
+    pid_t pgid;
+
+    if ((argv = expand_words(argv))[0] == NULL) {
+        if (nsubst == subs)
+            last_status = 0; /* only variables that came to nothing */
+        return;
+    }
+    if (cmdline == NULL)
+        cmdline = join_words(argv, bg);
+
+    if (!strcmp(argv[0], "time")) { /* a prefix, so it covers the whole pipeline */
+        timed = 1;
+        if ((++argv)[0] == NULL)
+            return;
+    }
+    if (!strcmp(argv[0], "pin")) { /* so is pin, unless it names running jobs */
+        sched = (struct sched_t *) arena_alloc(&cmd_arena, sizeof(struct sched_t));
+        if ((argv = pin_parse(argv, sched)) == NULL) {
+            last_status = 2;
+            return;
+        }
+        if (argv[0] == NULL || argv[0][0] == '%' || strspn(argv[0], "0123456789") == strlen(argv[0])) {
+            last_status = do_pin(argv, sched);
+            return;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    stage = (struct stage_t *) arena_alloc(&cmd_arena, (count_pipes(argv) + 1) * sizeof(struct stage_t));
+    if ((nstage = split_pipeline(argv, stage)) == 0) {
+        fprintf(stderr, " Wrong pipe command\n");
+        last_status = 2;
+        return;
+    }
+    for (int i = 0; i < nstage; i++) {
+        if (!parse_redirs(&stage[i])) {
+            last_status = 2;
+            return;
+        }
+        stage[i].sched = sched;
+        stage[i].assign = stage[i].argv;
+        for (stage[i].nassign = 0; stage[i].argv[0] != NULL && is_assignment(stage[i].argv[0]);
+             stage[i].nassign++)
+            stage[i].argv++;
+    }
+
+    /* built-in command, or redirections alone: run by the shell itself.
+     * Its output stays in the stdout buffer until a program is started,
+     * unless it is redirected */
+    if (nstage == 1 && (stage[0].argv[0] == NULL || is_builtin(stage[0].argv[0])) && sched == NULL) {
+        struct rusage before[2], after[2];
+
+        getrusage(RUSAGE_SELF, &before[0]);
+        getrusage(RUSAGE_CHILDREN, &before[1]); /* parallel reaps its own jobs */
+        if (stage[0].redir != NULL)
+            fflush(stdout);
+        if (redirect(stage[0].redir, 1) < 0) {
+            last_status = 1;
+        } else if (stage[0].argv[0] != NULL) { /* its assignments last while it runs */
+            char **old = var_push(stage[0].assign, stage[0].nassign);
+
+            builtin_cmd(stage[0].argv);
+            var_pop(stage[0].assign, stage[0].nassign, old);
+        } else {
+            for (int i = 0; i < stage[0].nassign; i++)
+                var_assign(stage[0].assign[i], 0);
+            if (nsubst == subs)
+                last_status = 0;
+        }
+        if (stage[0].redir != NULL)
+            fflush(stdout);
+        unredirect(stage[0].redir);
+        if (timed) {
+            struct timespec end;
+
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            getrusage(RUSAGE_SELF, &after[0]);
+            getrusage(RUSAGE_CHILDREN, &after[1]);
+            rusage_sub(&after[0], &before[0]);
+            rusage_sub(&after[1], &before[1]);
+            rusage_add(&after[0], &after[1]);
+            print_time(NULL, 0, NULL, NULL);
+            print_time("total", timespec_diff(&end, &start), &after[0], NULL);
+        }
+        return;
+    }
+
+    /* program (file); a builtin in a pipeline runs in a forked child */
+    for (int i = 0; i < nstage; i++)
+        if (stage[i].argv[0] == NULL) {
             fprintf(stderr, " Wrong pipe command\n");
+            last_status = 2;
             return;
         }
-        if (!is_accessable(argv)) /* do not fork and addset! This process is much better.*/
+    hash_check(); /* the table must not change while the stages are resolved */
+    for (int i = 0; i < nstage; i++) {
+        char *name = stage[i].argv[0];
+        uint64_t t = trace_now();
+
+        if (!is_builtin(name) && !is_accessable(stage[i].argv)) { /* do not fork and addset! This process is much better.*/
+            last_status = 127;
             return;
+        }
+        trace_span("resolve", t, 0, 0, name);
+    }
 
-        pid_t pid;
-        sigset_t mask, prev;
-        sigemptyset(&mask);
-        sigaddset(&mask, SIGCHLD);
-        sigprocmask(SIG_SETMASK, &mask, &prev); /* block SIG_CHLD */
-		
-		/*if ((pid = fork()) == 0) // child 
-		{
-			Signal(SIGCHLD, SIG_IG);  // Terminated or stopped child 
-			
-			if (setpgid(0, 0)) 
-				unix_error("Failed to invoke setpgid(0, 0)");
-			
-			int state;
-			while(wait(&state)){};
-
-			tcsetpgrp(0, getppid()); //set the group as the frount group
-			exit(0);
-		} else{
-			pgid= pid;
-		}*/
-		
-		if(is_pipe(argv))
-		{
-			int pipe_in;
-			while(flag = is_pipe2(&argv[index],argv1,&index))
-			{
-				if(flag == 1)
-				{
-					int fd1[2];
-					if(pipe(fd1)<0)
-					{
-						app_error("pipe error");
-					}
-					
-					if ((pid = fork()) == 0) /* child */
-					{
-						
-						close(fd1[0]);
-						if(fd1[1] != STDOUT_FILENO)
-						{
-							if(dup2(fd1[1],STDOUT_FILENO) != STDOUT_FILENO)
-								app_error("dup2 error to stdout");
-							close(fd1[1]);
-						}
-						
-						sigprocmask(SIG_UNBLOCK, &prev, NULL);
-
-						if (!setpgid(0, pgid)) {
-							
-							if (execve(argv1[0], argv1, environ))
-								fprintf(stderr, "%s: Failed to execve\n", argv[0]);
-							/* context changed */
-						} else 
-							unix_error("Failed to invoke setpgid(0, 0)");
-					} else {
-						/* Parent process */
-					
-						dup2(fd1[0],pipe_in);
-						close(fd1[0]);
-						close(fd1[1]);
-						/*if(fd1[0] != STDOUT_FILENO)
-						{
-							if(dup2(fd1[1],STDOUT_FILENO) != STDOUT_FILENO)
-								app_error("dup2 error to stdout");
-							close(fd[1]);
-						}
-						*/
-						if(pgid ==0)
-						{
-							pgid = pid;
-						}
-						addjob(pid, pgid, (bg) ? BG : FG, cmdline);
-					}
-				}
-				if(flag == 2)
-				{
-					int fd1[2];
-					if(pipe(fd1)<0)
-					{
-						app_error("pipe error");
-					}
-					
-					int fd2[2];
-					if(pipe(fd2)<0)
-					{
-						app_error("pipe error");
-					}
-					
-					if ((pid = fork()) == 0) /* child */
-					{
-						
-						close(fd1[0]);
-						if(fd1[1] != STDOUT_FILENO)
-						{
-							if(dup2(fd1[1],STDOUT_FILENO) != STDOUT_FILENO)
-								app_error("dup2 error to stdout");
-							close(fd1[1]);
-						}
-						
-						close(fd2[1]);
-						close(pipe_in);
-						if(fd2[0] != STDIN_FILENO)
-						{
-							if(dup2(fd2[0],STDIN_FILENO) != STDIN_FILENO)
-								app_error("dup2 error to stdin");
-							close(fd2[1]);
-						}
-						
-						sigprocmask(SIG_UNBLOCK, &prev, NULL);
-
-						if (!setpgid(0, pgid)) {
-							
-							if (execve(argv1[0], argv1, environ))
-								fprintf(stderr, "%s: Failed to execve\n", argv[0]);
-							/* context changed */
-						} else 
-							unix_error("Failed to invoke setpgid(0, 0)");
-					} else {
-						/* Parent process */
-						/*if(pgid ==0)
-						{
-							pgid = pid;
-						}*/
-						char line[MAXLINE];
-						int n;
-						close(fd2[0]);
-						while((n=read(pipe_in,line,MAXLINE)) >0)
-						{
-							//int n = strlen(line);
-							if(write(fd2[1],line, n) !=n)
-								app_error("write error to pipe");
-						}
-						if(n<0)
-							app_error("read error from pipe");
-						close(fd2[1]);
-						close(pipe_in);
-						
-						
-						dup2(fd1[0],pipe_in);
-						close(fd1[0]);
-						close(fd1[1]);
-
-						addjob(pid, pgid, (bg) ? BG : FG, cmdline);
-					}
-				}
-				if(flag == 3)
-				{
-					int fd2[2];
-					if(pipe(fd2)<0)
-					{
-						app_error("pipe error");
-					}
-					
-					if ((pid = fork()) == 0) /* child */
-					{
-						
-						close(fd2[1]);
-						close(pipe_in);
-						if(fd2[0] != STDIN_FILENO)
-						{
-							if(dup2(fd2[0],STDIN_FILENO) != STDIN_FILENO)
-								app_error("dup2 error to stdin");
-							close(fd2[1]);
-						}
-						sigprocmask(SIG_UNBLOCK, &prev, NULL);
-
-						if (!setpgid(0, pgid)) {
-							
-							if (execve(argv1[0], argv1, environ))
-								fprintf(stderr, "%s: Failed to execve\n", argv[0]);
-							/* context changed */
-						} else 
-							unix_error("Failed to invoke setpgid(0, 0)");
-					} else {
-						/* Parent process */
-						/*if(pgid ==0)
-						{
-							pgid = pid;
-						}*/
-						char line[MAXLINE];
-						int n;
-						close(fd2[0]);
-						while((n = read(pipe_in,line,MAXLINE)) >0)
-						{
-							//int n = strlen(line);
-							if(write(fd2[1],line, n) !=n)
-								app_error("write error to pipe");
-						}
-						if(n<0)
-							app_error("read error from pipe");
-						close(fd2[1]);
-						close(pipe_in);
-						
-						
-						addjob(pid, pgid, (bg) ? BG : FG, cmdline);
-					}
-				}
-				
-			}
-		}
-		else{
-			if ((pid = fork()) == 0) /* child */
-			{
-				sigprocmask(SIG_UNBLOCK, &prev, NULL);
-				if (!setpgid(0, pgid)) {			
-					if (execve(argv1[0], argv1, environ))
-						fprintf(stderr, "%s: Failed to execve\n", argv[0]);
-					/* context changed */
-				} else 
-					unix_error("Failed to invoke setpgid(0, 0)");
-			} else {
-				/* Parent process */
-				if(pgid ==0)
-				{
-					pgid = pid;
-				}
-				addjob(pid, pgid, (bg) ? BG : FG, cmdline);
-			}
-		}
-		
-		//if(!bg)
-				//    sigaddset(&prev, SIGCHLD);
-		sigprocmask(SIG_SETMASK, &prev, NULL);
-		if (!bg) 
-		{
-			//tcsetpgrp(0, pgid); //set the group as the frount group
-			waitfg(pgid);
-		}
-		else 
-			printf("[%d] (%d) %s", pid2jid(pid), pid, cmdline);
-
-				// sigprocmask(SIG_SETMASK, &prev, NULL);
+    pgid = run_pipeline(stage, nstage, bg, cmdline);
+
+    if (pgid == 0)
+        return;
+    /* nothing is reaped before the next event_wait(), so no stage is missed */
+    if (timed && (job = getjobpgid(pgid)) != NULL &&
+        (job->times = (struct stagetime_t *) calloc(job->npid, sizeof(struct stagetime_t))) != NULL) {
+        int fan = (stage[nstage - 1].branch > 0); /* the fan-out of |> was started first */
+
+        job->start = start;
+        for (int i = 0; i < job->npid; i++) {
+            char *name = (i < fan) ? "fanout" : stage[i - fan].argv[0], *base = strrchr(name, '/');
+            snprintf(job->times[i].name, sizeof(job->times[i].name), "%s", base ? base + 1 : name);
+        }
+    }
+    if (!bg) {
+        //tcsetpgrp(0, pgid); //set the group as the frount group
+        waitfg(pgid);
+    } else {
+        if ((job = getjobpgid(pgid)) != NULL)
+            last_bg = job->pid[job->npid - 1];
+        printf("[%d] (%d) %s", pid2jid(pgid), pgid, cmdline);
     }
 
     return;
 }
 
-int is_pipe2(char **argv, char **argv1, int *index)
-{
-	int argc = 0;
-	memset(argv,0,sizeof(argv));
-	
-	while (argv[argc] != NULL || strcmp(argv[argc], "|")) 
-	{
-		argv1[argc] = argv[argc];
-		argc++;
-	}
-	
-
-	if(argv[argc] != NULL && index == 0)
-	{
-		index += argc;
-		return 1;
-	}else if (argv[argc] != NULL && argc != 0)
-	{
-		index += argc;
-		return 2;
-	}
-	else if (argc != 0)
-	{
-		index += argc;
-		return 3;
-	}
-	return 0;
+/*
+ * join_words - Make the text of a command for the job list, when it is
+ *     only a part of the command line
+ */
+char *join_words(char **argv, int bg) {
+    size_t len = 4;
+    char *text, *p;
+
+    for (int i = 0; argv[i] != NULL; i++)
+        len += strlen(argv[i]) + 1;
+    p = text = (char *) arena_alloc(&cmd_arena, len);
+    for (int i = 0; argv[i] != NULL; i++) {
+        if (i > 0 && argv[i - 1] != OP_IONUM && !(i > 1 && argv[i - 2] == OP_IONUM))
+            *p++ = ' '; /* 2>file stays in one piece */
+        p = stpcpy(p, argv[i]);
+    }
+    strcpy(p, bg ? " &\n" : "\n");
+    return text;
 }
 
-/* 
- * parseline - Parse the command line and build the argv array.
- * 
- * Characters enclosed in single quotes are treated as a single
- * argument.  Return true if the user has requested a BG job, false if
- * the user has requested a FG job.  
- */
-int parseline(const char *cmdline, char **argv) {
-    static char array[MAXLINE + 1]; /* holds local copy of command line */
-    char *buf = array;          /* ptr that traverses command line */
-    char *delim;                /* points to first space delimiter */
-    int argc;                   /* number of args */
-    int bg;                     /* background job? */
-
-    strcpy(buf, cmdline);
-    buf[strlen(buf) - 1] = ' ';  /* replace trailing '\n' with space */
-    while (*buf && (*buf == ' ')) /* ignore leading spaces */
-        buf++;
-
-    /* Build the argv list */
-    argc = 0;
-    if (*buf == '\'') {
-        buf++;
-        delim = strchr(buf, '\'');
-    } else {
-        delim = strchr(buf, ' ');
+/*
+ * split_pipeline - Cut argv at every | into the stages of a pipeline.
+ *     The | operators are replaced by NULL so each stage's argv is
+ *     terminated in place. After a |>, the stages are numbered with
+ *     the branch they are in, a , starting the next one. Returns the
+ *     number of stages, 0 if a stage is empty or |> is there twice.
+ */
+int split_pipeline(char **argv, struct stage_t *stage) {
+    int nstage = 0, branch;
+
+    stage[nstage].branch = 0;
+    stage[nstage++].argv = argv;
+    for (int i = 0; argv[i] != NULL; i++) {
+        if (argv[i] == OP_PIPE || argv[i] == OP_FANOUT || argv[i] == OP_COMMA) {
+            branch = stage[nstage - 1].branch;
+            if (argv[i] == OP_FANOUT && branch++ > 0)
+                return 0;
+            if (argv[i] == OP_COMMA && branch++ == 0)
+                return 0;
+            argv[i] = NULL;
+            if (stage[nstage - 1].argv[0] == NULL)
+                return 0;
+            stage[nstage].branch = branch;
+            stage[nstage++].argv = &argv[i + 1];
+        }
     }
+    if (stage[nstage - 1].argv[0] == NULL)
+        return 0;
 
-    while (delim) {
-        argv[argc++] = buf;
-        *delim = '\0';
-        buf = delim + 1;
-        while (*buf && (*buf == ' ')) /* ignore spaces */
-            buf++;
+    return nstage;
+}
 
-        if (*buf == '\'') {
-            buf++;
-            delim = strchr(buf, '\'');
-        } else {
-            delim = strchr(buf, ' ');
+/*
+ * parse_redirs - Move the redirections of a stage out of its argv into
+ *     stage->redir, keeping their order. Returns 0 on a syntax error.
+ */
+int parse_redirs(struct stage_t *stage) {
+    struct redir_t **tail = &stage->redir;
+    struct redir_t *r;
+    char **argv = stage->argv;
+    int n = 0, fd;
+
+    stage->redir = NULL;
+    for (int i = 0; argv[i] != NULL; i++) {
+        if (!IS_OP(argv[i])) {
+            argv[n++] = argv[i];
+            continue;
+        }
+
+        fd = -1;
+        if (argv[i] == OP_IONUM) { /* parseline puts the operator after the number */
+            fd = atoi(argv[i + 1]);
+            i += 2;
+        }
+        if (argv[i + 1] == NULL || IS_OP(argv[i + 1])) {
+            fprintf(stderr, "%s: missing file name\n", argv[i]);
+            return 0;
         }
+        if ((argv[i] == OP_DUP || argv[i] == OP_DUPIN) && strcmp(argv[i + 1], "-") &&
+            strspn(argv[i + 1], "0123456789") != strlen(argv[i + 1])) {
+            fprintf(stderr, "%s%s: bad file descriptor\n", argv[i], argv[i + 1]);
+            return 0;
+        }
+
+        r = (struct redir_t *) arena_alloc(&cmd_arena, sizeof(struct redir_t));
+        r->op = argv[i];
+        r->fd = (fd >= 0) ? fd : (r->op == OP_IN || r->op == OP_DUPIN) ? STDIN_FILENO : STDOUT_FILENO;
+        r->word = argv[++i];
+        r->saved = -2;
+        r->next = NULL;
+        *tail = r;
+        tail = &r->next;
     }
-    argv[argc] = NULL;
+    argv[n] = NULL;
 
-    if (argc == 0)  /* ignore blank line */
-        return 1;
+    return 1;
+}
+
+/* open(2) flags of a file redirection */
+int redir_flags(char *op) {
+    if (op == OP_IN)
+        return O_RDONLY;
+    return O_WRONLY | O_CREAT | ((op == OP_APPEND) ? O_APPEND : O_TRUNC);
+}
 
-    /* should the job run in the background? */
-    if ((bg = (*argv[argc - 1] == '&')) != 0) {
-        argv[--argc] = NULL;
+/*
+ * redirect - Apply redirections to the shell itself, as a builtin or a
+ *     forked child needs them. With save, every fd replaced is first
+ *     copied so unredirect() can put it back. Returns -1 on error.
+ */
+int redirect(struct redir_t *redir, int save) {
+    int fd;
+
+    for (struct redir_t *r = redir; r != NULL; r = r->next) {
+        r->saved = save ? fcntl(r->fd, F_DUPFD_CLOEXEC, 64) : -1;
+        if (save && r->fd == STDOUT_FILENO && capture != NULL) /* its output is not captured */
+            capture->redirected++;
+        if (r->op == OP_DUP || r->op == OP_DUPIN) {
+            if (!strcmp(r->word, "-"))
+                close(r->fd);
+            else if (dup2(atoi(r->word), r->fd) < 0) {
+                fprintf(stderr, "%s: %s\n", r->word, strerror(errno));
+                return -1;
+            }
+            continue;
+        }
+        if ((fd = open(r->word, redir_flags(r->op), 0666)) < 0) {
+            fprintf(stderr, "%s: %s\n", r->word, strerror(errno));
+            return -1;
+        }
+        if (fd != r->fd) {
+            dup2(fd, r->fd);
+            close(fd);
+        }
     }
-    return bg;
+
+    return 0;
 }
 
-/* 
- * builtin_cmd - If the user has typed a built-in command then execute
- *    it immediately.  
+/*
+ * unredirect - Undo redirect(redir, 1), the last redirection first
  */
-int builtin_cmd(char **argv) {
+void unredirect(struct redir_t *redir) {
+    if (redir == NULL)
+        return;
+    unredirect(redir->next);
+    if (redir->fd == STDOUT_FILENO && capture != NULL && capture->redirected > 0)
+        capture->redirected--;
+    if (redir->saved >= 0) {
+        dup2(redir->saved, redir->fd);
+        close(redir->saved);
+    } else if (redir->saved == -1) /* it was not open */
+        close(redir->fd);
+}
 
-    if (!strcmp(argv[0], "quit")) {
-        if (is_pipe(argv))
-            return -1;
-        exit(0);
-    } else if (!strcmp(argv[0], "jobs")) {
-        listjobs();
-        if (is_pipe(argv))
-            return -1;
-        return 1;
-    } else if (!strcmp(argv[0], "bg") || !strcmp(argv[0], "fg")) {
-        do_bgfg(argv);
-        if (is_pipe(argv))
-            return -1;
-        return 1;
-    } else if (!strcmp(argv[0], "alias")) {
-        alias_add(argv);
-        if (is_pipe(argv))
-            return -1;
-        return 1;
+/*
+ * run_pipeline - Start every stage of a pipeline at the same time
+ *
+ * All the pipes are created up front and each child has its
+ * stdin/stdout wired before execve, so the data goes straight from
+ * one stage to the next and never through the shell. The stages share
+ * the process group of the first one. Returns the pgid of the new
+ * job, 0 if nothing could be started.
+ *
+ * With |>, the last stage before it writes to a fan-out process that
+ * gives a copy of the stream to the first stage of each branch (see
+ * fanout()). It is started first, so the whole job is in its group.
+ */
+pid_t run_pipeline(struct stage_t *stage, int nstage, int bg, char *cmdline) {
+    int nbranch = stage[nstage - 1].branch, ntrunk = nstage, nfd = 0, nfan = 0;
+    int *fd = (int *) arena_alloc(&cmd_arena, 2 * (nstage + nbranch) * sizeof(int));
+    int *in = (int *) arena_alloc(&cmd_arena, nstage * sizeof(int));
+    int *out = (int *) arena_alloc(&cmd_arena, nstage * sizeof(int));
+    int *fan = (int *) arena_alloc(&cmd_arena, (nbranch + 1) * sizeof(int));
+    pid_t pid, pgid = 0;
+
+    while (nbranch > 0 && stage[ntrunk - 1].branch > 0)
+        ntrunk--;
+    for (int i = 0; i < nstage; i++) {
+        in[i] = STDIN_FILENO;
+        out[i] = STDOUT_FILENO;
+    }
+
+    /* between the stages of the trunk and of each branch, into the
+     * fan-out (fan[nbranch]) and out of it into each branch */
+    for (int i = 0; i < nstage + nbranch; i++) {
+        int k = (i < nstage - 1) ? i : -1;
+
+        if (k >= 0 && stage[k + 1].branch != stage[k].branch)
+            continue; /* the end of the trunk or of a branch */
+        if (i == nstage - 1 && nbranch == 0)
+            break;
+        /* close-on-exec: every child only keeps the two ends it dup2s */
+        if (pipe2(&fd[nfd], O_CLOEXEC) < 0) {
+            while (--nfd >= 0)
+                close(fd[nfd]);
+            fprintf(stderr, "pipe error: %s\n", strerror(errno));
+            return 0;
+        }
+        if (pipe_size > 0 && fcntl(fd[nfd], F_SETPIPE_SZ, pipe_size) < 0 && verbose)
+            printf("F_SETPIPE_SZ %d: %s\n", pipe_size, strerror(errno));
+        if (k >= 0) {
+            out[k] = fd[nfd + 1];
+            in[k + 1] = fd[nfd];
+        } else if (i == nstage - 1) { /* into the fan-out */
+            out[ntrunk - 1] = fd[nfd + 1];
+            fan[nbranch] = fd[nfd];
+        } else { /* into the first stage of branch nfan + 1 */
+            int first = ntrunk;
+            while (stage[first].branch != nfan + 1)
+                first++;
+            in[first] = fd[nfd];
+            fan[nfan++] = fd[nfd + 1];
+        }
+        nfd += 2;
+    }
+
+    if (nbranch > 0) {
+        if ((pgid = fanout_start(fan[nbranch], fan, nbranch, fd, nfd)) < 0) {
+            for (int j = 0; j < nfd; j++)
+                close(fd[j]);
+            last_status = 1;
+            return 0;
+        }
+        addjob(pgid, pgid, (bg) ? BG : FG, cmdline);
+    }
+
+    for (int i = 0; i < nstage; i++) {
+        pid = launch(&stage[i], pgid, in[i], out[i]);
+        if (pid < 0) {
+            if (pgid != 0)
+                kill(-pgid, SIGKILL); /* do not leave half a pipeline */
+            else
+                last_status = 1;
+            break;
+        }
+
+        /* Parent process */
+        if (pgid == 0)
+            pgid = pid;
+        addjob(pid, pgid, (bg) ? BG : FG, cmdline);
+    }
+
+    for (int j = 0; j < nfd; j++)
+        close(fd[j]);
+
+    return pgid;
+}
+
+/*
+ * fanout_start - Fork the fan-out process of |>, copying in to the nout
+ *     pipes out. fd are all the pipes of the pipeline, it closes the
+ *     others. Returns its pid, the pgid of the job, -1 on failure.
+ */
+pid_t fanout_start(int in, int *out, int nout, int *fd, int nfd) {
+    pid_t pid;
+    uint64_t t;
+
+    fflush(stdout);
+    t = trace_now();
+    if ((pid = fork()) == 0) {
+        for (int j = 0; j < nfd; j++) {
+            int keep = (fd[j] == in);
+            for (int k = 0; k < nout; k++)
+                keep |= (fd[j] == out[k]);
+            if (!keep)
+                close(fd[j]);
+        }
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGQUIT, SIG_DFL);
+        signal(SIGPIPE, SIG_IGN); /* a branch that quits is only dropped */
+        sigprocmask(SIG_SETMASK, &child_mask, NULL);
+        setpgid(0, 0);
+        _exit(fanout(in, out, nout));
+    } else if (pid < 0) {
+        fprintf(stderr, "fork error: %s\n", strerror(errno));
+        return -1;
+    }
+    setpgid(pid, pid);
+    trace_span("fork", t, pid, 0, "fanout");
+    return pid;
+}
+
+/*
+ * fanout - Copy everything that comes through the pipe in to each of
+ *     the pipes out, and return the exit status of the fan-out
+ *
+ * The kernel does the copies: tee() links the pages of in into a
+ * private pipe per branch without taking them out of in, and splice()
+ * moves them on to the branch. Nothing is copied in user space. A round
+ * takes what is in in, up to its size: the private pipes are as large
+ * as in and empty, so each takes all of it, the last one through
+ * splice(), which takes it out of in. They are then drained into the
+ * branches as each can take more, so a slow branch only holds back the
+ * next round. A branch that quits is dropped and the others go on.
+ */
+int fanout(int in, int *out, int nout) {
+    int *st = (int *) malloc(2 * nout * sizeof(int)); /* the private pipes */
+    size_t *left = (size_t *) calloc(nout, sizeof(size_t)); /* bytes in them */
+    struct pollfd *pfd = (struct pollfd *) malloc(nout * sizeof(struct pollfd));
+    int *idx = (int *) malloc(nout * sizeof(int));
+    int size = fcntl(in, F_GETPIPE_SZ), live = nout;
+    ssize_t n, m;
+
+    if (st == NULL || left == NULL || pfd == NULL || idx == NULL)
+        return 1;
+    for (int i = 0; i < nout; i++) {
+        if (pipe2(&st[2 * i], O_CLOEXEC) < 0) {
+            fprintf(stderr, "fanout: pipe: %s\n", strerror(errno));
+            return 1;
+        }
+        if (size > 0 && fcntl(st[2 * i], F_SETPIPE_SZ, size) < 0) {
+            fprintf(stderr, "fanout: F_SETPIPE_SZ: %s\n", strerror(errno));
+            return 1;
+        }
+        fcntl(out[i], F_SETFL, O_NONBLOCK);
+    }
+
+    while (live > 0) {
+        int last = -1, np;
+
+        /* a round: wait for input, give it to every live branch */
+        for (int i = 0; i < nout; i++)
+            if (out[i] >= 0)
+                last = i;
+        n = 0;
+        for (int i = 0; i < nout; i++) {
+            if (out[i] < 0)
+                continue;
+            do {
+                if (i == last)
+                    m = splice(in, NULL, st[2 * i + 1], NULL, n ? (size_t) n : (size_t) size, 0);
+                else
+                    m = tee(in, st[2 * i + 1], n ? (size_t) n : (size_t) size, 0);
+            } while (m < 0 && errno == EINTR);
+            if (m < 0) {
+                fprintf(stderr, "fanout: %s\n", strerror(errno));
+                return 1;
+            }
+            if (m == 0) /* end of the input */
+                goto done;
+            if (n == 0)
+                n = m;
+            else if (m != n) { /* cannot happen, st is empty and as large as in */
+                fprintf(stderr, "fanout: short copy\n");
+                return 1;
+            }
+            left[i] = n;
+        }
+
+        /* drain the private pipes into the branches */
+        while (1) {
+            np = 0;
+            for (int i = 0; i < nout; i++)
+                if (out[i] >= 0 && left[i] > 0) {
+                    pfd[np].fd = out[i];
+                    pfd[np].events = POLLOUT;
+                    idx[np++] = i;
+                }
+            if (np == 0)
+                break;
+            if (poll(pfd, np, -1) < 0 && errno != EINTR)
+                return 1;
+            for (int k = 0; k < np; k++) {
+                int i = idx[k];
+                if (pfd[k].revents == 0)
+                    continue;
+                m = splice(st[2 * i], NULL, out[i], NULL, left[i], SPLICE_F_NONBLOCK);
+                if (m > 0) {
+                    left[i] -= m;
+                } else if (m < 0 && errno != EAGAIN && errno != EINTR) { /* EPIPE: the branch quit */
+                    close(out[i]);
+                    out[i] = -1;
+                    left[i] = 0;
+                    live--;
+                }
+            }
+        }
+    }
+
+done:
+    for (int i = 0; i < nout; i++) {
+        if (out[i] >= 0)
+            close(out[i]);
+        close(st[2 * i]);
+        close(st[2 * i + 1]);
+    }
+    free(st);
+    free(left);
+    free(pfd);
+    free(idx);
+    return 0;
+}
+
+/*
+ * launch - Start one program in process group pgid (0 for a new group)
+ *     with its stdin/stdout taken from in/out. Returns the pid, -1 on
+ *     failure.
+ *
+ * By default the program is started with posix_spawn, which glibc runs
+ * as clone(CLONE_VM|CLONE_VFORK): unlike fork() it does not copy the
+ * page tables of the shell, so the cost does not grow with the shell.
+ * The process group, the dup2 of the pipe ends and the signal mask are
+ * set up through the spawn attributes and file actions. LAUNCHER=fork
+ * in myconf switches back to fork/execve, and so do builtins and the
+ * pin options, which spawn cannot apply. The environment is env_vec,
+ * with the assignments before the command laid over it meanwhile.
+ */
+pid_t launch(struct stage_t *stage, pid_t pgid, int in, int out) {
+    char **argv = stage->argv;
+    struct redir_t *redir = stage->redir;
+    struct envsave_t *save = NULL;
+    pid_t pid;
+    sigset_t sigdef;
+    int err;
+    uint64_t t;
+    char *base;
+
+    if (out == STDOUT_FILENO) /* in a command substitution, fd 1 must be its pipe */
+        capture_pipe();
+    if (stage->nassign > 0) {
+        save = (struct envsave_t *) arena_alloc(&cmd_arena, stage->nassign * sizeof(struct envsave_t));
+        env_overlay(stage->assign, stage->nassign, save);
+    }
+
+    /* the shell ignores these, its children must not */
+    sigemptyset(&sigdef);
+    sigaddset(&sigdef, SIGINT);
+    sigaddset(&sigdef, SIGTSTP);
+    sigaddset(&sigdef, SIGQUIT);
+    sigaddset(&sigdef, SIGCHLD);
+
+    if (launcher == LAUNCH_SPAWN && !is_builtin(argv[0]) && stage->sched == NULL) {
+        posix_spawnattr_t attr;
+        posix_spawn_file_actions_t fa;
+        int nredir = 0, nopen = 0, *fd;
+
+        /* the files are opened here, so a failed open can name the file */
+        for (struct redir_t *r = redir; r != NULL; r = r->next)
+            nredir++;
+        fd = (int *) arena_alloc(&cmd_arena, (nredir + 1) * sizeof(int));
+        for (struct redir_t *r = redir; r != NULL; r = r->next) {
+            if (r->op == OP_DUP || r->op == OP_DUPIN)
+                continue;
+            if ((fd[nopen] = open(r->word, redir_flags(r->op) | O_CLOEXEC, 0666)) < 0) {
+                fprintf(stderr, "%s: %s\n", r->word, strerror(errno));
+                while (--nopen >= 0)
+                    close(fd[nopen]);
+                env_restore(stage->nassign, save);
+                return -1;
+            }
+            /* an fd that a redirection replaces would be gone before its dup2 */
+            for (struct redir_t *q = redir; q != NULL; q = q->next)
+                if (q->fd == fd[nopen]) {
+                    int moved = fcntl(fd[nopen], F_DUPFD_CLOEXEC, 64);
+                    close(fd[nopen]);
+                    fd[nopen] = moved;
+                    break;
+                }
+            nopen++;
+        }
+
+        posix_spawnattr_init(&attr);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK |
+                                        POSIX_SPAWN_SETSIGDEF);
+        posix_spawnattr_setpgroup(&attr, pgid);
+        posix_spawnattr_setsigmask(&attr, &child_mask);
+        posix_spawnattr_setsigdefault(&attr, &sigdef);
+
+        posix_spawn_file_actions_init(&fa);
+        if (in != STDIN_FILENO)
+            posix_spawn_file_actions_adddup2(&fa, in, STDIN_FILENO);
+        if (out != STDOUT_FILENO)
+            posix_spawn_file_actions_adddup2(&fa, out, STDOUT_FILENO);
+        nopen = 0;
+        for (struct redir_t *r = redir; r != NULL; r = r->next) {
+            if (r->op != OP_DUP && r->op != OP_DUPIN)
+                posix_spawn_file_actions_adddup2(&fa, fd[nopen++], r->fd);
+            else if (!strcmp(r->word, "-"))
+                posix_spawn_file_actions_addclose(&fa, r->fd);
+            else
+                posix_spawn_file_actions_adddup2(&fa, atoi(r->word), r->fd);
+        }
+
+        fflush(stdout);
+        t = trace_now();
+        err = posix_spawn(&pid, argv[0], &fa, &attr, argv, var_envp());
+
+        posix_spawn_file_actions_destroy(&fa);
+        posix_spawnattr_destroy(&attr);
+        while (--nopen >= 0)
+            close(fd[nopen]);
+        env_restore(stage->nassign, save);
+        if (err != 0) {
+            /* the files are open, so only a >&n of a bad fd is left to fail */
+            fprintf(stderr, "%s: Failed to %s: %s\n", argv[0],
+                    (nredir > 0) ? "redirect or execve" : "execve", strerror(err));
+            return -1;
+        }
+        /* glibc returns once the child has exec'd, so this covers both */
+        trace_span("spawn", t, pid, 0, (base = strrchr(argv[0], '/')) ? base + 1 : argv[0]);
+        return pid;
+    }
+
+    fflush(stdout);
+    t = trace_now();
+    if ((pid = fork()) == 0) /* child */
+    {
+        if (in != STDIN_FILENO && dup2(in, STDIN_FILENO) != STDIN_FILENO)
+            app_error("dup2 error to stdin");
+        if (out != STDOUT_FILENO && dup2(out, STDOUT_FILENO) != STDOUT_FILENO)
+            app_error("dup2 error to stdout");
+        if (redirect(redir, 0) < 0)
+            exit(1);
+        if (stage->sched != NULL && sched_apply(0, stage->sched) < 0) {
+            fprintf(stderr, "pin: %s: %s\n", argv[0], strerror(errno));
+            exit(1);
+        }
+
+        for (int sig = 1; sig < NSIG; sig++)
+            if (sigismember(&sigdef, sig))
+                signal(sig, SIG_DFL);
+        sigprocmask(SIG_SETMASK, &child_mask, NULL);
+
+        if (!setpgid(0, pgid)) {
+            if (is_builtin(argv[0])) { /* a stage of a pipeline */
+                for (int i = 0; i < stage->nassign; i++)
+                    var_assign(stage->assign[i], 0);
+                events_reset();
+                builtin_cmd(argv);
+                fflush(stdout);
+                _exit(last_status);
+            }
+            trace_mark("exec", getpid(), 0, argv[0]);
+            if (execve(argv[0], argv, var_envp()))
+                fprintf(stderr, "%s: Failed to execve\n", argv[0]);
+            exit(1);
+            /* context changed */
+        } else
+            unix_error("Failed to invoke setpgid(0, 0)");
+    }
+    env_restore(stage->nassign, save);
+    if (pid < 0) {
+        fprintf(stderr, "fork error: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* Parent process: also here, so the group exists before the next stage */
+    setpgid(pid, pgid ? pgid : pid);
+    trace_span("fork", t, pid, 0, (base = strrchr(argv[0], '/')) ? base + 1 : argv[0]);
+    return pid;
+}
+
+/*
+ * lex_subst - Copy the $(command) or `command` at cmdline[*ip] to out as
+ *     ctl, the text of the command and CTL_END. Quotes and nested $( )
+ *     are skipped to find the closing parenthesis; in backquotes a
+ *     backslash before $ ` or \ is dropped. Sets *ip past it and returns
+ *     the new end of out.
+ */
+static char *lex_subst(const char *cmdline, size_t *ip, char *out, char ctl) {
+    size_t i = *ip;
+    int depth = 1;
+
+    *out++ = ctl;
+    if (cmdline[i] == '`') {
+        for (i++; cmdline[i] != '\0' && cmdline[i] != '`'; i++) {
+            if (cmdline[i] == '\\' && cmdline[i + 1] != '\0' && strchr("$`\\", cmdline[i + 1]))
+                i++;
+            *out++ = cmdline[i];
+        }
+    } else {
+        for (i += 2; cmdline[i] != '\0'; i++) {
+            char q = cmdline[i];
+
+            if (q == ')' && --depth == 0)
+                break;
+            if (q == '(') {
+                depth++;
+            } else if (q == '\\' && cmdline[i + 1] != '\0') {
+                *out++ = cmdline[i++];
+            } else if (q == '\'' || q == '"' || q == '`') {
+                for (*out++ = cmdline[i++]; cmdline[i] != '\0' && cmdline[i] != q; *out++ = cmdline[i++])
+                    if (q != '\'' && cmdline[i] == '\\' && cmdline[i + 1] != '\0')
+                        *out++ = cmdline[i++];
+                if (cmdline[i] == '\0')
+                    break;
+            }
+            *out++ = cmdline[i];
+        }
+    }
+    *out++ = CTL_END;
+    *ip = (cmdline[i] != '\0') ? i + 1 : i;
+    return out;
+}
+
+/*
+ * lex_dollar - Copy the $ at cmdline[*ip] to out: if a name, ${name}, $?,
+ *     $$ or $! follows, as ctl, the name and CTL_END, else as it is. $( is
+ *     a command substitution. Sets *ip past it and returns the new end
+ *     of out.
+ */
+static char *lex_dollar(const char *cmdline, size_t *ip, char *out, char ctl) {
+    size_t i = *ip + 1, brace = (cmdline[i] == '{'), n;
+
+    if (cmdline[i] == '(')
+        return lex_subst(cmdline, ip, out, (ctl == CTL_VAR) ? CTL_SUB : CTL_QSUB);
+    /* cmdline ends with a NUL at len, so looking one ahead is safe */
+    n = (cmdline[i + brace] && strchr("?$!", cmdline[i + brace])) ? 1 : var_name_len(cmdline + i + brace);
+    if (n == 0 || (brace && cmdline[i + 1 + n] != '}')) {
+        *out++ = '$';
+        *ip += 1;
+        return out;
+    }
+    *out++ = ctl;
+    memcpy(out, cmdline + i + brace, n);
+    out += n;
+    *out++ = CTL_END;
+    *ip = i + n + 2 * brace;
+    return out;
+}
+
+/* 
+ * parseline - Parse the command line and build the argv array.
+ * 
+ * Words are separated by blanks and by the operators | & ; < > >> >& |>,
+ * which are returned as the pointers OP_PIPE, OP_AMP, ... so a quoted
+ * '|' stays a word. After |> in a command, an unquoted comma that ends
+ * a word separates the branches. Characters enclosed in single quotes are taken as
+ * they are, in double quotes a backslash escapes " \ $ and `, outside
+ * quotes it escapes any character. $name, ${name}, $?, $$, $!,
+ * $(command) and `command` outside single quotes are marked for expand_words(),
+ * which puts in their values when the command runs. A word starting with #
+ * begins a comment. The copy of the line and argv are allocated from
+ * cmd_arena, so there is no limit on either. Returns the number of words.
+ *
+ * The runs of plain characters are found by lex_scan, which tests 16
+ * or 32 bytes at a time with SSE2 or AVX2, so the cost follows the
+ * length of the line rather than the number of characters in a word.
+ */
+int parseline(const char *cmdline, char ***argvp) {
+    size_t len = strlen(cmdline), i = 0, j, start, plain;
+    char *out;                  /* unquoted text of the words */
+    int fanout = 0;             /* a |> was seen in this command */
+    char **argv;                /* the words, grown as needed */
+    int argc = 0;               /* number of args */
+    int maxargc = 16;
+
+    if (lex_scan == NULL)
+        lex_init();
+
+    /* a word only grows by marking $x as 3 bytes, and by one byte for a
+     * ` left open, so the text fits in len + len / 2 + 2 */
+    out = (char *) arena_alloc(&cmd_arena, len + len / 2 + 2);
+    argv = (char **) arena_alloc(&cmd_arena, (maxargc + 1) * sizeof(char *));
+
+    while (1) {
+        while (i < len && IS_BLANK(cmdline[i]))
+            i++;
+        if (i == len || cmdline[i] == '#')
+            break;
+
+        if (argc == maxargc) {
+            argv = (char **) arena_grow(&cmd_arena, argv, (maxargc + 1) * sizeof(char *),
+                                        (2 * maxargc + 1) * sizeof(char *));
+            maxargc *= 2;
+        }
+
+        /* operators */
+        switch (cmdline[i]) {
+            case '|':
+                if (cmdline[i + 1] == '>') {
+                    argv[argc++] = OP_FANOUT;
+                    fanout = 1;
+                    i += 2;
+                } else {
+                    argv[argc++] = OP_PIPE;
+                    i++;
+                }
+                continue;
+            case '&':
+                argv[argc++] = OP_AMP;
+                fanout = 0;
+                i++;
+                continue;
+            case ';':
+                argv[argc++] = OP_SEMI;
+                fanout = 0;
+                i++;
+                continue;
+            case '<':
+                if (cmdline[i + 1] == '&') {
+                    argv[argc++] = OP_DUPIN;
+                    i += 2;
+                } else {
+                    argv[argc++] = OP_IN;
+                    i++;
+                }
+                continue;
+            case '>':
+                if (cmdline[i + 1] == '>') {
+                    argv[argc++] = OP_APPEND;
+                    i += 2;
+                } else if (cmdline[i + 1] == '&') {
+                    argv[argc++] = OP_DUP;
+                    i += 2;
+                } else {
+                    argv[argc++] = OP_OUT;
+                    i++;
+                }
+                continue;
+        }
+
+        /* a word */
+        start = i;
+        argv[argc++] = out;
+        while (1) {
+            j = lex_scan(cmdline, i, len);
+            memcpy(out, cmdline + i, j - i);
+            out += j - i;
+            plain = j;
+            if ((i = j) == len || IS_BLANK(cmdline[i]) || IS_OPERATOR(cmdline[i]))
+                break;
+
+            if (cmdline[i] == '\'') {
+                const char *q = memchr(cmdline + i + 1, '\'', len - i - 1);
+                j = q ? (size_t) (q - cmdline) : len;
+                memcpy(out, cmdline + i + 1, j - i - 1);
+                out += j - i - 1;
+                i = q ? j + 1 : len;
+            } else if (cmdline[i] == '"') {
+                for (i++; i < len && cmdline[i] != '"';) {
+                    if (cmdline[i] == '$') {
+                        out = lex_dollar(cmdline, &i, out, CTL_QVAR);
+                        continue;
+                    }
+                    if (cmdline[i] == '`') {
+                        out = lex_subst(cmdline, &i, out, CTL_QSUB);
+                        continue;
+                    }
+                    if (cmdline[i] == '\\' && i + 1 < len && strchr("\"\\$`", cmdline[i + 1]))
+                        i++;
+                    *out++ = cmdline[i++];
+                }
+                if (i < len)
+                    i++;
+            } else if (cmdline[i] == '$') {
+                out = lex_dollar(cmdline, &i, out, CTL_VAR);
+            } else if (cmdline[i] == '`') {
+                out = lex_subst(cmdline, &i, out, CTL_SUB);
+            } else { /* backslash */
+                if (i + 1 < len && cmdline[i + 1] != '\n')
+                    *out++ = cmdline[i + 1];
+                i = (i + 2 < len) ? i + 2 : len;
+            }
+        }
+        *out++ = '\0';
+
+        /* an unquoted number right before < or > is the fd it redirects */
+        if (i < len && (cmdline[i] == '<' || cmdline[i] == '>') &&
+            strspn(cmdline + start, "0123456789") == i - start) {
+            if (argc == maxargc) {
+                argv = (char **) arena_grow(&cmd_arena, argv, (maxargc + 1) * sizeof(char *),
+                                            (2 * maxargc + 1) * sizeof(char *));
+                maxargc *= 2;
+            }
+            argv[argc] = argv[argc - 1];
+            argv[argc++ - 1] = OP_IONUM;
+        }
+
+        /* a comma ending the word, not quoted, starts a branch of |> */
+        if (fanout && plain == i && i > start && cmdline[i - 1] == ',') {
+            out[-2] = '\0';
+            if (argv[argc - 1][0] == '\0') {
+                argv[argc - 1] = OP_COMMA;
+            } else {
+                if (argc == maxargc) {
+                    argv = (char **) arena_grow(&cmd_arena, argv, (maxargc + 1) * sizeof(char *),
+                                                (2 * maxargc + 1) * sizeof(char *));
+                    maxargc *= 2;
+                }
+                argv[argc++] = OP_COMMA;
+            }
+        }
+    }
+    argv[argc] = NULL;
+    *argvp = argv;
+    return argc;
+}
+
+/*
+ * lex_scan_scalar - Index of the first special character of
+ *     cmdline[i..len), len if there is none
+ */
+static size_t lex_scan_scalar(const char *cmdline, size_t i, size_t len) {
+    while (i < len && !lex_special[(unsigned char) cmdline[i]])
+        i++;
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * lex_scan_sse2 - lex_scan testing 16 characters at a time
+ */
+__attribute__ ((target("sse2")))
+static size_t lex_scan_sse2(const char *cmdline, size_t i, size_t len) {
+    static const char set[] = LEX_SPECIAL;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *) (cmdline + i));
+        __m128i m = _mm_setzero_si128();
+        for (size_t k = 0; k < sizeof(set) - 1; k++)
+            m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8(set[k])));
+        unsigned int bits = (unsigned int) _mm_movemask_epi8(m);
+        if (bits)
+            return i + __builtin_ctz(bits);
+    }
+    return lex_scan_scalar(cmdline, i, len);
+}
+
+/*
+ * lex_scan_avx2 - lex_scan testing 32 characters at a time
+ */
+__attribute__ ((target("avx2")))
+static size_t lex_scan_avx2(const char *cmdline, size_t i, size_t len) {
+    static const char set[] = LEX_SPECIAL;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *) (cmdline + i));
+        __m256i m = _mm256_setzero_si256();
+        for (size_t k = 0; k < sizeof(set) - 1; k++)
+            m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_set1_epi8(set[k])));
+        unsigned int bits = (unsigned int) _mm256_movemask_epi8(m);
+        if (bits)
+            return i + __builtin_ctz(bits);
+    }
+    return lex_scan_sse2(cmdline, i, len);
+}
+#endif
+
+/*
+ * lex_init - Fill the table of special characters and pick the widest
+ *     lex_scan the CPU supports
+ */
+void lex_init(void) {
+    for (const char *p = LEX_SPECIAL; *p; p++)
+        lex_special[(unsigned char) *p] = 1;
+
+    lex_scan = lex_scan_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        lex_scan = lex_scan_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        lex_scan = lex_scan_sse2;
+#endif
+}
+
+/* 
+ * builtin_cmd - If the user has typed a built-in command then execute
+ *    it immediately.  
+ */
+int builtin_cmd(char **argv) {
+
+    if (!strcmp(argv[0], "quit")) {
+        exit(0);
+    } else if (!strcmp(argv[0], "jobs")) {
+        listjobs();
+        last_status = 0;
+        return 1;
+    } else if (!strcmp(argv[0], "bg") || !strcmp(argv[0], "fg")) {
+        last_status = do_bgfg(argv);
+        return 1;
+    } else if (!strcmp(argv[0], "parallel")) {
+        last_status = do_parallel(argv);
+        return 1;
+    } else if (!strcmp(argv[0], "hash")) {
+        last_status = do_hash(argv);
+        return 1;
+    } else if (!strcmp(argv[0], "alias")) {
+        last_status = alias_add(argv);
+        return 1;
+    } else if (!strcmp(argv[0], "history")) {
+        last_status = do_history(argv);
+        return 1;
+    } else if (!strcmp(argv[0], "echo")) {
+        last_status = do_echo(argv);
+        return 1;
+    } else if (!strcmp(argv[0], "printf")) {
+        last_status = do_printf(argv);
+        return 1;
+    } else if (!strcmp(argv[0], "test") || !strcmp(argv[0], "[")) {
+        last_status = do_test(argv);
+        return 1;
+    } else if (!strcmp(argv[0], "cd")) {
+        last_status = do_cd(argv);
+        return 1;
+    } else if (!strcmp(argv[0], "pwd")) {
+        last_status = do_pwd(argv);
+        return 1;
+    } else if (!strcmp(argv[0], "true") || !strcmp(argv[0], "false")) {
+        last_status = (argv[0][0] == 'f');
+        return 1;
+    } else if (!strcmp(argv[0], "export")) {
+        last_status = do_export(argv);
+        return 1;
+    } else if (!strcmp(argv[0], "source") || !strcmp(argv[0], ".")) {
+        last_status = do_source(argv);
+        return 1;
+    } else if (!strcmp(argv[0], "unset")) {
+        last_status = do_unset(argv);
+        return 1;
+    } else if (!strcmp(argv[0], "trace")) {
+        last_status = do_trace(argv);
+        return 1;
+    } else if (!strcmp(argv[0], "wait")) {
+        last_status = do_wait(argv);
+        return 1;
+    }
+
+    return 0;     /* not a builtin command */
+}
+
+/* 
+ * alias_add - Execute the builtin alias command
+ *     alias                     list all aliases
+ *     alias name                print one alias
+ *     alias name = 'command'    define an alias, also name=command
+ *     alias -f file             define the aliases of a file
+ */
+int alias_add(char **argv) {
+    struct alias_t *p;
+    char *name = argv[1], *value, *eq;
+
+    if (name == NULL) {
+        for (int i = 0; i < HASHSIZE; i++)
+            for (p = alias_hash[i]; p != NULL; p = p->next)
+                printf("alias %s='%s'\n", p->name, p->value);
+        return 0;
+    }
+    if (!strcmp(name, "-f")) {
+        if (argv[2] == NULL || argv[3] != NULL) {
+            fprintf(stderr, "usage: alias -f file\n");
+            return 2;
+        }
+        return alias_load(argv[2]);
+    }
+
+    if ((eq = strchr(name, '=')) != NULL) {         /* name=command */
+        name = arena_strndup(&cmd_arena, name, eq - name); /* a script runs the words again */
+        value = eq[1] ? eq + 1 : argv[2];
+        if (eq[1] && argv[2] != NULL)
+            value = NULL;
+    } else if (argv[2] == NULL) {                   /* alias name */
+        if ((p = alias_find(name)) == NULL) {
+            fprintf(stderr, "alias: %s: not found\n", name);
+            return 1;
+        }
+        printf("alias %s='%s'\n", p->name, p->value);
+        return 0;
+    } else if (!strcmp(argv[2], "=")) {             /* name = command */
+        value = argv[3];
+        if (value != NULL && argv[4] != NULL)
+            value = NULL;
+    } else
+        value = NULL;
+
+    if (value == NULL || name[0] == '\0') {
+        fprintf(stderr, "Error command of alias\n");
+        return 2;
+    }
+    alias_define(name, value);
+    return 0;
+}
+
+/*
+ * alias_find - Find an alias by name
+ */
+struct alias_t *alias_find(char *name) {
+    for (struct alias_t *p = alias_hash[strhash(name) % HASHSIZE]; p != NULL; p = p->next)
+        if (!strcmp(p->name, name))
+            return p;
+    return NULL;
+}
+
+/*
+ * alias_define - Add or replace an alias. The command is split into
+ *     words here, once, so expanding the alias only copies pointers.
+ *     The words and their text share one allocation.
+ */
+void alias_define(char *name, char *value) {
+    unsigned int h = strhash(name) % HASHSIZE;
+    size_t vlen = strlen(value), size;
+    char *line, **words, *text;
+    struct alias_t *p;
+    struct arena_mark_t mark;
+    int argc;
+
+    if ((p = alias_find(name)) == NULL) {
+        p = (struct alias_t *) calloc(1, sizeof(struct alias_t));
+        p->name = strdup(name);
+        p->next = alias_hash[h];
+        alias_hash[h] = p;
+        nalias++;
+    } else {
+        free(p->argv);
+    }
+    value = strdup(value);
+    free(p->value);
+    p->value = value;
+
+    line = (char *) malloc(vlen + 2);
+    memcpy(line, value, vlen);
+    line[vlen] = '\n';
+    line[vlen + 1] = '\0';
+    mark = arena_mark(&cmd_arena);
+    parseline(line, &words); /* the words are copied out of cmd_arena below */
+    free(line);
+
+    for (argc = 0, size = 0; words[argc] != NULL; argc++)
+        if (!IS_OP(words[argc]))
+            size += strlen(words[argc]) + 1;
+
+    p->argc = argc;
+    p->argv = (char **) malloc((argc + 1) * sizeof(char *) + size);
+    text = (char *) (p->argv + argc + 1);
+    for (int i = 0; i < argc; i++) {
+        if (IS_OP(words[i])) { /* operators keep their address */
+            p->argv[i] = words[i];
+            continue;
+        }
+        p->argv[i] = text;
+        text = stpcpy(text, words[i]) + 1;
+    }
+    p->argv[argc] = NULL;
+    arena_release(&cmd_arena, mark); /* also outside eval(), from the config */
+}
+
+/*
+ * alias_load - Define the aliases of a file, one per line, written as
+ *     [alias] name = 'command' or [alias] name=command. The file is
+ *     mapped in and parsed in place.
+ */
+int alias_load(char *filename) {
+    struct stat st;
+    char *text, *end, *line, *nl;
+    int fd, lineno = 0;
+
+    if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "alias: %s: %s\n", filename, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    /* private and writable: the names and commands are cut in place */
+    text = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (text == MAP_FAILED) {
+        fprintf(stderr, "alias: %s: %s\n", filename, strerror(errno));
+        return 1;
+    }
+
+    end = text + st.st_size;
+    for (line = text; line < end; line = nl + 1) {
+        lineno++;
+        if ((nl = memchr(line, '\n', end - line)) == NULL) {
+            /* a last line without '\n' has no byte to cut it with */
+            char *copy = strndup(line, end - line);
+            alias_parse_line(copy + strspn(copy, " \t"), filename, lineno);
+            free(copy);
+            break;
+        }
+        *nl = '\0';
+        alias_parse_line(line + strspn(line, " \t"), filename, lineno);
+    }
+    munmap(text, st.st_size);
+    return 0;
+}
+
+/*
+ * alias_parse_line - Define the alias of one line of an alias file
+ */
+void alias_parse_line(char *name, char *filename, int lineno) {
+    char *value, *eq, *e;
+
+    if (*name == '\0' || *name == '#')
+        return;
+    if (!strncmp(name, "alias", 5) && (name[5] == ' ' || name[5] == '\t'))
+        name += 5 + strspn(name + 5, " \t");
+    if ((eq = strchr(name, '=')) == NULL || eq == name) {
+        fprintf(stderr, "%s:%d: Error command of alias\n", filename, lineno);
+        return;
+    }
+    for (e = eq; e > name && (e[-1] == ' ' || e[-1] == '\t'); e--)
+        ;
+    *e = '\0';
+    value = eq + 1 + strspn(eq + 1, " \t");
+    e = value + strlen(value);
+    while (e > value && (e[-1] == ' ' || e[-1] == '\t' || e[-1] == '\r'))
+        *--e = '\0';
+    if (e - value >= 2 && (*value == '\'' || *value == '"') && e[-1] == *value) {
+        e[-1] = '\0';
+        value++;
+    }
+    alias_define(name, value);
+}
+
+/*
+ * alias_free - free the memory of all rename command
+ */
+void alias_free(void) {
+    for (int i = 0; i < HASHSIZE; i++) {
+        while (alias_hash[i] != NULL) {
+            struct alias_t *p = alias_hash[i]->next;
+            free(alias_hash[i]->name);
+            free(alias_hash[i]->value);
+            free(alias_hash[i]->argv);
+            free(alias_hash[i]);
+            alias_hash[i] = p;
+        }
+    }
+    nalias = 0;
+    return;
+}
+
+/* 
+ * do_bgfg - Execute the builtin bg and fg commands
+ */
+int do_bgfg(char **argv) {
+
+    struct job_t *job;
+
+
+    /* have no argument */
+    if (argv[1] == NULL) {
+        printf("%s command requires PID or %%jobid argument\n", argv[0]);
+        return 2;
+    }
+
+    /* job id */
+    if (argv[1][0] == '%') {
+        int jid = atoi(&argv[1][1]);
+        job = getjobjid(jid);
+        if (job == NULL) {
+            printf("%%%d: no such job\n", jid);
+            return 1;
+        }
+    } else if (isdigit(argv[1][0])) {//pid
+        int pid = atoi(argv[1]);
+        job = getjobpid(pid);
+        if (job == NULL) {
+            printf("(%d): no such process\n", pid);
+            return 1;
+        }
+    } else {
+        printf("%s: argument must be a PID or %%jobid\n", argv[0]);
+        return 2;
+    }
+
+    kill(-(job->pgid), SIGCONT);
+    trace_mark("continue", job->pgid, job->jid, argv[0]);
+
+    if (!strcmp(argv[0], "bg")) {
+        setjobstate(job, BG);
+        printf("[%d] (%d) %s", job->jid, job->pgid, job->cmdline);
+        return 0;
+    }
+    setjobstate(job, FG);
+    waitfg(job->pgid); /* deletejob() sets last_status if it is done */
+    return last_status;
+
+}
+
+/*
+ * wait_match - Whether a running job (job) or a finished one (d) is one
+ *     of the n given to wait, each as jid[k] (%jid) or pid[k]. n == 0
+ *     matches every job.
+ */
+static int wait_match(struct job_t *job, struct done_t *d, int *jid, pid_t *pid, int n) {
+    for (int k = 0; k < n; k++) {
+        if (jid[k] > 0 ? (job ? job->jid : d->jid) == jid[k]
+                       : job ? getjobpid(pid[k]) == job : (d->pgid == pid[k] || d->last == pid[k]))
+            return 1;
+    }
+    return n == 0;
+}
+
+/* wait_done - The newest entry of done_ring for a job, NULL if none */
+static struct done_t *wait_done(int jid, pid_t pid) {
+    for (unsigned long i = ndone; i > 0 && i + NDONE > ndone; i--)
+        if (wait_match(NULL, &done_ring[(i - 1) % NDONE], &jid, &pid, 1))
+            return &done_ring[(i - 1) % NDONE];
+    return NULL;
+}
+
+/*
+ * wait_any - wait -n: the status of the first of the jobs to be done
+ *     that wait has not reported yet, 127 if none is left to wait for
+ */
+static int wait_any(int *jid, pid_t *pid, int n) {
+    unsigned long i = (ndone > NDONE) ? ndone - NDONE : 0;
+    int running;
+
+    while (1) {
+        if (ndone - i > NDONE) /* the ring went round while we waited */
+            i = ndone - NDONE;
+        for (; i < ndone; i++) {
+            struct done_t *d = &done_ring[i % NDONE];
+            if (!d->waited && wait_match(NULL, d, jid, pid, n)) {
+                d->waited = 1;
+                return d->status;
+            }
+        }
+        running = 0;
+        for (int j = 1; j <= topjid && !running; j++)
+            running = (jobs[j] != NULL && jobs[j]->state == BG && jobs[j]->ondone == NULL &&
+                       wait_match(jobs[j], NULL, jid, pid, n));
+        if (!running)
+            return 127;
+        event_wait(0);
+    }
+}
+
+/*
+ * do_wait - Execute the builtin wait command
+ *     wait [-n] [%jid|pid...]
+ * Waits until the jobs given, or all background jobs, are done and
+ * returns the status of the last one given; with -n until any one of
+ * them is, and returns its status. The shell sleeps in the event loop,
+ * woken by the pidfds of the jobs. The status of a job that is already
+ * done is taken from done_ring.
+ */
+int do_wait(char **argv) {
+    int any = (argv[1] != NULL && !strcmp(argv[1], "-n")), n = 0, status = 0, *jid;
+    char **arg = argv + 1 + any;
+    pid_t *pid;
+
+    while (arg[n] != NULL)
+        n++;
+    jid = (int *) arena_alloc(&cmd_arena, (n + 1) * sizeof(int));
+    pid = (pid_t *) arena_alloc(&cmd_arena, (n + 1) * sizeof(pid_t));
+    for (int k = 0; k < n; k++) {
+        char *a = arg[k] + (arg[k][0] == '%');
+
+        if (*a == '\0' || strspn(a, "0123456789") != strlen(a) || atoi(a) <= 0) {
+            builtin_error("wait: `%s': not a pid or valid job spec\n", arg[k]);
+            return 2;
+        }
+        jid[k] = (arg[k][0] == '%') ? atoi(a) : 0;
+        pid[k] = jid[k] ? 0 : atoi(a);
+    }
+    if (any)
+        return wait_any(jid, pid, n);
+
+    if (n == 0) {
+        for (int j = 1; j <= topjid; j++)
+            while (jobs[j] != NULL && jobs[j]->state == BG && jobs[j]->ondone == NULL)
+                event_wait(0);
+        for (int i = 0; i < NDONE; i++)
+            done_ring[i].waited = 1;
+        return 0;
+    }
+    for (int k = 0; k < n; k++) {
+        struct job_t *job = jid[k] ? getjobjid(jid[k]) : getjobpid(pid[k]);
+        struct done_t *d;
+
+        if (job != NULL && job->ondone == NULL) {
+            pid_t pgid = job->pgid;
+
+            while ((job = getjobpgid(pgid)) != NULL && job->state == BG)
+                event_wait(0);
+            if (job != NULL) { /* stopped */
+                status = 128 + SIGTSTP;
+                continue;
+            }
+            jid[k] = 0;
+            pid[k] = pgid;
+        }
+        if ((d = wait_done(jid[k], pid[k])) == NULL) {
+            builtin_error("wait: %s: no such job\n", arg[k]);
+            status = 127;
+            continue;
+        }
+        d->waited = 1;
+        status = d->status;
+    }
+    return status;
+}
+
+/*
+ * builtin_error - Print an error of a builtin after what it has written
+ *     to stdout so far
+ */
+void builtin_error(const char *fmt, ...) {
+    va_list ap;
+
+    fflush(stdout);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+/*
+ * unescape - Decode the backslash escape at s for echo -e and printf.
+ *     Returns the character and sets *len to the length of the escape,
+ *     returns -1 for \c (no more output).
+ */
+int unescape(const char *s, int *len) {
+    static const char from[] = "abefnrtv\\", to[] = "\a\b\033\f\n\r\t\v\\";
+    const char *p;
+    int c = 0, n = 1;
+
+    if (s[1] == 'c')
+        return -1;
+    if (s[1] != '\0' && (p = strchr(from, s[1])) != NULL) {
+        *len = 2;
+        return to[p - from];
+    }
+    if (s[1] >= '0' && s[1] <= '7') { /* \NNN, or \0NNN as echo writes it */
+        if (s[1] == '0')
+            n++;
+        for (int k = 0; k < 3 && s[n] >= '0' && s[n] <= '7'; k++)
+            c = c * 8 + s[n++] - '0';
+        *len = n;
+        return c & 0xff;
+    }
+    if (s[1] == 'x' && isxdigit(s[2])) {
+        for (n = 2; n < 4 && isxdigit(s[n]); n++)
+            c = c * 16 + (isdigit(s[n]) ? s[n] - '0' : tolower(s[n]) - 'a' + 10);
+        *len = n;
+        return c;
+    }
+    *len = 1; /* not an escape, the backslash is printed as is */
+    return '\\';
+}
+
+/*
+ * do_echo - Execute the builtin echo command
+ *     echo [-neE] [arg ...]
+ */
+int do_echo(char **argv) {
+    int newline = 1, escapes = 0, i, c, n;
+
+    for (i = 1; argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0' &&
+                strspn(argv[i] + 1, "neE") == strlen(argv[i] + 1); i++) {
+        for (char *o = argv[i] + 1; *o; o++) {
+            if (*o == 'n')
+                newline = 0;
+            else
+                escapes = (*o == 'e');
+        }
+    }
+
+    for (int first = i; argv[i] != NULL; i++) {
+        if (i > first)
+            putchar(' ');
+        if (!escapes) {
+            fputs(argv[i], stdout);
+            continue;
+        }
+        for (char *p = argv[i]; *p; p++) {
+            if (*p != '\\') {
+                putchar(*p);
+                continue;
+            }
+            if ((c = unescape(p, &n)) < 0)
+                return 0;
+            putchar(c);
+            p += n - 1;
+        }
+    }
+    if (newline)
+        putchar('\n');
+    return 0;
+}
+
+/* printf_badnum - Report an argument of printf that is not a number, returns the status */
+static int printf_badnum(char *arg) {
+    builtin_error("printf: %s: invalid number\n", arg);
+    return 1;
+}
+
+/*
+ * do_printf - Execute the builtin printf command
+ *     printf format [arg ...]
+ *
+ * The format is reused while arguments are left, a missing argument is
+ * an empty string or 0. An argument starting with a quote stands for
+ * the code of the character after it.
+ */
+int do_printf(char **argv) {
+    char **arg, **first, spec[32], *a, *end;
+    int status = 0, c, n;
+
+    if (argv[1] == NULL) {
+        builtin_error("printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+
+    arg = &argv[2];
+    do {
+        first = arg;
+        for (char *f = argv[1]; *f; f++) {
+            if (*f == '\\') {
+                if ((c = unescape(f, &n)) < 0)
+                    return status;
+                putchar(c);
+                f += n - 1;
+                continue;
+            }
+            if (*f != '%') {
+                putchar(*f);
+                continue;
+            }
+            if (f[1] == '%') {
+                putchar('%');
+                f++;
+                continue;
+            }
+
+            /* %[flags][width][.precision]conversion */
+            n = strspn(f + 1, "-+ #0123456789.");
+            if (n > 20 || f[n + 1] == '\0' || strchr("diouxXcseEfgGb", f[n + 1]) == NULL) {
+                builtin_error("printf: %.*s: invalid directive\n", n + 2, f);
+                return 1;
+            }
+            c = f[n + 1];
+            a = (*arg != NULL) ? *arg++ : NULL;
+            memcpy(spec, f, n + 1); /* integers are printed as long long */
+            strcpy(spec + n + 1, strchr("diouxX", c) ? (char[]) {'l', 'l', c, 0} : (char[]) {c, 0});
+            f += n + 1;
+
+            if (c == 's' || c == 'c' || c == 'b') {
+                if (c == 'b') { /* the argument with its escapes decoded */
+                    for (char *p = a ? a : ""; *p; p++) {
+                        if (*p != '\\')
+                            putchar(*p);
+                        else if ((c = unescape(p, &n)) < 0)
+                            return status;
+                        else {
+                            putchar(c);
+                            p += n - 1;
+                        }
+                    }
+                } else if (c == 's')
+                    printf(spec, a ? a : "");
+                else if (a != NULL && a[0] != '\0')
+                    printf(spec, a[0]);
+                continue;
+            }
+
+            if (a != NULL && (a[0] == '\'' || a[0] == '"')) {
+                if (strchr("eEfgG", c))
+                    printf(spec, (double) (unsigned char) a[1]);
+                else
+                    printf(spec, (long long) (unsigned char) a[1]);
+                continue;
+            }
+            /* a bad number is reported, then printed as far as it was read */
+            errno = 0;
+            end = a;
+            if (strchr("eEfgG", c)) {
+                double d = a ? strtod(a, &end) : 0.0;
+                if (a != NULL && (end == a || *end != '\0' || errno == ERANGE))
+                    status = printf_badnum(a);
+                printf(spec, d);
+            } else if (c == 'd' || c == 'i') {
+                long long v = a ? strtoll(a, &end, 0) : 0;
+                if (a != NULL && (end == a || *end != '\0' || errno == ERANGE))
+                    status = printf_badnum(a);
+                printf(spec, v);
+            } else {
+                unsigned long long v = a ? strtoull(a, &end, 0) : 0;
+                if (a != NULL && (end == a || *end != '\0' || errno == ERANGE))
+                    status = printf_badnum(a);
+                printf(spec, v);
+            }
+        }
+    } while (*arg != NULL && arg != first);
+
+    return status;
+}
+
+/*
+ * do_test - Execute the builtin test command, also called [
+ *     test expression, [ expression ]
+ *
+ * Returns 0 if the expression is true, 1 if it is false and 2 on a
+ * syntax error. The operators are the ones of POSIX test, with ! ( )
+ * -a -o, in the usual precedence.
+ */
+int do_test(char **argv) {
+    struct test_t t;
+    int argc, r;
+
+    for (argc = 1; argv[argc] != NULL; argc++)
+        ;
+    if (argv[0][0] == '[') {
+        if (strcmp(argv[argc - 1], "]")) {
+            builtin_error("[: missing `]'\n");
+            return 2;
+        }
+        argc--;
+    }
+
+    t.argv = argv + 1;
+    t.argc = argc - 1;
+    t.i = 0;
+    t.err = 0;
+    if (t.argc == 0)
+        return 1;
+    r = test_or(&t);
+    if (!t.err && t.i < t.argc) {
+        builtin_error("%s: %s: unexpected argument\n", argv[0], t.argv[t.i]);
+        t.err = 1;
+    }
+    return t.err ? 2 : !r;
+}
+
+/* test_or - expression: and-expression [-o expression] */
+int test_or(struct test_t *t) {
+    int r = test_and(t);
+
+    while (t->i < t->argc && !strcmp(t->argv[t->i], "-o")) {
+        t->i++;
+        r = test_and(t) || r; /* both sides are parsed */
+    }
+    return r;
+}
+
+/* test_and - and-expression: not-expression [-a and-expression] */
+int test_and(struct test_t *t) {
+    int r = test_not(t);
+
+    while (t->i < t->argc && !strcmp(t->argv[t->i], "-a")) {
+        t->i++;
+        r = test_not(t) && r;
+    }
+    return r;
+}
+
+/* test_not - not-expression: [!] primary */
+int test_not(struct test_t *t) {
+    if (t->i + 1 < t->argc && !strcmp(t->argv[t->i], "!")) {
+        t->i++;
+        return !test_not(t);
+    }
+    return test_primary(t);
+}
+
+/* is_test_binary - Is word a binary operator of test */
+static int is_test_binary(char *w) {
+    static char *ops[] = {"=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge",
+                          "-nt", "-ot", "-ef", NULL};
+
+    for (int i = 0; ops[i] != NULL; i++)
+        if (!strcmp(w, ops[i]))
+            return 1;
+    return 0;
+}
+
+/* test_primary - ( expression ), a unary or binary test, or a string */
+int test_primary(struct test_t *t) {
+    char **a = t->argv + t->i;
+    int left = t->argc - t->i, r;
+
+    if (left <= 0) {
+        builtin_error("test: argument expected\n");
+        t->err = 1;
+        return 0;
+    }
+    if (left >= 3 && is_test_binary(a[1])) {
+        t->i += 3;
+        return test_binary(t, a[0], a[1], a[2]);
+    }
+    if (left >= 2 && !strcmp(a[0], "(")) {
+        t->i++;
+        r = test_or(t);
+        if (t->i >= t->argc || strcmp(t->argv[t->i], ")")) {
+            if (!t->err)
+                builtin_error("test: `)' expected\n");
+            t->err = 1;
+            return 0;
+        }
+        t->i++;
+        return r;
+    }
+    if (left >= 2 && a[0][0] == '-' && a[0][1] != '\0' && a[0][2] == '\0' &&
+        strchr("zntLhrwxefdspSbcugkOG", a[0][1]) != NULL) {
+        t->i += 2;
+        return test_unary(a[0][1], a[1]);
+    }
+    t->i++;
+    return a[0][0] != '\0';
+}
+
+/* test_unary - -op arg */
+int test_unary(int op, char *arg) {
+    struct stat st;
+
+    switch (op) {
+        case 'z': return arg[0] == '\0';
+        case 'n': return arg[0] != '\0';
+        case 't': return isatty(atoi(arg));
+        case 'L':
+        case 'h': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+        case 'r': return access(arg, R_OK) == 0;
+        case 'w': return access(arg, W_OK) == 0;
+        case 'x': return access(arg, X_OK) == 0;
+    }
+    if (stat(arg, &st) < 0)
+        return 0;
+    switch (op) {
+        case 'f': return S_ISREG(st.st_mode);
+        case 'd': return S_ISDIR(st.st_mode);
+        case 's': return st.st_size > 0;
+        case 'p': return S_ISFIFO(st.st_mode);
+        case 'S': return S_ISSOCK(st.st_mode);
+        case 'b': return S_ISBLK(st.st_mode);
+        case 'c': return S_ISCHR(st.st_mode);
+        case 'u': return (st.st_mode & S_ISUID) != 0;
+        case 'g': return (st.st_mode & S_ISGID) != 0;
+        case 'k': return (st.st_mode & S_ISVTX) != 0;
+        case 'O': return st.st_uid == geteuid();
+        case 'G': return st.st_gid == getegid();
+    }
+    return 1; /* -e */
+}
+
+/* test_binary - a op b */
+int test_binary(struct test_t *t, char *a, char *op, char *b) {
+    struct stat sa, sb;
+    long long x, y;
+    char *end1, *end2;
+
+    if (op[0] != '-') {
+        int c = strcmp(a, b);
+        switch (op[0]) {
+            case '!': return c != 0;
+            case '<': return c < 0;
+            case '>': return c > 0;
+        }
+        return c == 0;
+    }
+
+    if (!strcmp(op, "-nt") || !strcmp(op, "-ot") || !strcmp(op, "-ef")) {
+        int ha = (stat(a, &sa) == 0), hb = (stat(b, &sb) == 0);
+        if (op[1] == 'e')
+            return ha && hb && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+        if (op[1] == 'o') /* a -ot b is b -nt a */
+            return hb && (!ha || sb.st_mtim.tv_sec > sa.st_mtim.tv_sec ||
+                          (sb.st_mtim.tv_sec == sa.st_mtim.tv_sec && sb.st_mtim.tv_nsec > sa.st_mtim.tv_nsec));
+        return ha && (!hb || sa.st_mtim.tv_sec > sb.st_mtim.tv_sec ||
+                      (sa.st_mtim.tv_sec == sb.st_mtim.tv_sec && sa.st_mtim.tv_nsec > sb.st_mtim.tv_nsec));
+    }
+
+    x = strtoll(a, &end1, 10);
+    y = strtoll(b, &end2, 10);
+    if (end1 == a || *end1 != '\0' || end2 == b || *end2 != '\0') {
+        builtin_error("test: %s: integer expression expected\n", (end1 == a || *end1) ? a : b);
+        t->err = 1;
+        return 0;
+    }
+    if (!strcmp(op, "-eq")) return x == y;
+    if (!strcmp(op, "-ne")) return x != y;
+    if (!strcmp(op, "-lt")) return x < y;
+    if (!strcmp(op, "-le")) return x <= y;
+    if (!strcmp(op, "-gt")) return x > y;
+    return x >= y;
+}
+
+/*
+ * pin_parse - Read the options of pin into sched
+ *     pin [-c cpulist] [-n nice] [-p policy[:priority]] command | %jid | pid ...
+ *
+ * Returns the arguments after the options, NULL on an error.
+ */
+char **pin_parse(char **argv, struct sched_t *sched) {
+    static const char *policies[] = {"other", "fifo", "rr", "batch", "", "idle", NULL};
+    char *arg, *end;
+    int i;
+
+    memset(sched, 0, sizeof(*sched));
+    for (i = 1; argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0' && argv[i][2] == '\0'; i++) {
+        if (strchr("cnp", argv[i][1]) == NULL || (arg = argv[i + 1]) == NULL) {
+            builtin_error("usage: pin [-c cpulist] [-n nice] [-p policy[:priority]] command | %%jid | pid ...\n");
+            return NULL;
+        }
+        i++;
+        switch (argv[i - 1][1]) {
+            case 'c':
+                if (!cpulist_parse(arg, &sched->cpus)) {
+                    builtin_error("pin: %s: bad CPU list\n", arg);
+                    return NULL;
+                }
+                sched->setcpus = 1;
+                break;
+            case 'n':
+                sched->nice = strtol(arg, &end, 10);
+                if (end == arg || *end != '\0' || sched->nice < -20 || sched->nice > 19) {
+                    builtin_error("pin: %s: nice must be -20..19\n", arg);
+                    return NULL;
+                }
+                sched->setnice = 1;
+                break;
+            case 'p':
+                sched->prio = 0;
+                for (sched->policy = 0; policies[sched->policy] != NULL; sched->policy++) {
+                    size_t n = strlen(policies[sched->policy]);
+                    if (n > 0 && !strncmp(arg, policies[sched->policy], n) && (arg[n] == '\0' || arg[n] == ':'))
+                        break;
+                }
+                if (policies[sched->policy] == NULL) {
+                    builtin_error("pin: %s: policy must be other, batch, idle, fifo or rr\n", arg);
+                    return NULL;
+                }
+                if ((end = strchr(arg, ':')) != NULL)
+                    sched->prio = atoi(end + 1);
+                else if (sched->policy == SCHED_FIFO || sched->policy == SCHED_RR)
+                    sched->prio = 1;
+                sched->setpolicy = 1;
+                break;
+        }
+    }
+
+    return &argv[i];
+}
+
+/*
+ * cpulist_parse - Read a CPU list like 0-3,8,10-11 into set. Returns 0
+ *     if it is malformed.
+ */
+int cpulist_parse(char *list, cpu_set_t *set) {
+    char *p = list;
+    long lo, hi;
+
+    CPU_ZERO(set);
+    do {
+        if (!isdigit(*p))
+            return 0;
+        lo = hi = strtol(p, &p, 10);
+        if (*p == '-') {
+            if (!isdigit(*++p))
+                return 0;
+            hi = strtol(p, &p, 10);
+        }
+        if (lo > hi || hi >= CPU_SETSIZE)
+            return 0;
+        for (long c = lo; c <= hi; c++)
+            CPU_SET(c, set);
+    } while (*p++ == ',');
+
+    return p[-1] == '\0';
+}
+
+/* cpulist_format - Write set as a CPU list into buf */
+char *cpulist_format(cpu_set_t *set, char *buf, size_t size) {
+    size_t len = 0;
+
+    buf[0] = '\0';
+    for (int c = 0; c < CPU_SETSIZE && len < size; c++) {
+        int e = c;
+        if (!CPU_ISSET(c, set))
+            continue;
+        while (e + 1 < CPU_SETSIZE && CPU_ISSET(e + 1, set))
+            e++;
+        len += snprintf(buf + len, size - len, (e > c) ? "%s%d-%d" : "%s%d", len ? "," : "", c, e);
+        c = e;
+    }
+    return buf;
+}
+
+/*
+ * sched_apply - Set the options of sched on the thread tid, 0 for the
+ *     calling one. Returns -1 with errno set on the first failure.
+ */
+int sched_apply(pid_t tid, struct sched_t *sched) {
+    struct sched_param sp;
+
+    if (sched->setcpus && sched_setaffinity(tid, sizeof(cpu_set_t), &sched->cpus) < 0)
+        return -1;
+    if (sched->setpolicy) {
+        sp.sched_priority = sched->prio;
+        if (sched_setscheduler(tid, sched->policy, &sp) < 0)
+            return -1;
+    }
+    if (sched->setnice && setpriority(PRIO_PROCESS, tid, sched->nice) < 0) /* per thread on Linux */
+        return -1;
+    return 0;
+}
+
+/*
+ * do_pin - Apply the pin options to running jobs, given as %jid or pid.
+ *     Every thread of every process of the job is changed, so the
+ *     threads a program has already started follow too. Without options
+ *     the settings of the processes are listed.
+ */
+int do_pin(char **argv, struct sched_t *sched) {
+    static const char *policies[] = {"other", "fifo", "rr", "batch", "iso", "idle", "deadline"};
+    int status = 0, show = !sched->setcpus && !sched->setnice && !sched->setpolicy;
+    struct job_t *job;
+    char path[64], cpus[256];
+
+    if (argv[0] == NULL) {
+        builtin_error("usage: pin [-c cpulist] [-n nice] [-p policy[:priority]] command | %%jid | pid ...\n");
+        return 2;
+    }
+
+    for (int i = 0; argv[i] != NULL; i++) {
+        if (argv[i][0] == '%')
+            job = getjobjid(atoi(&argv[i][1]));
+        else
+            job = getjobpid(atoi(argv[i]));
+        if (job == NULL) {
+            builtin_error("pin: %s: no such job\n", argv[i]);
+            status = 1;
+            continue;
+        }
+
+        for (int k = 0; k < job->npid; k++) {
+            pid_t pid = job->pid[k];
+            struct dirent *d;
+            DIR *dir;
+
+            if (show) {
+                cpu_set_t set;
+                errno = 0;
+                int nice = getpriority(PRIO_PROCESS, pid), policy = sched_getscheduler(pid);
+                if (policy < 0 || sched_getaffinity(pid, sizeof(set), &set) < 0)
+                    continue; /* already reaped */
+                printf("[%d] (%d) cpus %s nice %d policy %s\n", job->jid, pid,
+                       cpulist_format(&set, cpus, sizeof(cpus)), nice,
+                       (policy & ~SCHED_RESET_ON_FORK) < 7 ? policies[policy & ~SCHED_RESET_ON_FORK] : "?");
+                continue;
+            }
+
+            snprintf(path, sizeof(path), "/proc/%d/task", pid);
+            if ((dir = opendir(path)) == NULL)
+                continue; /* already reaped */
+            while ((d = readdir(dir)) != NULL) {
+                pid_t tid = atoi(d->d_name);
+                if (tid > 0 && sched_apply(tid, sched) < 0 && errno != ESRCH) {
+                    builtin_error("pin: %d: %s\n", tid, strerror(errno));
+                    status = 1;
+                }
+            }
+            closedir(dir);
+        }
+    }
+    return status;
+}
+
+/*
+ * do_cd - Execute the builtin cd command
+ *     cd [dir | -]
+ */
+int do_cd(char **argv) {
+    char *dir = argv[1], old[PATH_MAX], cwd[PATH_MAX];
+    int print = 0;
+
+    if (dir == NULL && (dir = var_get("HOME")) == NULL) {
+        builtin_error("cd: HOME not set\n");
+        return 1;
+    }
+    if (!strcmp(dir, "-")) {
+        if ((dir = var_get("OLDPWD")) == NULL) {
+            builtin_error("cd: OLDPWD not set\n");
+            return 1;
+        }
+        print = 1;
+    }
+
+    if (getcwd(old, sizeof(old)) == NULL)
+        old[0] = '\0';
+    if (chdir(dir) < 0) {
+        builtin_error("cd: %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+    if (old[0] != '\0')
+        var_set("OLDPWD", 6, old, VAR_EXPORT);
+    if (getcwd(cwd, sizeof(cwd)) != NULL) {
+        var_set("PWD", 3, cwd, VAR_EXPORT);
+        if (print)
+            printf("%s\n", cwd);
+    }
+    return 0;
+}
+
+/*
+ * do_pwd - Execute the builtin pwd command
+ */
+int do_pwd(char **argv) {
+    char cwd[PATH_MAX];
+
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        builtin_error("pwd: %s\n", strerror(errno));
+        return 1;
+    }
+    printf("%s\n", cwd);
+    return 0;
+}
+
+/*
+ * do_export - Execute the builtin export command
+ *     export [name[=value] ...]
+ *
+ * Without arguments it lists the environment of programs. A name
+ * alone exports the variable if it is set.
+ */
+int do_export(char **argv) {
+    int status = 0;
+    char **envp;
+
+    if (argv[1] == NULL) {
+        for (envp = var_envp(); *envp != NULL; envp++)
+            printf("export %s\n", *envp);
+        return 0;
+    }
+
+    for (int i = 1; argv[i] != NULL; i++) {
+        size_t n = var_name_len(argv[i]);
+
+        if (n == 0 || (argv[i][n] != '=' && argv[i][n] != '\0')) {
+            builtin_error("export: `%s': not a valid identifier\n", argv[i]);
+            status = 1;
+            continue;
+        }
+        if (argv[i][n] == '=')
+            var_assign(argv[i], VAR_EXPORT);
+        else
+            var_export(argv[i]);
+    }
+    return status;
+}
+
+/*
+ * do_parallel - Execute the builtin parallel command
+ *     parallel [-j N] command [args] [::: item ...]
+ *
+ * Runs command once per item, with {} in the arguments replaced by
+ * the item (or the item appended if there is no {}). The items are
+ * the words after ::: or else the lines of stdin. At most N jobs run
+ * at once, N defaults to the number of online CPUs. Every item is a
+ * job of its own in the job list. The stdout of each item is kept in
+ * memory and written in the order of the items.
+ */
+int do_parallel(char **argv) {
+    struct parjob_t **item = NULL;
+    int nitem = 0, maxitem = 0, emit = 0, running = 0, failed = 0;
+    long njob = sysconf(_SC_NPROCESSORS_ONLN);
+    char **cmd, **list = NULL, *line = NULL;
+    size_t linesize = 0;
+    int argc = 1, ncmd, eof = 0;
+
+    if (argv[argc] != NULL && !strncmp(argv[argc], "-j", 2)) {
+        char *n = argv[argc][2] ? &argv[argc][2] : argv[++argc];
+        if (n == NULL || (njob = atol(n)) < 1) {
+            printf("parallel: -j requires a positive number\n");
+            return 2;
+        }
+        argc++;
+    }
+    if (njob < 1)
+        njob = 1;
+    cmd = &argv[argc];
+    for (ncmd = 0; cmd[ncmd] != NULL && strcmp(cmd[ncmd], ":::"); ncmd++)
+        ;
+    if (ncmd == 0) {
+        printf("usage: parallel [-j N] command [args] [::: item ...]\n");
+        return 2;
+    }
+    if (cmd[ncmd] != NULL)
+        list = &cmd[ncmd + 1];
+
+    hash_check();
+    fflush(stdout);
+    while (1) {
+        /* start jobs while there are free slots and items left */
+        while (running < njob && !eof) {
+            char *arg;
+            if (list != NULL) {
+                if ((arg = *list) == NULL) {
+                    eof = 1;
+                    break;
+                }
+                list++;
+            } else {
+                ssize_t n = getline(&line, &linesize, stdin);
+                if (n <= 0) {
+                    eof = 1;
+                    break;
+                }
+                if (line[n - 1] == '\n')
+                    line[n - 1] = '\0';
+                arg = line;
+            }
+            if (nitem == maxitem) {
+                maxitem = maxitem ? 2 * maxitem : 64;
+                item = (struct parjob_t **) realloc(item, maxitem * sizeof(struct parjob_t *));
+            }
+            item[nitem] = parallel_start(cmd, ncmd, arg, list == NULL);
+            if (item[nitem]->pid > 0)
+                running++;
+            nitem++;
+        }
+
+        /* write the finished items in input order */
+        while (emit < nitem && item[emit]->fd < 0 && item[emit]->pid <= 0) {
+            struct parjob_t *p = item[emit];
+            for (size_t off = 0; off < p->len;) {
+                ssize_t n = write(STDOUT_FILENO, p->out + off, p->len - off);
+                if (n <= 0)
+                    break;
+                off += n;
+            }
+            if (p->status != 0)
+                failed++;
+            free(p->out);
+            free(p);
+            item[emit++] = NULL;
+        }
+        if (eof && emit == nitem)
+            break;
+
+        event_wait(0);
+        running = 0;
+        for (int i = emit; i < nitem; i++)
+            if (item[i] != NULL && item[i]->pid > 0)
+                running++;
+    }
+
+    free(item);
+    free(line);
+    return failed > 101 ? 101 : failed;
+}
+
+/*
+ * parallel_start - Start the job of one item of parallel with its stdout
+ *     going to a pipe watched by the event loop
+ */
+struct parjob_t *parallel_start(char **cmd, int ncmd, char *arg, int nullin) {
+    struct parjob_t *p = (struct parjob_t *) calloc(1, sizeof(struct parjob_t));
+    char **argv = (char **) malloc((ncmd + 2) * sizeof(char *));
+    char *cmdline, *q;
+    int fd[2], in = STDIN_FILENO, braces = 0;
+    size_t len = 2;
+
+    p->fd = -1;
+    p->status = 127;
+    for (int i = 0; i < ncmd; i++) {
+        if ((q = strstr(cmd[i], "{}")) == NULL) {
+            argv[i] = strdup(cmd[i]);
+        } else { /* the item replaces every {} of the word */
+            size_t n = strlen(cmd[i]) + 1, alen = strlen(arg);
+            for (char *r = q; (r = strstr(r, "{}")) != NULL; r += 2)
+                n += alen;
+            argv[i] = (char *) malloc(n);
+            argv[i][0] = '\0';
+            char *r = cmd[i];
+            for (; (q = strstr(r, "{}")) != NULL; r = q + 2) {
+                strncat(argv[i], r, q - r);
+                strcat(argv[i], arg);
+                braces = 1;
+            }
+            strcat(argv[i], r);
+        }
+        len += strlen(argv[i]) + 1;
+    }
+    if (!braces) {
+        argv[ncmd] = strdup(arg);
+        len += strlen(arg) + 1;
+        argv[ncmd + 1] = NULL;
+    } else
+        argv[ncmd] = NULL;
+
+    /* the job list wants a command line */
+    cmdline = (char *) malloc(len);
+    cmdline[0] = '\0';
+    for (int i = 0; argv[i] != NULL; i++) {
+        strcat(cmdline, argv[i]);
+        strcat(cmdline, argv[i + 1] ? " " : "\n");
+    }
+
+    char *name = argv[0];
+    if (is_accessable(argv)) {
+        if (nullin) /* stdin holds the items, not input for the jobs */
+            in = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (pipe2(fd, O_CLOEXEC) < 0) {
+            fprintf(stderr, "pipe error: %s\n", strerror(errno));
+        } else {
+            struct stage_t st = {argv, NULL, NULL};
+
+            if ((p->pid = launch(&st, 0, in, fd[1])) > 0) {
+                struct job_t *job;
+                addjob(p->pid, p->pid, BG, cmdline);
+                if ((job = getjobpgid(p->pid)) != NULL) {
+                    job->ondone = parallel_done;
+                    job->arg = p;
+                }
+                p->fd = fd[0];
+                fcntl(p->fd, F_SETFL, O_NONBLOCK);
+                watchfd(p->fd, parallel_read, p);
+            } else
+                close(fd[0]);
+            close(fd[1]);
+        }
+        if (in != STDIN_FILENO)
+            close(in);
+    }
+    argv[0] = name;
+
+    for (int i = 0; argv[i] != NULL; i++)
+        free(argv[i]);
+    free(argv);
+    free(cmdline);
+    return p;
+}
+
+/*
+ * parallel_read - Keep the output of an item of parallel
+ */
+void parallel_read(int fd, void *arg) {
+    struct parjob_t *p = (struct parjob_t *) arg;
+    ssize_t n;
+
+    while (1) {
+        if (p->size - p->len < 4096) {
+            p->size = p->size ? 2 * p->size : 16384;
+            p->out = (char *) realloc(p->out, p->size);
+        }
+        if ((n = read(fd, p->out + p->len, p->size - p->len)) > 0) {
+            p->len += n;
+            continue;
+        }
+        if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+            unwatchfd(fd);
+            close(fd);
+            p->fd = -1;
+        }
+        return;
+    }
+}
+
+/*
+ * parallel_done - The job of an item of parallel was reaped
+ */
+void parallel_done(struct job_t *job) {
+    struct parjob_t *p = (struct parjob_t *) job->arg;
+
+    p->status = job->status;
+    p->pid = 0;
+}
+
+/* 
+ * waitfg - Block until process pid is no longer the foreground process 不推荐使用 waitpid 函数
+ *     The event loop reaps the children while we wait.
+ */
+void waitfg(pid_t pgid) {
+    uint64_t t = trace_now();
+    int jid = pid2jid(pgid);
+
+    if (pgid == 0) 
+        return;
+
+    while (pgid == fgpgid())
+        event_wait(0);
+    trace_span("foreground", t, pgid, jid, NULL);
+    
+    return;
+
+}
+
+/***********************************************
+ * Arena allocator
+ *
+ * Everything a command line needs while it is evaluated (its copy, the
+ * argv vector, alias expansion, the pipeline stages) is bump-allocated
+ * from cmd_arena and dropped at once when eval() returns. The chunks
+ * are kept and reused, so releasing costs nothing and parsing does not
+ * call malloc per word.
+ **********************************************/
+
+/* arena_next - Make a chunk with room for n bytes the current one */
+static void arena_next(struct arena_t *a, size_t n) {
+    struct chunk_t *c = a->cur ? a->cur->next : a->first;
+
+    if (c == NULL || c->size < n) {
+        size_t size = n > ARENA_CHUNK ? n : ARENA_CHUNK;
+        struct chunk_t *nc = (struct chunk_t *) malloc(sizeof(struct chunk_t) + size);
+        if (nc == NULL)
+            app_error("arena: out of memory");
+        nc->size = size;
+        nc->next = c;           /* a too small chunk is kept for later */
+        if (a->cur)
+            a->cur->next = nc;
+        else
+            a->first = nc;
+        c = nc;
+    }
+    a->cur = c;
+    a->ptr = c->data;
+    a->end = c->data + c->size;
+}
+
+/* arena_alloc - Allocate n bytes from an arena */
+void *arena_alloc(struct arena_t *a, size_t n) {
+    char *p;
+
+    n = (n + 15) & ~(size_t) 15;
+    if ((size_t) (a->end - a->ptr) < n)
+        arena_next(a, n);
+    p = a->ptr;
+    a->ptr += n;
+    a->last = p;
+    return p;
+}
+
+/* arena_grow - Resize an allocation, in place if it is the last one */
+void *arena_grow(struct arena_t *a, void *p, size_t old, size_t n) {
+    void *q;
+
+    if (p != NULL && p == a->last && (size_t) (a->end - (char *) p) >= ((n + 15) & ~(size_t) 15)) {
+        a->ptr = (char *) p + ((n + 15) & ~(size_t) 15);
+        return p;
+    }
+    q = arena_alloc(a, n);
+    if (p != NULL)
+        memcpy(q, p, old < n ? old : n);
+    return q;
+}
+
+/* arena_strndup - Copy a string into an arena */
+char *arena_strndup(struct arena_t *a, const char *s, size_t n) {
+    char *p = (char *) arena_alloc(a, n + 1);
+
+    memcpy(p, s, n);
+    p[n] = '\0';
+    return p;
+}
+
+/* arena_mark - Remember the current position of an arena */
+struct arena_mark_t arena_mark(struct arena_t *a) {
+    struct arena_mark_t m;
+
+    m.cur = a->cur;
+    m.ptr = a->ptr;
+    return m;
+}
+
+/* arena_release - Free everything allocated after the mark */
+void arena_release(struct arena_t *a, struct arena_mark_t m) {
+    if ((a->cur = m.cur) == NULL) {
+        a->ptr = a->end = NULL;
+    } else {
+        a->ptr = m.ptr;
+        a->end = m.cur->data + m.cur->size;
+    }
+    a->last = NULL;
+}
+
+/* arena_free - Give all the chunks of an arena back */
+void arena_free(struct arena_t *a) {
+    struct chunk_t *c, *next;
+
+    for (c = a->first; c != NULL; c = next) {
+        next = c->next;
+        free(c);
+    }
+    memset(a, 0, sizeof(*a));
+}
+
+/***********************************************
+ * Helper routines that manipulate the job list
+ *
+ * The jobs are stored in an array indexed by jid, and hashed by pgid
+ * and by the pid of every stage, so none of the lookups below scans
+ * the list. Both hash tables double when they fill up.
+ **********************************************/
+
+/* clearjob - Free a job struct */
+void clearjob(struct job_t *job) {
+    free(job->pid);
+    free(job->times);
+    free(job->cmdline);
+    free(job);
+    return;
+}
+
+/* initjobs - Initialize the job list */
+void initjobs(void) {
+    maxjobs = 64;
+    jobs = (struct job_t **) calloc(maxjobs, sizeof(struct job_t *));
+    pgid_size = 64;
+    pgid_hash = (struct job_t **) calloc(pgid_size, sizeof(struct job_t *));
+    pid_size = 64;
+    pid_hash = (struct jobpid_t **) calloc(pid_size, sizeof(struct jobpid_t *));
+    if (jobs == NULL || pgid_hash == NULL || pid_hash == NULL)
+        app_error("initjobs: out of memory");
+    return;
+}
+
+/* maxjid - Returns largest allocated job ID */
+int maxjid(void) {
+    return topjid;
+}
+
+/* pgid_grow - Double the pgid hash table */
+static void pgid_grow(void) {
+    int size = pgid_size * 2;
+    struct job_t **tab = (struct job_t **) calloc(size, sizeof(struct job_t *));
+
+    if (tab == NULL)
+        return;
+    for (int i = 0; i < pgid_size; i++) {
+        while (pgid_hash[i] != NULL) {
+            struct job_t *job = pgid_hash[i];
+            pgid_hash[i] = job->pgnext;
+            job->pgnext = tab[job->pgid & (size - 1)];
+            tab[job->pgid & (size - 1)] = job;
+        }
+    }
+    free(pgid_hash);
+    pgid_hash = tab;
+    pgid_size = size;
+}
+
+/* pid_grow - Double the pid hash table */
+static void pid_grow(void) {
+    int size = pid_size * 2;
+    struct jobpid_t **tab = (struct jobpid_t **) calloc(size, sizeof(struct jobpid_t *));
+
+    if (tab == NULL)
+        return;
+    for (int i = 0; i < pid_size; i++) {
+        while (pid_hash[i] != NULL) {
+            struct jobpid_t *p = pid_hash[i];
+            pid_hash[i] = p->next;
+            p->next = tab[p->pid & (size - 1)];
+            tab[p->pid & (size - 1)] = p;
+        }
+    }
+    free(pid_hash);
+    pid_hash = tab;
+    pid_size = size;
+}
+
+/* addjob - Add a process to the job of group pgid, create the job for its first process */
+int addjob(pid_t pid, pid_t pgid, int state, char *cmdline) {
+    struct job_t *job;
+    struct jobpid_t *p;
+
+    if (pid < 1)
+        return 0;
+
+    if ((job = getjobpgid(pgid)) == NULL) {
+        if (topjid + 1 >= maxjobs) {
+            struct job_t **tab = (struct job_t **) realloc(jobs, 2 * maxjobs * sizeof(struct job_t *));
+            if (tab == NULL) {
+                printf("Tried to create too many jobs\n");
+                return 0;
+            }
+            memset(tab + maxjobs, 0, maxjobs * sizeof(struct job_t *));
+            jobs = tab;
+            maxjobs *= 2;
+        }
+        job = (struct job_t *) calloc(1, sizeof(struct job_t));
+        job->maxpid = 4;
+        job->pid = (pid_t *) malloc(job->maxpid * sizeof(pid_t));
+        job->cmdline = strdup(cmdline);
+        job->pgid = pgid;
+        job->jid = ++topjid;
+        job->state = state;
+        job->traced = trace_now();
+        jobs[job->jid] = job;
+        if (++njobs > pgid_size)
+            pgid_grow();
+        job->pgnext = pgid_hash[pgid & (pgid_size - 1)];
+        pgid_hash[pgid & (pgid_size - 1)] = job;
+        if (state == FG)
+            fgjob = job;
+    } else if (job->npid == job->maxpid) { /* a later stage of a pipeline */
+        pid_t *tab = (pid_t *) realloc(job->pid, 2 * job->maxpid * sizeof(pid_t));
+        if (tab == NULL) {
+            printf("Tried to create too many processes in job [%d]\n", job->jid);
+            return 0;
+        }
+        job->pid = tab;
+        job->maxpid *= 2;
+    }
+
+    job->pid[job->npid++] = pid;
+    job->nlive++;
+
+    p = (struct jobpid_t *) malloc(sizeof(struct jobpid_t));
+    p->pid = pid;
+    p->job = job;
+    p->pidfd = watchpid(pid);
+    if (++npids > pid_size)
+        pid_grow();
+    p->next = pid_hash[pid & (pid_size - 1)];
+    pid_hash[pid & (pid_size - 1)] = p;
+
+    if (verbose) {
+        printf("Added job [%d] %d %s\n", job->jid, pid, job->cmdline);
+    }
+    return 1;
+}
+
+/* unindexpid - Remove a pid from the pid hash table */
+static void unindexpid(pid_t pid) {
+    struct jobpid_t **pp = &pid_hash[pid & (pid_size - 1)];
+
+    for (struct jobpid_t *p = *pp; p != NULL; pp = &p->next, p = p->next) {
+        if (p->pid == pid) {
+            *pp = p->next;
+            if (p->pidfd >= 0)
+                close(p->pidfd); /* leaves the epoll set too */
+            free(p);
+            npids--;
+            return;
+        }
+    }
+}
+
+/* deletejob - Delete the job of group pgid from the job list */
+int deletejob(pid_t pgid) {
+    struct job_t **pp, *job;
+
+    if (pgid < 1)
+        return 0;
+
+    for (pp = &pgid_hash[pgid & (pgid_size - 1)]; (job = *pp) != NULL; pp = &job->pgnext)
+        if (job->pgid == pgid)
+            break;
+    if (job == NULL)
+        return 0;
+
+    *pp = job->pgnext;
+    njobs--;
+    for (int i = 0; i < job->npid; i++)
+        unindexpid(job->pid[i]);
+    jobs[job->jid] = NULL;
+    while (topjid > 0 && jobs[topjid] == NULL) /* the next job reuses the freed IDs on top */
+        topjid--;
+    if (fgjob == job) {
+        fgjob = NULL;
+        last_status = job->status;
+    } else if (job->ondone == NULL) { /* not a job of parallel or --serve */
+        struct done_t *d = &done_ring[ndone++ % NDONE];
+
+        d->pgid = job->pgid;
+        d->last = job->pid[job->npid - 1];
+        d->jid = job->jid;
+        d->status = job->status;
+        d->waited = 0;
+    }
+    if (job->traced != 0) {
+        char arg[24];
+
+        snprintf(arg, sizeof(arg), "exit %d", job->status);
+        trace_span("job", job->traced, job->pgid, job->jid, arg);
+    }
+    if (job->times != NULL)
+        report_time(job);
+    if (job->ondone != NULL)
+        job->ondone(job);
+    clearjob(job);
+    return 1;
+}
+
+/* deletepid - A process of a job was reaped, delete the job with its last process */
+int deletepid(pid_t pid) {
+    struct job_t *job = getjobpid(pid);
+
+    if (job == NULL)
+        return 0;
+    if (--job->nlive == 0)
+        return deletejob(job->pgid);
+    unindexpid(pid);
+    return 1;
+}
+
+/* setjobstate - Change the state of a job, keep track of the foreground job */
+void setjobstate(struct job_t *job, int state) {
+    if (job->state == FG && fgjob == job)
+        fgjob = NULL;
+    job->state = state;
+    if (state == FG)
+        fgjob = job;
+}
+
+/* fgpgid - Return PID of current foreground job, 0 if no such job */
+pid_t fgpgid(void) {
+    return (fgjob != NULL) ? fgjob->pgid : 0;
+}
+
+/* getjobpid  - Find a job (by PID) on the job list */
+struct job_t *getjobpid(pid_t pid) {
+    if (pid < 1)
+        return NULL;
+    for (struct jobpid_t *p = pid_hash[pid & (pid_size - 1)]; p != NULL; p = p->next)
+        if (p->pid == pid)
+            return p->job;
+
+    return NULL;
+}
+
+/* getjobpgid  - Find a job (by process group) on the job list */
+struct job_t *getjobpgid(pid_t pgid) {
+    if (pgid < 1)
+        return NULL;
+    for (struct job_t *job = pgid_hash[pgid & (pgid_size - 1)]; job != NULL; job = job->pgnext)
+        if (job->pgid == pgid)
+            return job;
+
+    return NULL;
+}
+
+/* getjobjid  - Find a job (by JID) on the job list */
+struct job_t *getjobjid(int jid) {
+    if (jid < 1 || jid > topjid)
+        return NULL;
+    return jobs[jid];
+}
+
+/* pid2jid - Map process ID to job ID */
+int pid2jid(pid_t pid) {
+    struct job_t *job = getjobpid(pid);
+
+    return (job != NULL) ? job->jid : 0;
+}
+
+/* listjobs - Print the job list */
+void listjobs(void) {
+    int i, j;
+
+    for (i = 1; i <= topjid; i++) {
+        if (jobs[i] != NULL) {
+            for (j = 0; j < jobs[i]->npid; j++) {
+                printf("[%d] (%d) (%d)", jobs[i]->jid, jobs[i]->pid[j], jobs[i]->pgid);
+				
+                switch (jobs[i]->state) {
+                    case BG:
+                        printf("Running ");
+                        break;
+                    case FG:
+                        printf("Foreground ");
+                        break;
+                    case ST:
+                        printf("Stopped ");
+                        break;
+                    default:
+                        printf("listjobs: Internal error: job[%d].state=%d ",
+                               i, jobs[i]->state);
+                }
+                printf("%s", jobs[i]->cmdline);
+            }
+
+        }
+    }
+}
+/******************************
+ * end job list helper routines
+ ******************************/
+
+/**************
+ * Variables
+ *
+ * Shell variables live in var_hash, keyed by name, each kept as one
+ * "name=value" string. The environment is imported at the first use.
+ * env_vec is the envp of every program started, kept up to date as
+ * exported variables change rather than rebuilt: each exported variable
+ * knows its slot, so setting one replaces a pointer, and exporting or
+ * unsetting one appends or moves one slot. The prefix assignments of
+ * a command (NAME=value cmd) are laid over env_vec just for its start
+ * with env_overlay() and taken off with env_restore(), so nothing is
+ * copied however large the environment is.
+ **************/
+
+/* var_hash_n - FNV-1a hash of the n bytes of a name, like strhash() */
+static unsigned int var_hash_n(const char *name, size_t n) {
+    unsigned int h = 2166136261u;
+
+    while (n-- > 0) {
+        h ^= (unsigned char) *name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* var_name_len - Length of the name at the start of s, 0 if there is none */
+size_t var_name_len(const char *s) {
+    size_t n = 0;
+
+    if (!isalpha((unsigned char) s[0]) && s[0] != '_')
+        return 0;
+    while (isalnum((unsigned char) s[n]) || s[n] == '_')
+        n++;
+    return n;
+}
+
+/* is_assignment - Whether a word is NAME=value */
+int is_assignment(const char *word) {
+    size_t n = var_name_len(word);
+
+    return n > 0 && word[n] == '=';
+}
+
+/* var_init - Import the environment, once */
+void var_init(void) {
+    char *eq;
+
+    if (vars_loaded)
+        return;
+    vars_loaded = 1;
+    env_max = 64;
+    env_vec = (char **) malloc(env_max * sizeof(char *));
+    env_vec[0] = NULL;
+    for (char **e = environ; *e != NULL; e++)
+        if ((eq = strchr(*e, '=')) != NULL)
+            var_set(*e, eq - *e, eq + 1, VAR_EXPORT);
+}
+
+/* var_lookup - The variable named by the n bytes of name, NULL if unset */
+struct var_t *var_lookup(const char *name, size_t n) {
+    struct var_t *v;
+
+    var_init();
+    for (v = var_hash[var_hash_n(name, n) % HASHSIZE]; v != NULL; v = v->next)
+        if (v->namelen == n && !memcmp(v->entry, name, n))
+            return v;
+    return NULL;
+}
+
+/* var_get - The value of a variable, NULL if it is unset */
+char *var_get(const char *name) {
+    struct var_t *v = var_lookup(name, strlen(name));
+
+    return (v != NULL) ? v->entry + v->namelen + 1 : NULL;
+}
+
+/* env_reserve - Make room in env_vec for n more slots and the NULL */
+static void env_reserve(int n) {
+    if (env_n + n + 1 <= env_max)
+        return;
+    while (env_n + n + 1 > env_max)
+        env_max *= 2;
+    if ((env_vec = (char **) realloc(env_vec, env_max * sizeof(char *))) == NULL)
+        unix_error("realloc error");
+}
+
+/* env_add - Give an exported variable the last slot of env_vec */
+static void env_add(struct var_t *v) {
+    env_reserve(1);
+    v->envi = env_n;
+    env_vec[env_n++] = v->entry;
+    env_vec[env_n] = NULL;
+}
+
+/* env_remove - Take a variable out of env_vec, the last slot fills its own */
+static void env_remove(struct var_t *v) {
+    struct var_t *last;
+
+    if (--env_n != v->envi) {
+        char *e = env_vec[env_n];
+
+        last = var_lookup(e, strchr(e, '=') - e);
+        last->envi = v->envi;
+        env_vec[v->envi] = e;
+    }
+    env_vec[env_n] = NULL;
+    v->envi = -1;
+}
+
+/*
+ * var_set - Set the variable named by the n bytes of name. VAR_EXPORT
+ *     in flags exports it, else it keeps being exported or not.
+ */
+void var_set(const char *name, size_t n, const char *value, int flags) {
+    struct var_t *v = var_lookup(name, n);
+    size_t len = strlen(value);
+    char *entry = (char *) malloc(n + len + 2);
+
+    memcpy(entry, name, n);
+    entry[n] = '=';
+    memcpy(entry + n + 1, value, len + 1);
+    if (v == NULL) {
+        unsigned int h = var_hash_n(name, n) % HASHSIZE;
+
+        v = (struct var_t *) malloc(sizeof(struct var_t));
+        v->entry = entry;
+        v->namelen = n;
+        v->envi = -1;
+        v->next = var_hash[h];
+        var_hash[h] = v;
+        nvars++;
+    } else {
+        free(v->entry);
+        v->entry = entry;
+        if (v->envi >= 0)
+            env_vec[v->envi] = entry;
+    }
+    if ((flags & VAR_EXPORT) && v->envi < 0)
+        env_add(v);
+}
+
+/* var_assign - Set a variable from a NAME=value word. Returns 0 if it is not one. */
+int var_assign(const char *word, int flags) {
+    size_t n = var_name_len(word);
+
+    if (n == 0 || word[n] != '=')
+        return 0;
+    var_set(word, n, word + n + 1, flags);
+    return 1;
+}
+
+/* var_export - Export a variable that is set. Returns 0 if it is not. */
+int var_export(const char *name) {
+    struct var_t *v = var_lookup(name, strlen(name));
+
+    if (v == NULL)
+        return 0;
+    if (v->envi < 0)
+        env_add(v);
+    return 1;
+}
+
+/* var_unset - Remove a variable */
+void var_unset(const char *name) {
+    size_t n = strlen(name);
+    struct var_t **pp, *v;
+
+    var_init();
+    for (pp = &var_hash[var_hash_n(name, n) % HASHSIZE]; (v = *pp) != NULL; pp = &v->next)
+        if (v->namelen == n && !memcmp(v->entry, name, n))
+            break;
+    if (v == NULL)
+        return;
+    if (v->envi >= 0)
+        env_remove(v);
+    *pp = v->next;
+    nvars--;
+    free(v->entry);
+    free(v);
+}
+
+/*
+ * var_push - Set the assignments before a builtin for as long as it
+ *     runs. Returns the entries they replaced, for var_pop().
+ */
+char **var_push(char **assign, int n) {
+    char **old;
+
+    if (n == 0)
+        return NULL;
+    old = (char **) arena_alloc(&cmd_arena, n * sizeof(char *));
+    for (int i = 0; i < n; i++) {
+        struct var_t *v = var_lookup(assign[i], var_name_len(assign[i]));
+
+        old[i] = (v != NULL) ? arena_strndup(&cmd_arena, v->entry, strlen(v->entry)) : NULL;
+        var_assign(assign[i], 0);
+    }
+    return old;
+}
+
+/* var_pop - Put back the variables var_push() replaced */
+void var_pop(char **assign, int n, char **old) {
+    while (--n >= 0) {
+        if (old[n] != NULL)
+            var_assign(old[n], 0);
+        else
+            var_unset(arena_strndup(&cmd_arena, assign[n], var_name_len(assign[n])));
+    }
+}
+
+/* var_envp - The environment of the programs started */
+char **var_envp(void) {
+    var_init();
+    return env_vec;
+}
+
+/*
+ * env_overlay - Lay the n NAME=value words of assign over env_vec for
+ *     the start of one command, saving what they cover in save. A
+ *     variable already exported has its slot replaced, any other name
+ *     is added after the last slot.
+ */
+void env_overlay(char **assign, int n, struct envsave_t *save) {
+    int top = env_n;
+
+    var_init();
+    env_reserve(n);
+    for (int i = 0; i < n; i++) {
+        size_t len = var_name_len(assign[i]);
+        struct var_t *v = var_lookup(assign[i], len);
+        int slot = (v != NULL && v->envi >= 0) ? v->envi : -1;
+
+        for (int k = env_n; slot < 0 && k < top; k++) /* named twice */
+            if (!strncmp(env_vec[k], assign[i], len + 1))
+                slot = k;
+        if (slot < 0)
+            slot = top++;
+        save[i].slot = slot;
+        save[i].old = env_vec[slot];
+        env_vec[slot] = assign[i];
+    }
+    env_vec[top] = NULL;
+}
+
+/* env_restore - Take off what env_overlay() laid over env_vec */
+void env_restore(int n, struct envsave_t *save) {
+    while (--n >= 0)
+        env_vec[save[n].slot] = save[n].old;
+    env_vec[env_n] = NULL;
+}
+
+/*
+ * var_value - The value of the n bytes of name after a $, "" if unset.
+ *     $?, $$ and $! are the last status, the pid of the shell and the
+ *     last background pid, written into cmd_arena.
+ */
+static const char *var_value(const char *name, size_t n) {
+    struct var_t *v;
+
+    if (n == 1 && (name[0] == '?' || name[0] == '$' || name[0] == '!')) {
+        char *num;
+
+        if (name[0] == '!' && last_bg == 0)
+            return "";
+        num = (char *) arena_alloc(&cmd_arena, 12);
+        sprintf(num, "%d", (name[0] == '?') ? last_status : (name[0] == '$') ? (int) getpid() : (int) last_bg);
+        return num;
+    }
+    v = var_lookup(name, n);
+    return (v != NULL) ? v->entry + n + 1 : "";
+}
+
+/*
+ * expand_word - Push the fields of a word with variables onto *outp.
+ *     Unless split is 0, the values of unquoted variables and command
+ *     substitutions are split at blanks and one that comes to nothing
+ *     leaves no field. The values are all taken first, left to right,
+ *     so each command is run once and a $? sees the one before it.
+ */
+static void expand_word(char *word, int split, char ***outp, int *n, int *max) {
+    char *buf, *p, *f, *s, *e;
+    const char **vals, *val;
+    size_t size = strlen(word) + 1;
+    int quoted = 0;             /* the field has a quoted variable, even empty */
+    int nval = 0, k = 0;
+
+    for (s = word; (s = strpbrk(s, CTL_VARS)) != NULL; s++)
+        nval++;
+    vals = (const char **) arena_alloc(&cmd_arena, nval * sizeof(char *));
+    for (s = word; (s = strpbrk(s, CTL_VARS)) != NULL; s = e + 1) {
+        e = strchr(s, CTL_END);
+        vals[k] = (*s == CTL_SUB || *s == CTL_QSUB) ? subst(s + 1, e - s - 1) : var_value(s + 1, e - s - 1);
+        size += strlen(vals[k++]);
+    }
+    p = f = buf = (char *) arena_alloc(&cmd_arena, size);
+    for (s = word, k = 0; *s != '\0';) {
+        if (strchr(CTL_VARS, *s) == NULL) {
+            *p++ = *s++;
+            continue;
+        }
+        e = strchr(s, CTL_END);
+        val = vals[k++];
+        if (*s == CTL_QVAR || *s == CTL_QSUB || !split) {
+            p = stpcpy(p, val);
+            quoted = 1;
+        } else {
+            for (; *val != '\0'; val++) {
+                if (!IS_BLANK(*val)) {
+                    *p++ = *val;
+                } else if (p > f || quoted) { /* the end of a field */
+                    if (*n == *max) {
+                        *outp = (char **) arena_grow(&cmd_arena, *outp, (*max + 1) * sizeof(char *),
+                                                     (2 * *max + 1) * sizeof(char *));
+                        *max *= 2;
+                    }
+                    *p++ = '\0';
+                    (*outp)[(*n)++] = f;
+                    f = p;
+                    quoted = 0;
+                }
+            }
+        }
+        s = e + 1;
+    }
+    if (p > f || quoted) {
+        if (*n == *max) {
+            *outp = (char **) arena_grow(&cmd_arena, *outp, (*max + 1) * sizeof(char *),
+                                         (2 * *max + 1) * sizeof(char *));
+            *max *= 2;
+        }
+        *p = '\0';
+        (*outp)[(*n)++] = f;
+    }
+}
+
+/*
+ * expand_words - Replace the variables and command substitutions
+ *     parseline() marked in the words of a command with their values,
+ *     running the commands. Unquoted values are split into fields,
+ *     except in the assignments before a command and in the file name
+ *     of a redirection. Returns argv itself if it has no variables,
+ *     else a new argv from cmd_arena.
+ */
+char **expand_words(char **argv) {
+    char **out;
+    int n = 0, max = 16, i, prefix = 1;
+
+    for (i = 0; argv[i] != NULL; i++)
+        if (!IS_OP(argv[i]) && strpbrk(argv[i], CTL_VARS) != NULL)
+            break;
+    if (argv[i] == NULL)
+        return argv;
+
+    out = (char **) arena_alloc(&cmd_arena, (max + 1) * sizeof(char *));
+    for (i = 0; argv[i] != NULL; i++) {
+        int file = (i > 0 && IS_OP(argv[i - 1]) && argv[i - 1] != OP_PIPE && argv[i - 1] != OP_FANOUT &&
+                    argv[i - 1] != OP_COMMA && argv[i - 1] != OP_IONUM);
+
+        if (argv[i] == OP_PIPE || argv[i] == OP_FANOUT || argv[i] == OP_COMMA)
+            prefix = 1;
+        else if (!IS_OP(argv[i]) && !file)
+            prefix = prefix && is_assignment(argv[i]);
+        if (IS_OP(argv[i]) || strpbrk(argv[i], CTL_VARS) == NULL) {
+            if (n == max) {
+                out = (char **) arena_grow(&cmd_arena, out, (max + 1) * sizeof(char *),
+                                           (2 * max + 1) * sizeof(char *));
+                max *= 2;
+            }
+            out[n++] = argv[i];
+        } else
+            expand_word(argv[i], !file && !prefix, &out, &n, &max);
+    }
+    out[n] = NULL;
+    return out;
+}
+
+/*
+ * do_unset - Execute the builtin unset command
+ *     unset name...
+ */
+int do_unset(char **argv) {
+    int status = 0;
+
+    for (int i = 1; argv[i] != NULL; i++) {
+        if (var_name_len(argv[i]) != strlen(argv[i])) {
+            builtin_error("unset: `%s': not a valid identifier\n", argv[i]);
+            status = 1;
+            continue;
+        }
+        var_unset(argv[i]);
+    }
+    return status;
+}
+
+/**************
+ * Command substitution
+ *
+ * The output of a $(command) or `command` is captured in a buffer of
+ * the substitution, never a file. The shell swaps stdout for a stdio
+ * cookie stream that appends to the buffer, so the builtins it runs
+ * itself write into memory without a fork or a pipe. Only when it
+ * starts a program does capture_pipe() put a pipe on fd 1, which the
+ * event loop drains into the same buffer while the job runs. Programs
+ * are started as jobs of the shell, like any command line; only a
+ * command that could change the shell (cd, assignments, a compound
+ * command, ...) runs in a forked copy of it.
+ **************/
+
+/* capture_reserve - Make room for n more bytes in the buffer */
+static void capture_reserve(struct capture_t *c, size_t n) {
+    if (c->size - c->len >= n)
+        return;
+    c->size = (c->len + n > 2 * c->size) ? c->len + n : 2 * c->size;
+    c->buf = (char *) realloc(c->buf, c->size);
+}
+
+/*
+ * capture_read - Append what the programs of a substitution wrote to
+ *     the pipe so far, or all of it if the pipe is blocking
+ */
+void capture_read(int fd, void *arg) {
+    struct capture_t *c = (struct capture_t *) arg;
+    ssize_t n;
+
+    do {
+        capture_reserve(c, 4096);
+        if ((n = read(fd, c->buf + c->len, c->size - c->len)) > 0)
+            c->len += n;
+    } while (n > 0 || (n < 0 && errno == EINTR));
+}
+
+/*
+ * capture_write - Write function of the stdout of a substitution. What
+ *     the shell writes goes after what its programs wrote before; with
+ *     fd 1 redirected, or in a forked child, it goes to fd 1.
+ */
+static ssize_t capture_write(void *cookie, const char *data, size_t n) {
+    struct capture_t *c = (struct capture_t *) cookie;
+    size_t done = 0;
+    ssize_t k;
+
+    if (c->redirected > 0 || c->pid != getpid()) {
+        while (done < n && ((k = write(STDOUT_FILENO, data + done, n - done)) > 0 || errno == EINTR))
+            if (k > 0)
+                done += k;
+        return done;
+    }
+    if (c->fd >= 0)
+        capture_read(c->fd, c);
+    capture_reserve(c, n);
+    memcpy(c->buf + c->len, data, n);
+    c->len += n;
+    return n;
+}
+
+/*
+ * capture_pipe - Put the pipe of the innermost substitution on fd 1,
+ *     before the shell starts a program that writes there
+ */
+void capture_pipe(void) {
+    struct capture_t *c = capture;
+    int fd[2];
+
+    if (c == NULL || c->fd >= 0)
+        return;
+    if (pipe2(fd, O_CLOEXEC) < 0) {
+        fprintf(stderr, "pipe error: %s\n", strerror(errno));
+        return;
+    }
+    c->saved = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 64);
+    dup2(fd[1], STDOUT_FILENO);
+    close(fd[1]);
+    c->fd = fd[0];
+    fcntl(c->fd, F_SETFL, O_NONBLOCK);
+    watchfd(c->fd, capture_read, c);
+}
+
+/*
+ * subst_in_shell - Whether the shell can run the commands of a
+ *     substitution itself: programs, and the builtins that only write.
+ *     argv has its aliases expanded.
+ */
+static int subst_in_shell(char **argv) {
+    static const char *pure[] = {"echo", "printf", "test", "[", "pwd", "true", "false", "jobs",
+                                 "history", NULL};
+    int start = 1, assign = 0;  /* at the start of a command, after assignments */
+
+    for (int i = 0; argv[i] != NULL; i++) {
+        char *w = argv[i];
+
+        if (w == OP_SEMI || w == OP_AMP || w == OP_PIPE || w == OP_FANOUT || w == OP_COMMA) {
+            if (start && assign) /* an assignment alone sets a variable */
+                return 0;
+            start = 1;
+            assign = 0;
+        } else if (!start || w == OP_IONUM) {
+            continue;
+        } else if (IS_OP(w)) {
+            if (argv[i + 1] != NULL) /* the file */
+                i++;
+        } else if (is_assignment(w)) {
+            assign = 1;
+        } else {
+            if (strpbrk(w, CTL_VARS) != NULL) /* could be any command */
+                return 0;
+            if (is_builtin(w)) {
+                int k;
+                for (k = 0; pure[k] != NULL && strcmp(pure[k], w); k++)
+                    ;
+                if (pure[k] == NULL)
+                    return 0;
+            }
+            start = 0;
+        }
+    }
+    return !(start && assign);
+}
+
+/*
+ * subst_fork - Run the commands of a substitution in a forked copy of
+ *     the shell, as a foreground job writing to the pipe
+ */
+static void subst_fork(char **argv, int argc, char *cmd) {
+    uint64_t t = trace_now();
+    pid_t pid;
+
+    capture_pipe();
+    fflush(stdout);
+    if ((pid = fork()) < 0) {
+        fprintf(stderr, "fork error: %s\n", strerror(errno));
+        last_status = 1;
+        return;
+    }
+    if (pid == 0) {
+        setpgid(0, 0);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGQUIT, SIG_DFL);
+        events_reset();
+        if (is_compound(argv))
+            run_list(compile(argv, NULL, argc, &cmd_arena, NULL));
+        else
+            eval_words(argv, cmd);
+        fflush(stdout);
+        _exit(last_status);
+    }
+    setpgid(pid, pid);
+    trace_span("fork", t, pid, 0, argv[0]);
+    addjob(pid, pid, FG, cmd);
+    waitfg(pid);
+}
+
+/*
+ * subst - Run the n bytes of command text of a substitution and return
+ *     its output without the newlines at the end, from cmd_arena. $?
+ *     is its status afterwards.
+ */
+char *subst(const char *text, size_t n) {
+    static cookie_io_functions_t io = {NULL, capture_write, NULL, NULL};
+    struct capture_t c = {NULL, 0, 0, -1, -1, 0, getpid(), stdout, capture};
+    struct arena_mark_t mark;
+    uint64_t t = trace_now();
+    char *cmd = (char *) arena_alloc(&cmd_arena, n + 2), **argv, *val;
+    int argc, shell;
+    FILE *f;
+
+    memcpy(cmd, text, n);
+    memcpy(cmd + n, "\n", 2); /* the job list wants a line */
+    nsubst++;
+    mark = arena_mark(&cmd_arena);
+    if ((argc = parseline(cmd, &argv)) == 0) {
+        arena_release(&cmd_arena, mark);
+        last_status = 0;
+        return "";
+    }
+    if ((shell = !is_compound(argv))) {
+        rebulid_command(&argv);
+        shell = subst_in_shell(argv);
+    }
+
+    if ((f = fopencookie(&c, "w", io)) == NULL) {
+        fprintf(stderr, "command substitution: %s\n", strerror(errno));
+        arena_release(&cmd_arena, mark);
+        last_status = 1;
+        return "";
+    }
+    fflush(stdout);
+    stdout = f;
+    capture = &c;
+    if (shell)
+        eval_list(argv, cmd);
+    else
+        subst_fork(argv, argc, cmd);
+    fclose(f);
+    stdout = c.out;
+    capture = c.prev;
+
+    /* wait for every process holding the pipe, as in the background */
+    if (c.fd >= 0) {
+        if (c.saved >= 0) {
+            dup2(c.saved, STDOUT_FILENO);
+            close(c.saved);
+        } else
+            close(STDOUT_FILENO);
+        unwatchfd(c.fd);
+        fcntl(c.fd, F_SETFL, 0);
+        capture_read(c.fd, &c);
+        close(c.fd);
+    }
+    arena_release(&cmd_arena, mark);
+
+    while (c.len > 0 && c.buf[c.len - 1] == '\n')
+        c.len--;
+    val = arena_strndup(&cmd_arena, c.len ? c.buf : "", c.len);
+    free(c.buf);
+    cmd[n] = '\0';
+    trace_span("subst", t, 0, 0, cmd);
+    return val;
+}
+
+/**************
+ * Control flow
+ *
+ * if, while, until, for and case are compiled into a tree of node_t
+ * from the words parseline() makes of each line, and run_list() walks
+ * the tree. The commands in the tree are kept as word vectors, so a
+ * loop body is never parsed again: running a command only copies its
+ * vector into cmd_arena and expands its variables. A script file is
+ * compiled once into an arena of its own and kept in scripts, keyed by
+ * its device and inode and checked against its mtime and size, so a
+ * file run again by source is not parsed again either.
+ **************/
+
+/* compound - Whether a word starts a compound command */
+static int compound(char *w) {
+    return !IS_OP(w) && w != tok_newline && (!strcmp(w, "if") || !strcmp(w, "while") ||
+           !strcmp(w, "until") || !strcmp(w, "for") || !strcmp(w, "case"));
+}
+
+/* is_compound - Whether a compound command starts a command of a line */
+int is_compound(char **argv) {
+    int cmdpos = 1;
+
+    for (int i = 0; argv[i] != NULL; i++) {
+        if (cmdpos && compound(argv[i]))
+            return 1;
+        cmdpos = (argv[i] == OP_SEMI || argv[i] == OP_AMP || argv[i] == OP_PIPE);
+    }
+    return 0;
+}
+
+/* c_stop - Whether a word ends the list before it */
+static int c_stop(char *w) {
+    static const char *stop[] = {"then", "elif", "else", "fi", "do", "done", "esac", NULL};
+
+    if (IS_OP(w) || w == tok_newline)
+        return 0;
+    for (int i = 0; stop[i] != NULL; i++)
+        if (!strcmp(w, stop[i]))
+            return 1;
+    return 0;
+}
+
+/* c_at - Whether the next word is the keyword kw */
+static int c_at(struct compile_t *c, const char *kw) {
+    char *w = (c->i < c->n) ? c->tok[c->i] : NULL;
+
+    return w != NULL && !IS_OP(w) && w != tok_newline && !strcmp(w, kw);
+}
+
+/* c_sep - Whether the next word ends a command: ; or a new line */
+static int c_sep(struct compile_t *c) {
+    return c->i < c->n && (c->tok[c->i] == OP_SEMI || c->tok[c->i] == tok_newline);
+}
+
+/* c_node - A new node at the next word */
+static struct node_t *c_node(struct compile_t *c, int type) {
+    struct node_t *n = (struct node_t *) arena_alloc(c->a, sizeof(struct node_t));
+
+    memset(n, 0, sizeof(*n));
+    n->type = type;
+    n->line = (c->line != NULL && c->i < c->n) ? c->line[c->i] : 0;
+    return n;
+}
+
+/* c_error - Note a syntax error at the next word, the first one only. Returns NULL. */
+static struct node_t *c_error(struct compile_t *c) {
+    char msg[PATH_MAX + MAXLINE];
+    char *w = (c->i < c->n) ? c->tok[c->i] : NULL;
+    int k = 0;
+
+    if (c->err != NULL)
+        return NULL;
+    if (c->file != NULL)
+        k = snprintf(msg, PATH_MAX, "%s:%d: ", c->file,
+                     (c->line != NULL) ? c->line[(c->i < c->n) ? c->i : c->n - 1] : 0);
+    if (k >= PATH_MAX)
+        k = PATH_MAX - 1;
+    if (w == NULL)
+        snprintf(msg + k, MAXLINE, "syntax error: unexpected end of file");
+    else
+        snprintf(msg + k, MAXLINE, "syntax error near '%s'", (w == tok_newline) ? "newline" : w);
+    c->err = c_node(c, N_ERROR);
+    c->err->name = arena_strndup(c->a, msg, strlen(msg));
+    return NULL;
+}
+
+/* c_expect - Skip the keyword kw, or note a syntax error. Returns 0 on an error. */
+static int c_expect(struct compile_t *c, const char *kw) {
+    if (!c_at(c, kw)) {
+        c_error(c);
+        return 0;
+    }
+    c->i++;
+    return 1;
+}
+
+/* c_words - Copy the words from start up to the next word into an argv */
+static char **c_words(struct compile_t *c, int start, int *argc) {
+    char **argv = (char **) arena_alloc(c->a, (c->i - start + 1) * sizeof(char *));
+
+    *argc = c->i - start;
+    memcpy(argv, &c->tok[start], *argc * sizeof(char *));
+    argv[*argc] = NULL;
+    return argv;
+}
+
+static struct node_t *c_list(struct compile_t *c, int incase);
+
+/* c_if - Compile if (or elif) ... fi, the fi of every elif shared */
+static struct node_t *c_if(struct compile_t *c) {
+    struct node_t *n = c_node(c, N_IF);
+
+    c->i++;
+    n->cond = c_list(c, 0);
+    if (!c_expect(c, "then"))
+        return NULL;
+    n->body = c_list(c, 0);
+    if (c_at(c, "elif"))
+        return ((n->alt = c_if(c)) != NULL) ? n : NULL;
+    if (c_at(c, "else")) {
+        c->i++;
+        n->alt = c_list(c, 0);
+    }
+    return c_expect(c, "fi") ? n : NULL;
+}
+
+/* c_loop - Compile while or until ... do ... done */
+static struct node_t *c_loop(struct compile_t *c) {
+    struct node_t *n = c_node(c, c_at(c, "while") ? N_WHILE : N_UNTIL);
+
+    c->i++;
+    n->cond = c_list(c, 0);
+    if (!c_expect(c, "do"))
+        return NULL;
+    n->body = c_list(c, 0);
+    return c_expect(c, "done") ? n : NULL;
+}
+
+/* c_for - Compile for name in words; do ... done */
+static struct node_t *c_for(struct compile_t *c) {
+    struct node_t *n = c_node(c, N_FOR);
+    int start;
+
+    c->i++;
+    if (c->i >= c->n || IS_OP(c->tok[c->i]) || c->tok[c->i] == tok_newline ||
+        var_name_len(c->tok[c->i]) != strlen(c->tok[c->i]))
+        return c_error(c);
+    n->name = c->tok[c->i++];
+    if (!c_expect(c, "in"))
+        return NULL;
+    for (start = c->i; c->i < c->n && !c_sep(c); c->i++)
+        if (IS_OP(c->tok[c->i]))
+            return c_error(c);
+    n->argv = c_words(c, start, &n->argc);
+    while (c_sep(c))
+        c->i++;
+    if (!c_expect(c, "do"))
+        return NULL;
+    n->body = c_list(c, 0);
+    return c_expect(c, "done") ? n : NULL;
+}
+
+/* c_case - Compile case word in pattern|...) list;; ... esac */
+static struct node_t *c_case(struct compile_t *c) {
+    struct node_t *n = c_node(c, N_CASE), **tail = &n->body, *item;
+    char **pat;
+    int npat;
+
+    c->i++;
+    if (c->i >= c->n || IS_OP(c->tok[c->i]) || c->tok[c->i] == tok_newline)
+        return c_error(c);
+    n->name = c->tok[c->i++];
+    while (c_sep(c))
+        c->i++;
+    if (!c_expect(c, "in"))
+        return NULL;
+    while (1) {
+        while (c_sep(c))
+            c->i++;
+        if (c_at(c, "esac"))
+            break;
+        item = c_node(c, N_ITEM);
+        pat = (char **) arena_alloc(c->a, 8 * sizeof(char *));
+        for (npat = 0;; c->i++) { /* a|b) stays: a, the | and b) */
+            char *w = (c->i < c->n) ? c->tok[c->i] : NULL;
+            size_t len;
+
+            if (w == NULL || IS_OP(w) || w == tok_newline)
+                return c_error(c);
+            if (npat == 0 && w[0] == '(')
+                w++;
+            len = strlen(w);
+            if (npat % 8 == 7)
+                pat = (char **) arena_grow(c->a, pat, (npat + 1) * sizeof(char *), (npat + 9) * sizeof(char *));
+            if (len > 0 && w[len - 1] == ')') {
+                pat[npat++] = arena_strndup(c->a, w, len - 1);
+                c->i++;
+                break;
+            }
+            pat[npat++] = w;
+            if (c->i + 1 >= c->n || c->tok[c->i + 1] != OP_PIPE)
+                return c_error(c);
+            c->i++;
+        }
+        pat[npat] = NULL;
+        item->argv = pat;
+        item->argc = npat;
+        item->body = c_list(c, 1);
+        if (c->err != NULL)
+            return NULL;
+        *tail = item;
+        tail = &item->next;
+        if (c->i + 1 < c->n && c->tok[c->i] == OP_SEMI && c->tok[c->i + 1] == OP_SEMI)
+            c->i += 2;
+        else if (!c_at(c, "esac"))
+            return c_error(c);
+    }
+    c->i++;
+    return n;
+}
+
+/* c_command - Compile one command: compound, break, continue or simple */
+static struct node_t *c_command(struct compile_t *c) {
+    struct node_t *n;
+    int start = c->i;
+
+    if (c_at(c, "if"))
+        n = c_if(c);
+    else if (c_at(c, "while") || c_at(c, "until"))
+        n = c_loop(c);
+    else if (c_at(c, "for"))
+        n = c_for(c);
+    else if (c_at(c, "case"))
+        n = c_case(c);
+    else {
+        n = c_node(c, N_CMD);
+        while (c->i < c->n && !c_sep(c) && c->tok[c->i] != OP_AMP)
+            c->i++;
+        if (c->i < c->n && c->tok[c->i] == OP_AMP)
+            c->i++;
+        n->argv = c_words(c, start, &n->argc);
+        if (!strcmp(n->argv[0], "break") || !strcmp(n->argv[0], "continue")) {
+            n->type = (n->argv[0][0] == 'b') ? N_BREAK : N_CONTINUE;
+            n->count = (n->argc > 1) ? atoi(n->argv[1]) : 1;
+            if (n->count < 1 || n->argc > 2) {
+                c->i = start + 1;
+                return c_error(c);
+            }
+        }
+        return n;
+    }
+    /* nothing but redirections may follow a compound command */
+    if (n != NULL && c->i < c->n && !c_sep(c)) {
+        char *w = c->tok[c->i];
+        int argc;
+
+        if (w != OP_IN && w != OP_OUT && w != OP_APPEND && w != OP_DUP && w != OP_DUPIN && w != OP_IONUM)
+            return c_error(c);
+        for (start = c->i; c->i < c->n && !c_sep(c); c->i++)
+            if (c->tok[c->i] == OP_PIPE || c->tok[c->i] == OP_AMP || c->tok[c->i] == OP_FANOUT)
+                return c_error(c);
+        n->redir = c_words(c, start, &argc);
+    }
+    return n;
+}
+
+/*
+ * c_list - Compile commands up to a word that ends the list, or ;; in
+ *     the item of a case (incase)
+ */
+static struct node_t *c_list(struct compile_t *c, int incase) {
+    struct node_t *head = NULL, **tail = &head, *n;
+
+    while (c->i < c->n && c->err == NULL) {
+        if (c->tok[c->i] == OP_SEMI && c->i + 1 < c->n && c->tok[c->i + 1] == OP_SEMI) {
+            if (!incase)
+                c_error(c);
+            break;
+        }
+        if (c_sep(c)) {
+            c->i++;
+            continue;
+        }
+        if (c_stop(c->tok[c->i]))
+            break;
+        if ((n = c_command(c)) == NULL)
+            break;
+        *tail = n;
+        tail = &n->next;
+    }
+    return head;
+}
+
+/*
+ * compile - Compile the n words of tok, lines separated by tok_newline,
+ *     into a list of nodes allocated from a. line is the line of each
+ *     word and file the name for errors, both may be NULL. A syntax
+ *     error compiles to an N_ERROR node after the commands before it.
+ */
+struct node_t *compile(char **tok, int *line, int n, struct arena_t *a, const char *file) {
+    struct compile_t c = {tok, line, 0, n, a, file, NULL};
+    struct node_t *prog, **tail;
+    uint64_t t = trace_now();
+
+    prog = c_list(&c, 0);
+    if (c.err == NULL && c.i < c.n)
+        c_error(&c); /* fi, done, ... without its start */
+    if (c.err != NULL) {
+        for (tail = &prog; *tail != NULL; tail = &(*tail)->next)
+            ;
+        *tail = c.err;
+    }
+    trace_span("compile", t, 0, 0, file);
+    return prog;
+}
+
+/*
+ * compile_text - Split a text into lines, parse them and compile them.
+ *     The words are copied into a unless a is cmd_arena.
+ */
+struct node_t *compile_text(const char *text, size_t len, struct arena_t *a, const char *file) {
+    const char *end = text + len, *nl;
+    char **tok = NULL, **argv, *line = NULL;
+    int *lines = NULL, ntok = 0, maxtok = 0, lineno = 0, argc;
+    size_t linesize = 0;
+    struct node_t *prog;
+
+    for (; text < end; text = nl + 1) {
+        struct arena_mark_t m = arena_mark(&cmd_arena);
+
+        if ((nl = memchr(text, '\n', end - text)) == NULL)
+            nl = end;
+        lineno++;
+        if ((size_t) (nl - text) + 1 > linesize) {
+            linesize = nl - text + 1;
+            if ((line = (char *) realloc(line, linesize)) == NULL)
+                app_error("compile_text: out of memory");
+        }
+        memcpy(line, text, nl - text);
+        line[nl - text] = '\0';
+
+        argc = parseline(line, &argv);
+        if (ntok + argc + 1 > maxtok) {
+            maxtok = 2 * (ntok + argc + 1);
+            tok = (char **) realloc(tok, maxtok * sizeof(char *));
+            lines = (int *) realloc(lines, maxtok * sizeof(int));
+            if (tok == NULL || lines == NULL)
+                app_error("compile_text: out of memory");
+        }
+        for (int i = 0; i < argc; i++) {
+            tok[ntok] = (IS_OP(argv[i]) || a == &cmd_arena) ? argv[i] : arena_strndup(a, argv[i], strlen(argv[i]));
+            lines[ntok++] = lineno;
+        }
+        tok[ntok] = tok_newline;
+        lines[ntok++] = lineno;
+        if (a != &cmd_arena)
+            arena_release(&cmd_arena, m);
+    }
+    prog = compile(tok, lines, ntok, a, file);
+    free(tok);
+    free(lines);
+    free(line);
+    return prog;
+}
+
+/*
+ * loop_end - After the body of a loop, whether break or continue end
+ *     it. A command killed by ctrl-c ends all the loops.
+ */
+static int loop_end(void) {
+    if (last_status == 128 + SIGINT)
+        loop_break = loop_depth;
+    if (loop_break > 0) {
+        loop_break--;
+        return 1;
+    }
+    if (loop_continue > 0 && --loop_continue > 0)
+        return 1;
+    return 0;
+}
+
+/* expand_string - A word with its variables replaced, not split */
+static char *expand_string(char *word) {
+    char *argv[] = {OP_OUT, word, NULL}, **out; /* a file name is not split */
+
+    if (strpbrk(word, CTL_VARS) == NULL)
+        return word;
+    out = expand_words(argv);
+    return (out[1] != NULL) ? out[1] : "";
+}
+
+/* run_node - Run one node of a compiled list */
+void run_node(struct node_t *n) {
+    struct arena_mark_t m = arena_mark(&cmd_arena);
+    struct stage_t st;
+    int status = 0, argc;
+    char **argv, *word;
+
+    if (n->redir != NULL) { /* like a builtin, in the shell with the fds saved */
+        for (argc = 0; n->redir[argc] != NULL; argc++)
+            ;
+        st.argv = (char **) arena_alloc(&cmd_arena, (argc + 1) * sizeof(char *));
+        memcpy(st.argv, n->redir, (argc + 1) * sizeof(char *));
+        st.argv = expand_words(st.argv);
+        if (!parse_redirs(&st) || st.argv[0] != NULL) {
+            if (st.argv[0] != NULL)
+                fprintf(stderr, "syntax error near '%s'\n", st.argv[0]);
+            last_status = 2;
+            arena_release(&cmd_arena, m);
+            return;
+        }
+        fflush(stdout);
+        if (redirect(st.redir, 1) < 0) {
+            unredirect(st.redir);
+            last_status = 1;
+            arena_release(&cmd_arena, m);
+            return;
+        }
+    }
+
+    switch (n->type) {
+        case N_CMD:
+            argv = (char **) arena_alloc(&cmd_arena, (n->argc + 1) * sizeof(char *));
+            memcpy(argv, n->argv, (n->argc + 1) * sizeof(char *));
+            eval_words(argv, NULL);
+            break;
+        case N_IF:
+            run_list(n->cond);
+            if (loop_break || loop_continue)
+                break;
+            if (last_status == 0)
+                run_list(n->body);
+            else if (n->alt != NULL)
+                run_list(n->alt);
+            else
+                last_status = 0;
+            break;
+        case N_WHILE:
+        case N_UNTIL:
+            loop_depth++;
+            while (1) {
+                run_list(n->cond);
+                if (loop_break || loop_continue) {
+                    loop_end();
+                    break;
+                }
+                if ((last_status == 0) != (n->type == N_WHILE))
+                    break;
+                run_list(n->body);
+                status = last_status;
+                if (loop_end())
+                    break;
+            }
+            loop_depth--;
+            last_status = status;
+            break;
+        case N_FOR:
+            argv = (char **) arena_alloc(&cmd_arena, (n->argc + 1) * sizeof(char *));
+            memcpy(argv, n->argv, (n->argc + 1) * sizeof(char *));
+            argv = expand_words(argv);
+            loop_depth++;
+            for (int i = 0; argv[i] != NULL; i++) {
+                var_set(n->name, strlen(n->name), argv[i], 0);
+                run_list(n->body);
+                status = last_status;
+                if (loop_end())
+                    break;
+            }
+            loop_depth--;
+            last_status = status;
+            break;
+        case N_CASE:
+            word = expand_string(n->name);
+            last_status = 0;
+            for (struct node_t *item = n->body; item != NULL; item = item->next) {
+                int k;
+
+                for (k = 0; k < item->argc && fnmatch(expand_string(item->argv[k]), word, 0) != 0; k++)
+                    ;
+                if (k < item->argc) {
+                    run_list(item->body);
+                    break;
+                }
+            }
+            break;
+        case N_BREAK:
+        case N_CONTINUE:
+            if (loop_depth == 0) {
+                fprintf(stderr, "%s: only meaningful in a loop\n", n->argv[0]);
+                last_status = 1;
+                break;
+            }
+            *((n->type == N_BREAK) ? &loop_break : &loop_continue) = (n->count < loop_depth) ? n->count : loop_depth;
+            last_status = 0;
+            break;
+        case N_ERROR:
+            fprintf(stderr, "%s\n", n->name);
+            last_status = 2;
+            break;
+    }
+    if (n->redir != NULL) {
+        fflush(stdout);
+        unredirect(st.redir);
+    }
+    arena_release(&cmd_arena, m);
+}
+
+/* run_list - Run a compiled list, up to a break or continue */
+void run_list(struct node_t *n) {
+    for (; n != NULL && !loop_break && !loop_continue; n = n->next)
+        run_node(n);
+}
+
+/*
+ * do_source - Execute the builtin source command, also .
+ *     source file
+ */
+int do_source(char **argv) {
+    if (argv[1] == NULL) {
+        builtin_error("%s: file name required\n", argv[0]);
+        return 2;
+    }
+    return run_script(argv[1]);
+}
+
+/**************
+ * History
+ *
+ * Every line typed is appended to ~/.caishell_history (or
+ * $CAISHELL_HISTFILE) with one write() under flock(), so shells running
+ * at the same time interleave whole lines. The file is read through a
+ * shared mapping that follows its growth, so lines of the other shells
+ * show up too. An entry is a line of the mapping, found through
+ * hist_off. The first search builds the index: the entries are cut in
+ * blocks of about HISTBLOCK bytes, each with a bitmap of the hashes of
+ * the trigrams in it. A search only reads the blocks that have every
+ * trigram of the text, a few in millions of entries. Later lines are
+ * added to the index as they come.
+ **************/
+
+/*
+ * hist_open - Open and map the history file of an interactive shell
+ */
+void hist_open(void) {
+    char path[PATH_MAX], *file = var_get("CAISHELL_HISTFILE"), *home = var_get("HOME");
+
+    if (file == NULL) {
+        if (home == NULL)
+            return;
+        snprintf(path, sizeof(path), "%s/.caishell_history", home);
+        file = path;
+    }
+    if ((hist_fd = open(file, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600)) < 0) {
+        if (verbose)
+            printf("%s: %s\n", file, strerror(errno));
+        return;
+    }
+    hist_sync();
+}
+
+/*
+ * hist_sync - Catch up with what was appended to the history file, by
+ *     this shell or another one
+ */
+void hist_sync(void) {
+    struct stat st;
+    char *p, *end, *nl;
+
+    if (hist_fd < 0 || fstat(hist_fd, &st) < 0)
+        return;
+    if ((size_t) st.st_size < hist_len) /* truncated: start over */
+        hist_len = hist_n = hist_indexed = hist_nblock = 0;
+    if ((size_t) st.st_size > hist_mapsize) {
+        if (hist_map != NULL)
+            munmap(hist_map, hist_mapsize);
+        hist_mapsize = 0;
+        if ((hist_map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, hist_fd, 0)) == MAP_FAILED) {
+            hist_map = NULL;
+            return;
+        }
+        hist_mapsize = st.st_size;
+    }
+    if (hist_map == NULL)
+        return;
+
+    /* a line still being written has no '\n' yet and waits */
+    p = hist_map + hist_len;
+    end = hist_map + st.st_size;
+    while (p < end && (nl = memchr(p, '\n', end - p)) != NULL) {
+        if (hist_n + 2 > hist_max) {
+            hist_max = hist_max ? 2 * hist_max : 1024;
+            if ((hist_off = (uint64_t *) realloc(hist_off, hist_max * sizeof(uint64_t))) == NULL)
+                app_error("hist_sync: out of memory");
+        }
+        hist_off[hist_n++] = p - hist_map;
+        p = nl + 1;
+    }
+    hist_len = p - hist_map;
+    if (hist_off != NULL)
+        hist_off[hist_n] = hist_len;
+    if (hist_block != NULL)
+        hist_index();
+}
+
+/*
+ * hist_add - Append a command line to the history. Blank lines and a
+ *     repeat of the last entry are left out.
+ */
+void hist_add(const char *line) {
+    size_t len = strcspn(line, "\n"), last;
+    char *prev;
+
+    if (hist_fd < 0 || strspn(line, " \t") >= len)
+        return;
+    hist_sync();
+    if (hist_n > 0 && (prev = hist_entry(hist_n - 1, &last)) && last == len && !memcmp(prev, line, len))
+        return;
+
+    flock(hist_fd, LOCK_EX);
+    if (write(hist_fd, line, len + 1) != (ssize_t) len + 1 && verbose) /* line[len] is the '\n' */
+        printf("history: %s\n", strerror(errno));
+    flock(hist_fd, LOCK_UN);
+    hist_sync();
+}
+
+/* hist_entry - Entry i of the history, without its '\n' */
+char *hist_entry(size_t i, size_t *len) {
+    *len = hist_off[i + 1] - hist_off[i] - 1;
+    return hist_map + hist_off[i];
+}
+
+/* hist_tri - The bit of the trigram at e in an index block */
+static inline unsigned int hist_tri(const unsigned char *e) {
+    return ((uint32_t) (e[0] << 16 | e[1] << 8 | e[2]) * 2654435761u) >> 19; /* 13 bits */
+}
+
+/*
+ * hist_index - Add the entries not indexed yet to the trigram index
+ */
+void hist_index(void) {
+    struct histblock_t *b = hist_nblock ? &hist_block[hist_nblock - 1] : NULL;
+
+    for (; hist_indexed < hist_n; hist_indexed++) {
+        size_t len;
+        unsigned char *e = (unsigned char *) hist_entry(hist_indexed, &len);
+
+        if (b == NULL || hist_off[hist_indexed] - hist_off[b->first] >= HISTBLOCK) {
+            if (hist_nblock == hist_maxblock) {
+                size_t n = hist_maxblock ? 2 * hist_maxblock : 64;
+                struct histblock_t *t = (struct histblock_t *) realloc(hist_block, n * sizeof(*t));
+                if (t == NULL)
+                    return;
+                hist_block = t;
+                hist_maxblock = n;
+            }
+            b = &hist_block[hist_nblock++];
+            memset(b->bits, 0, sizeof(b->bits));
+            b->first = hist_indexed;
+        }
+        for (size_t k = 0; k + 3 <= len; k++) {
+            unsigned int bit = hist_tri(e + k);
+            b->bits[bit / 64] |= 1ULL << (bit % 64);
+        }
+    }
+}
+
+/*
+ * hist_search - Find the newest entry before entry number before that
+ *     contains q. Returns its number, -1 if there is none.
+ */
+long hist_search(const char *q, long before) {
+    size_t qlen = strlen(q), len, ntri = 0;
+    unsigned int tri[MAXLINE];
+    long i;
+    char *e;
+
+    hist_sync();
+    if (before > (long) hist_n)
+        before = hist_n;
+
+    if (qlen < 3) { /* no trigram to look up */
+        for (i = before - 1; i >= 0; i--) {
+            e = hist_entry(i, &len);
+            if (memmem(e, len, q, qlen) != NULL)
+                return i;
+        }
+        return -1;
+    }
+
+    hist_index();
+    for (size_t k = 0; k + 3 <= qlen && ntri < MAXLINE; k++)
+        tri[ntri++] = hist_tri((const unsigned char *) q + k);
+
+    for (long b = (long) hist_nblock - 1; b >= 0; b--) {
+        size_t k;
+
+        if (hist_block[b].first >= (size_t) before)
+            continue;
+        for (k = 0; k < ntri; k++)
+            if (!(hist_block[b].bits[tri[k] / 64] & (1ULL << (tri[k] % 64))))
+                break;
+        if (k < ntri) /* a trigram of q is in no entry of the block */
+            continue;
+
+        i = (b + 1 < (long) hist_nblock) ? (long) hist_block[b + 1].first : (long) hist_indexed;
+        if (i > before)
+            i = before;
+        while (--i >= (long) hist_block[b].first) {
+            e = hist_entry(i, &len);
+            if (memmem(e, len, q, qlen) != NULL)
+                return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * do_history - Execute the builtin history command
+ *     history         list the history
+ *     history N       list the last N entries
+ *     history -s text list the entries containing text, oldest first
+ */
+int do_history(char **argv) {
+    size_t first = 0, len, n = 0;
+    long *found = NULL, i;
+    char *e, q[MAXLINE];
+
+    hist_sync();
+    if (argv[1] != NULL && !strcmp(argv[1], "-s")) {
+        q[0] = '\0';
+        for (int k = 2; argv[k] != NULL; k++)
+            snprintf(q + strlen(q), sizeof(q) - strlen(q), "%s%s", (k > 2) ? " " : "", argv[k]);
+        for (i = hist_search(q, hist_n); i >= 0; i = hist_search(q, i)) {
+            if (n % 256 == 0 && (found = (long *) realloc(found, (n + 256) * sizeof(long))) == NULL)
+                return 1;
+            found[n++] = i;
+        }
+        while (n > 0) {
+            e = hist_entry(found[--n], &len);
+            printf("%5ld  %.*s\n", found[n] + 1, (int) len, e);
+        }
+        free(found);
+        return 0;
+    }
+
+    if (argv[1] != NULL && (size_t) atol(argv[1]) < hist_n)
+        first = hist_n - atol(argv[1]);
+    for (size_t k = first; k < hist_n; k++) {
+        e = hist_entry(k, &len);
+        printf("%5zu  %.*s\n", k + 1, (int) len, e);
+    }
+    return 0;
+}
+
+/**************
+ * Line editor
+ *
+ * When stdin and stdout are a terminal, command lines are read by this
+ * editor with the terminal in raw mode. Keys come in through the event
+ * loop like the blocks of getcmdline(), so jobs are still reaped while
+ * a line is typed. The editor remembers what is on the screen, and a
+ * redraw only moves the cursor to the first byte that changed, writes
+ * the rest of the line and clears what is left of the old one, in one
+ * write(): over a slow link a key costs a few bytes, not the line.
+ * Keys that are already read are handled before a redraw, so a paste
+ * is drawn once.
+ *
+ * Tab completes a command name from cmd_index, the sorted names of the
+ * programs in the PATH directories. The first Tab reads the directories;
+ * after that hash_check() keeps the index up to date one name at a time
+ * from the inotify events of the PATH, so no directory is read again.
+ * Other words are completed as file names. Ctrl-R searches the history.
+ **************/
+
+/* cmdindex_cmp - Order of cmd_index, for qsort */
+static int cmdindex_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/* is_dir_entry - Whether a directory entry is (a link to) a directory */
+static int is_dir_entry(DIR *d, struct dirent *de) {
+    struct stat st;
+
+    if (de->d_type != DT_UNKNOWN && de->d_type != DT_LNK)
+        return de->d_type == DT_DIR;
+    return fstatat(dirfd(d), de->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+}
+
+/*
+ * cmdindex_build - Read the names of the programs in the PATH
+ *     directories into cmd_index
+ */
+void cmdindex_build(void) {
+    struct dirent *de;
+    size_t n = 0;
+    DIR *d;
+
+    cmdindex_free();
+    for (int i = 0; i < npath; i++) {
+        if ((d = opendir(PATH[i])) == NULL)
+            continue;
+        while ((de = readdir(d)) != NULL) {
+            if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..") || is_dir_entry(d, de) ||
+                faccessat(dirfd(d), de->d_name, X_OK, 0) < 0)
+                continue;
+            if (ncmd_index == maxcmd_index) {
+                size_t max = maxcmd_index ? 2 * maxcmd_index : 1024;
+                char **p = (char **) realloc(cmd_index, max * sizeof(char *));
+                if (p == NULL)
+                    break;
+                cmd_index = p;
+                maxcmd_index = max;
+            }
+            if ((cmd_index[ncmd_index] = strdup(de->d_name)) != NULL)
+                ncmd_index++;
+        }
+        closedir(d);
+    }
+
+    /* a name in several directories is there once */
+    qsort(cmd_index, ncmd_index, sizeof(char *), cmdindex_cmp);
+    for (size_t i = 0; i < ncmd_index; i++) {
+        if (n > 0 && !strcmp(cmd_index[n - 1], cmd_index[i]))
+            free(cmd_index[i]);
+        else
+            cmd_index[n++] = cmd_index[i];
+    }
+    ncmd_index = n;
+    cmd_indexed = 1;
+}
+
+/*
+ * cmdindex_lower - The first entry of cmd_index not before name
+ */
+size_t cmdindex_lower(const char *name) {
+    size_t lo = 0, hi = ncmd_index;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(cmd_index[mid], name) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * cmdindex_update - A PATH directory changed name: add it to the index
+ *     or remove it, whether some PATH directory still has a program of
+ *     that name
+ */
+void cmdindex_update(char *name) {
+    char file[PATH_MAX];
+    struct stat st;
+    size_t i;
+    int found = 0;
+
+    if (!cmd_indexed)
+        return;
+    for (int k = 0; k < npath && !found; k++) {
+        snprintf(file, sizeof(file), "%s/%s", PATH[k], name);
+        found = access(file, X_OK) == 0 && stat(file, &st) == 0 && !S_ISDIR(st.st_mode);
+    }
+
+    i = cmdindex_lower(name);
+    if (i < ncmd_index && !strcmp(cmd_index[i], name)) {
+        if (!found) {
+            free(cmd_index[i]);
+            memmove(cmd_index + i, cmd_index + i + 1, (ncmd_index - i - 1) * sizeof(char *));
+            ncmd_index--;
+        }
+    } else if (found) {
+        if (ncmd_index == maxcmd_index) {
+            size_t max = maxcmd_index ? 2 * maxcmd_index : 1024;
+            char **p = (char **) realloc(cmd_index, max * sizeof(char *));
+            if (p == NULL)
+                return;
+            cmd_index = p;
+            maxcmd_index = max;
+        }
+        if ((name = strdup(name)) == NULL)
+            return;
+        memmove(cmd_index + i + 1, cmd_index + i, (ncmd_index - i) * sizeof(char *));
+        cmd_index[i] = name;
+        ncmd_index++;
+    }
+}
+
+/*
+ * cmdindex_free - Drop the index, the next Tab builds it again
+ */
+void cmdindex_free(void) {
+    for (size_t i = 0; i < ncmd_index; i++)
+        free(cmd_index[i]);
+    ncmd_index = 0;
+    cmd_indexed = 0;
+}
+
+/* edit_reserve - Make room for n bytes in a buffer of the editor */
+static void edit_reserve(char **buf, size_t *size, size_t n) {
+    if (n <= *size)
+        return;
+    *size = (n > 2 * *size) ? n : 2 * *size;
+    if ((*buf = (char *) realloc(*buf, *size)) == NULL)
+        app_error("edit_line: out of memory");
+}
+
+/* edit_put - Queue n bytes of output */
+static void edit_put(struct edit_t *ed, const char *s, size_t n) {
+    edit_reserve(&ed->out, &ed->outsize, ed->outlen + n);
+    memcpy(ed->out + ed->outlen, s, n);
+    ed->outlen += n;
+}
+
+/* edit_puts - Queue a string of output */
+static void edit_puts(struct edit_t *ed, const char *s) {
+    edit_put(ed, s, strlen(s));
+}
+
+/* edit_flush - Write the queued output */
+static void edit_flush(struct edit_t *ed) {
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < ed->outlen) {
+        if ((n = write(STDOUT_FILENO, ed->out + done, ed->outlen - done)) < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            break;
+        }
+        done += n;
+    }
+    ed->outlen = 0;
+}
+
+/* edit_cols - Columns taken by n bytes of UTF-8 text */
+static size_t edit_cols(const char *s, size_t n) {
+    size_t cols = 0;
+
+    for (size_t i = 0; i < n; i++)
+        if ((s[i] & 0xc0) != 0x80)
+            cols++;
+    return cols;
+}
+
+/*
+ * edit_move - Move the cursor from column from to column to, both
+ *     counted from the start of the prompt over the wrapped rows
+ */
+static void edit_move(struct edit_t *ed, size_t from, size_t to) {
+    char seq[32];
+    size_t fr = from / ed->cols, fc = from % ed->cols;
+    size_t tr = to / ed->cols, tc = to % ed->cols;
+
+    if (tr < fr)
+        edit_put(ed, seq, snprintf(seq, sizeof(seq), "\x1b[%zuA", fr - tr));
+    else if (tr > fr)
+        edit_put(ed, seq, snprintf(seq, sizeof(seq), "\x1b[%zuB", tr - fr));
+    if (tc < fc)
+        edit_put(ed, seq, snprintf(seq, sizeof(seq), "\x1b[%zuD", fc - tc));
+    else if (tc > fc)
+        edit_put(ed, seq, snprintf(seq, sizeof(seq), "\x1b[%zuC", tc - fc));
+}
+
+/*
+ * edit_refresh - Bring the screen up to date with the line, rewriting
+ *     only what changed
+ */
+void edit_refresh(struct edit_t *ed) {
+    size_t p = 0, from = ed->pcols + edit_cols(ed->shown, ed->shownpos);
+    size_t end = ed->pcols + edit_cols(ed->buf, ed->len);
+
+    while (p < ed->len && p < ed->shownlen && ed->buf[p] == ed->shown[p])
+        p++;
+    while (p > 0 && (ed->buf[p] & 0xc0) == 0x80) /* not in the middle of a character */
+        p--;
+
+    if (p < ed->len || p < ed->shownlen) {
+        edit_move(ed, from, ed->pcols + edit_cols(ed->buf, p));
+        edit_put(ed, ed->buf + p, ed->len - p);
+        if (end % ed->cols == 0 && p < ed->len) /* the terminal waits to wrap */
+            edit_puts(ed, "\r\n");
+        if (ed->pcols + edit_cols(ed->shown, ed->shownlen) > end)
+            edit_puts(ed, "\x1b[J");
+        from = end;
+    }
+    edit_move(ed, from, ed->pcols + edit_cols(ed->buf, ed->pos));
+    edit_flush(ed);
+
+    edit_reserve(&ed->shown, &ed->shownsize, ed->len + 1);
+    memcpy(ed->shown, ed->buf, ed->len + 1);
+    ed->shownlen = ed->len;
+    ed->shownpos = ed->pos;
+}
+
+/*
+ * edit_prompt - Draw the line again after another prompt
+ */
+void edit_prompt(struct edit_t *ed, const char *prompt) {
+    size_t from = ed->pcols + edit_cols(ed->shown, ed->shownpos);
+
+    edit_move(ed, from, from % ed->cols); /* up to the first row, then \r */
+    edit_puts(ed, "\r\x1b[J");
+    edit_puts(ed, prompt);
+    ed->prompt = prompt;
+    ed->pcols = edit_cols(prompt, strlen(prompt));
+    if (ed->pcols > 0 && ed->pcols % ed->cols == 0)
+        edit_puts(ed, "\r\n");
+    ed->shownlen = ed->shownpos = 0;
+    edit_refresh(ed);
+}
+
+/* edit_insert - Insert n bytes at the cursor */
+static void edit_insert(struct edit_t *ed, const char *s, size_t n) {
+    edit_reserve(&ed->buf, &ed->size, ed->len + n + 2);
+    memmove(ed->buf + ed->pos + n, ed->buf + ed->pos, ed->len - ed->pos + 1);
+    memcpy(ed->buf + ed->pos, s, n);
+    ed->len += n;
+    ed->pos += n;
+}
+
+/* edit_delete - Delete the bytes from to to of the line */
+static void edit_delete(struct edit_t *ed, size_t from, size_t to) {
+    memmove(ed->buf + from, ed->buf + to, ed->len - to + 1);
+    ed->len -= to - from;
+    if (ed->pos >= to)
+        ed->pos -= to - from;
+    else if (ed->pos > from)
+        ed->pos = from;
+}
+
+/* edit_set - Replace the line, with the cursor at its end */
+static void edit_set(struct edit_t *ed, const char *s, size_t n) {
+    ed->len = ed->pos = 0;
+    edit_reserve(&ed->buf, &ed->size, 2);
+    ed->buf[0] = '\0';
+    edit_insert(ed, s, n);
+}
+
+/* edit_prev - Start of the character before offset i */
+static size_t edit_prev(struct edit_t *ed, size_t i) {
+    while (i > 0 && (ed->buf[--i] & 0xc0) == 0x80)
+        ;
+    return i;
+}
+
+/* edit_next - Start of the character after offset i */
+static size_t edit_next(struct edit_t *ed, size_t i) {
+    while (i < ed->len && (ed->buf[++i] & 0xc0) == 0x80)
+        ;
+    return i;
+}
+
+/* edit_word - Start of the word before offset i (dir < 0) or end of the word after it */
+static size_t edit_word(struct edit_t *ed, size_t i, int dir) {
+    if (dir < 0) {
+        while (i > 0 && IS_BLANK(ed->buf[i - 1]))
+            i--;
+        while (i > 0 && !IS_BLANK(ed->buf[i - 1]))
+            i--;
+    } else {
+        while (i < ed->len && IS_BLANK(ed->buf[i]))
+            i++;
+        while (i < ed->len && !IS_BLANK(ed->buf[i]))
+            i++;
+    }
+    return i;
+}
+
+/*
+ * edit_byte - The next byte typed, waiting for it through the event
+ *     loop, or at most wait ms if wait >= 0. Returns -1 at end of file,
+ *     -2 if the wait ran out.
+ */
+static int edit_byte(struct edit_t *ed, int wait) {
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    ssize_t n;
+
+    while (ed->instart == ed->inend) {
+        if (wait >= 0) {
+            if (poll(&pfd, 1, wait) <= 0)
+                return -2;
+        } else {
+            while (!event_wait(1))
+                ;
+        }
+        if ((n = read(STDIN_FILENO, ed->in, sizeof(ed->in))) < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+            return -1;
+        ed->instart = 0;
+        ed->inend = n;
+    }
+    return ed->in[ed->instart++];
+}
+
+/*
+ * edit_key - The next key typed: a byte, or one of the KEY_ codes for
+ *     the escape sequences of the cursor keys. -1 at end of file, 0 for
+ *     a sequence the editor does not know.
+ */
+int edit_key(struct edit_t *ed) {
+    int c = edit_byte(ed, -1), n = 0, mod = 0;
+
+    if (c != 27)
+        return c;
+    if ((c = edit_byte(ed, ESCWAIT)) < 0) /* Esc itself */
+        return 27;
+    if (c == 'b')
+        return KEY_WLEFT;
+    if (c == 'f')
+        return KEY_WRIGHT;
+    if (c != '[' && c != 'O')
+        return 0;
+
+    /* CSI: parameters, then the final byte */
+    while ((c = edit_byte(ed, ESCWAIT)) >= 0 && (isdigit(c) || c == ';')) {
+        if (c == ';')
+            mod = 1;
+        else if (!mod)
+            n = 10 * n + c - '0';
+    }
+    switch (c) {
+        case 'A':
+            return KEY_UP;
+        case 'B':
+            return KEY_DOWN;
+        case 'C':
+            return mod ? KEY_WRIGHT : KEY_RIGHT;
+        case 'D':
+            return mod ? KEY_WLEFT : KEY_LEFT;
+        case 'H':
+            return KEY_HOME;
+        case 'F':
+            return KEY_END;
+        case '~':
+            if (n == 1 || n == 7)
+                return KEY_HOME;
+            if (n == 4 || n == 8)
+                return KEY_END;
+            if (n == 3)
+                return KEY_DEL;
+    }
+    return 0;
+}
+
+/* edit_history - Show the entry of the history before (dir < 0) or after the one shown */
+static void edit_history(struct edit_t *ed, int dir) {
+    size_t len;
+    char *e;
+
+    if ((dir < 0 && ed->hist == 0) || (dir > 0 && ed->hist >= ed->nhist))
+        return;
+    if (ed->hist == ed->nhist) {
+        free(ed->saved);
+        ed->saved = strdup(ed->buf);
+    }
+    ed->hist += dir;
+    if (ed->hist == ed->nhist) {
+        edit_set(ed, ed->saved ? ed->saved : "", ed->saved ? strlen(ed->saved) : 0);
+    } else {
+        e = hist_entry(ed->hist, &len);
+        edit_set(ed, e, len);
+    }
+}
+
+/*
+ * edit_search - Ctrl-R: search the history as the text is typed. Ctrl-R
+ *     again finds an older entry, Ctrl-G gives the line back. Any other
+ *     key ends the search with the entry found in the line, and is
+ *     returned to be handled as usual.
+ */
+int edit_search(struct edit_t *ed) {
+    char q[MAXLINE], prompt[MAXLINE + 32], *orig = strdup(ed->buf), *e;
+    const char *oldprompt = ed->prompt;
+    size_t qlen = 0, origpos = ed->pos, len;
+    long match = -1, m;
+    int c, failed = 0;
+
+    q[0] = '\0';
+    while (1) {
+        snprintf(prompt, sizeof(prompt), "(%sreverse-i-search)`%s': ", failed ? "failed " : "", q);
+        edit_prompt(ed, prompt);
+
+        c = edit_key(ed);
+        if (c == CTRL('R')) {
+            if (qlen == 0 || match < 0)
+                continue;
+            m = hist_search(q, match);
+        } else if (c == 127 || c == CTRL('H')) {
+            if (qlen > 0)
+                q[--qlen] = '\0';
+            m = qlen ? hist_search(q, ed->nhist) : -1;
+            match = -1;
+        } else if (c >= 32 && c < 256 && qlen + 1 < sizeof(q)) {
+            q[qlen++] = c;
+            q[qlen] = '\0';
+            m = hist_search(q, match >= 0 ? match + 1 : (long) ed->nhist);
+        } else {
+            if (c == CTRL('G') || c == CTRL('C')) {
+                edit_set(ed, orig, strlen(orig));
+                ed->pos = origpos;
+                c = 0;
+            }
+            break;
+        }
+
+        failed = qlen > 0 && m < 0;
+        if (m >= 0) {
+            match = m;
+            e = hist_entry(match, &len);
+            edit_set(ed, e, len);
+            ed->pos = (char *) memmem(e, len, q, qlen) - e;
+        }
+    }
+
+    edit_prompt(ed, oldprompt);
+    free(orig);
+    return c;
+}
+
+/* edit_match - Add a candidate of a completion */
+static void edit_match(char ***match, size_t *n, size_t *max, const char *name, int dir) {
+    if (*n == *max) {
+        *max = *max ? 2 * *max : 64;
+        if ((*match = (char **) realloc(*match, *max * sizeof(char *))) == NULL)
+            app_error("edit_complete: out of memory");
+    }
+    if (((*match)[*n] = (char *) malloc(strlen(name) + 2)) == NULL)
+        app_error("edit_complete: out of memory");
+    sprintf((*match)[(*n)++], "%s%s", name, dir ? "/" : "");
+}
+
+/*
+ * edit_complete - Tab: complete the word before the cursor, a command
+ *     name if it is the first word of a command, else a file name.
+ *     What all the candidates start with is inserted; a second Tab
+ *     lists them.
+ */
+void edit_complete(struct edit_t *ed) {
+    char word[MAXLINE], dir[MAXLINE], **match = NULL, *base, quote = 0, seq[2];
+    size_t ws, i, n = 0, max = 0, wlen = 0, blen, common, width = 0;
+    struct dirent *de;
+    DIR *d;
+
+    /* the word before the cursor, without its quotes and backslashes */
+    for (ws = ed->pos; ws > 0; ws--) {
+        char c = ed->buf[ws - 1];
+        if ((IS_BLANK(c) || IS_OPERATOR(c)) && !(ws > 1 && ed->buf[ws - 2] == '\\'))
+            break;
+    }
+    for (i = ws; i < ed->pos && wlen + 1 < sizeof(word); i++) {
+        char c = ed->buf[i];
+        if (quote ? c == quote : (c == '\'' || c == '"'))
+            quote = quote ? 0 : c;
+        else if (c == '\\' && !quote && i + 1 < ed->pos)
+            word[wlen++] = ed->buf[++i];
+        else
+            word[wlen++] = c;
+    }
+    word[wlen] = '\0';
+
+    for (i = ws; i > 0 && IS_BLANK(ed->buf[i - 1]); i--)
+        ;
+    if ((i == 0 || ed->buf[i - 1] == '|' || ed->buf[i - 1] == ';' || ed->buf[i - 1] == '&' ||
+         (i > 1 && ed->buf[i - 1] == '>' && ed->buf[i - 2] == '|') ||
+         (ed->buf[i - 1] == ',' && memmem(ed->buf, i, "|>", 2) != NULL)) &&
+        strchr(word, '/') == NULL) {
+        base = word;
+        hash_check();
+        if (!cmd_indexed || inotify_fd < 0) /* not kept up to date without the watch */
+            cmdindex_build();
+        for (i = cmdindex_lower(word); i < ncmd_index && !strncmp(cmd_index[i], word, wlen); i++)
+            edit_match(&match, &n, &max, cmd_index[i], 0);
+        for (i = 0; builtin_names[i] != NULL; i++)
+            if (!strncmp(builtin_names[i], word, wlen))
+                edit_match(&match, &n, &max, builtin_names[i], 0);
+        for (i = 0; i < HASHSIZE; i++)
+            for (struct alias_t *a = alias_hash[i]; a != NULL; a = a->next)
+                if (!strncmp(a->name, word, wlen))
+                    edit_match(&match, &n, &max, a->name, 0);
+    } else {
+        if ((base = strrchr(word, '/')) != NULL) {
+            snprintf(dir, sizeof(dir), "%.*s", (int) (base == word ? 1 : base - word), word);
+            base++;
+        } else {
+            strcpy(dir, ".");
+            base = word;
+        }
+        if ((d = opendir(dir)) != NULL) {
+            blen = strlen(base);
+            while ((de = readdir(d)) != NULL) {
+                if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..") ||
+                    (de->d_name[0] == '.' && base[0] != '.') || strncmp(de->d_name, base, blen))
+                    continue;
+                edit_match(&match, &n, &max, de->d_name, is_dir_entry(d, de));
+            }
+            closedir(d);
+        }
+    }
+    blen = strlen(base);
+
+    if (n == 0) {
+        edit_puts(ed, "\a");
+        edit_flush(ed);
+        return;
+    }
+    qsort(match, n, sizeof(char *), cmdindex_cmp);
+    for (i = 1, max = 1; i < n; i++) { /* a builtin may also be a program */
+        if (strcmp(match[max - 1], match[i]))
+            match[max++] = match[i];
+        else
+            free(match[i]);
+    }
+    n = max;
+
+    common = strlen(match[0]);
+    for (i = 1; i < n; i++) {
+        size_t k = 0;
+        while (k < common && match[i][k] == match[0][k])
+            k++;
+        common = k;
+    }
+    while (common > blen && (match[0][common] & 0xc0) == 0x80)
+        common--;
+
+    if (common > blen || n == 1) {
+        for (i = blen; i < common; i++) {
+            seq[0] = '\\';
+            seq[1] = match[0][i];
+            if (!quote && strchr(LEX_SPECIAL, seq[1]) != NULL)
+                edit_insert(ed, seq, 2);
+            else
+                edit_insert(ed, seq + 1, 1);
+        }
+        if (n == 1 && match[0][common - 1] != '/') {
+            if (quote)
+                edit_insert(ed, &quote, 1);
+            edit_insert(ed, " ", 1);
+        }
+    } else if (n > 1 && ed->tabs >= 2) {
+        size_t cols, rows;
+
+        for (i = 0; i < n; i++)
+            if (edit_cols(match[i], strlen(match[i])) + 2 > width)
+                width = edit_cols(match[i], strlen(match[i])) + 2;
+        cols = (ed->cols / width) ? ed->cols / width : 1;
+        rows = (n + cols - 1) / cols;
+
+        ed->pos = ed->len;
+        edit_refresh(ed);
+        edit_puts(ed, "\r\n");
+        for (size_t r = 0; r < rows; r++) {
+            for (size_t c = 0; c < cols && c * rows + r < n; c++) {
+                char *s = match[c * rows + r];
+                edit_puts(ed, s);
+                if ((c + 1) * rows + r < n)
+                    for (size_t k = edit_cols(s, strlen(s)); k < width; k++)
+                        edit_puts(ed, " ");
+            }
+            edit_puts(ed, "\r\n");
+        }
+        edit_puts(ed, ed->prompt);
+        ed->shownlen = ed->shownpos = 0;
+    } else {
+        edit_puts(ed, "\a");
+    }
+
+    for (i = 0; i < n; i++)
+        free(match[i]);
+    free(match);
+}
+
+/*
+ * edit_restore - Give the terminal its settings back
+ */
+void edit_restore(void) {
+    if (tty_raw) {
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &tty_cooked);
+        tty_raw = 0;
+    }
+}
+
+/*
+ * edit_line - Read a command line with the editor. It is returned with
+ *     its '\n', NULL at end of file.
+ */
+char *edit_line(const char *prompt) {
+    static struct edit_t ed;
+    static int registered = 0;
+    struct termios raw;
+    struct winsize ws;
+    int c;
+
+    if (tcgetattr(STDIN_FILENO, &tty_cooked) < 0)
+        return getcmdline();
+    raw = tty_cooked;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cflag |= CS8;
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    if (!registered) {
+        atexit(edit_restore);
+        registered = 1;
+    }
+    if (tcsetattr(STDIN_FILENO, TCSADRAIN, &raw) == 0)
+        tty_raw = 1;
+
+    ed.cols = (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) ? ws.ws_col : 80;
+    hist_sync();
+    ed.hist = ed.nhist = hist_n;
+    ed.tabs = 0;
+    edit_set(&ed, "", 0);
+    ed.shownlen = ed.shownpos = 0;
+    ed.prompt = prompt;
+    ed.pcols = edit_cols(prompt, strlen(prompt));
+    edit_puts(&ed, prompt);
+    edit_flush(&ed);
+
+    while (1) {
+        c = edit_key(&ed);
+        if (c == CTRL('R'))
+            c = edit_search(&ed);
+        ed.tabs = (c == '\t') ? ed.tabs + 1 : 0;
+
+        switch (c) {
+            case -1: /* end of file */
+                if (ed.len == 0) {
+                    edit_restore();
+                    return NULL;
+                }
+                goto done;
+            case '\r':
+            case '\n':
+                goto done;
+            case CTRL('D'):
+                if (ed.len == 0) {
+                    edit_puts(&ed, "\r\n");
+                    edit_flush(&ed);
+                    edit_restore();
+                    return NULL;
+                }
+                /* fall through */
+            case KEY_DEL:
+                if (ed.pos < ed.len)
+                    edit_delete(&ed, ed.pos, edit_next(&ed, ed.pos));
+                break;
+            case CTRL('C'):
+                ed.pos = ed.len;
+                edit_refresh(&ed);
+                edit_puts(&ed, "^C\r\n");
+                edit_set(&ed, "", 0);
+                ed.hist = ed.nhist;
+                edit_puts(&ed, ed.prompt);
+                ed.shownlen = ed.shownpos = 0;
+                break;
+            case 127:
+            case CTRL('H'):
+                if (ed.pos > 0)
+                    edit_delete(&ed, edit_prev(&ed, ed.pos), ed.pos);
+                break;
+            case KEY_LEFT:
+            case CTRL('B'):
+                ed.pos = edit_prev(&ed, ed.pos);
+                break;
+            case KEY_RIGHT:
+            case CTRL('F'):
+                ed.pos = edit_next(&ed, ed.pos);
+                break;
+            case KEY_WLEFT:
+                ed.pos = edit_word(&ed, ed.pos, -1);
+                break;
+            case KEY_WRIGHT:
+                ed.pos = edit_word(&ed, ed.pos, 1);
+                break;
+            case KEY_HOME:
+            case CTRL('A'):
+                ed.pos = 0;
+                break;
+            case KEY_END:
+            case CTRL('E'):
+                ed.pos = ed.len;
+                break;
+            case CTRL('K'):
+                edit_delete(&ed, ed.pos, ed.len);
+                break;
+            case CTRL('U'):
+                edit_delete(&ed, 0, ed.pos);
+                break;
+            case CTRL('W'):
+                edit_delete(&ed, edit_word(&ed, ed.pos, -1), ed.pos);
+                break;
+            case CTRL('L'):
+                edit_puts(&ed, "\x1b[H\x1b[2J");
+                edit_puts(&ed, ed.prompt);
+                ed.shownlen = ed.shownpos = 0;
+                break;
+            case KEY_UP:
+            case CTRL('P'):
+                edit_history(&ed, -1);
+                break;
+            case KEY_DOWN:
+            case CTRL('N'):
+                edit_history(&ed, 1);
+                break;
+            case '\t':
+                edit_complete(&ed);
+                break;
+            default:
+                if (c >= 32 && c < 256 && c != 127) {
+                    char ch = c;
+                    edit_insert(&ed, &ch, 1);
+                }
+        }
+        if (ed.instart == ed.inend) /* else more keys are already here */
+            edit_refresh(&ed);
+    }
+
+done:
+    ed.pos = ed.len;
+    edit_refresh(&ed);
+    edit_puts(&ed, "\r\n");
+    edit_flush(&ed);
+    edit_restore();
+    ed.buf[ed.len] = '\n';
+    ed.buf[ed.len + 1] = '\0';
+    return ed.buf;
+}
+
+/**************
+ * Server mode
+ *
+ * CaiShell --serve path.sock stays resident and runs the command lines
+ * its clients send over a Unix domain socket, so a service pays for
+ * init() and the config once instead of for every system(). A message
+ * is a frame_t and its data. A request is any number of SERVE_ENV and
+ * SERVE_CWD frames and a SERVE_CMD frame with the same id; it is
+ * answered with SERVE_OUT and SERVE_ERR frames as the output comes and
+ * a last SERVE_EXIT frame with the status and rusage. Each request runs
+ * in a worker forked from the shell, which evaluates the lines with its
+ * own job list; the server watches the worker as a background job and
+ * its output pipes in the event loop, so any number of requests run at
+ * once, from one client or many, and none waits for another. A client
+ * that does not read its answers only stops its own workers, when
+ * SERVE_MAXOUT bytes are queued for it.
+ **************/
+
+/*
+ * serve - Listen on the socket path and run the requests of the
+ *     clients. Does not return.
+ */
+void serve(char *path) {
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        app_error("serve: socket path too long");
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if ((serve_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+        unix_error("socket error");
+    unlink(path); /* left by a server that was killed */
+    if (bind(serve_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+        unix_error(path);
+    if (listen(serve_fd, SOMAXCONN) < 0)
+        unix_error("listen error");
+    watchfd(serve_fd, serve_accept, NULL);
+    if (verbose)
+        printf("serving on %s\n", path);
+    fflush(stdout);
+
+    while (1)
+        event_wait(0);
+}
+
+/*
+ * serve_accept - Take the new clients
+ */
+void serve_accept(int fd, void *arg) {
+    struct conn_t *c;
+    int cfd;
+
+    while ((cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        if ((c = (struct conn_t *) calloc(1, sizeof(struct conn_t))) == NULL) {
+            close(cfd);
+            continue;
+        }
+        c->fd = cfd;
+        c->next = serve_conns;
+        serve_conns = c;
+        watchfd(cfd, serve_conn, c);
+    }
+}
+
+/*
+ * serve_conn - A client sent frames, or can take the ones queued for it
+ */
+void serve_conn(int fd, void *arg) {
+    struct conn_t *c = (struct conn_t *) arg;
+    struct frame_t f;
+    size_t off = 0;
+    ssize_t n;
+
+    serve_flush(c);
+    if (c->fd < 0)
+        return;
+
+    if (c->insize - c->inlen < 65536) {
+        c->insize = c->insize ? 2 * c->insize : 65536;
+        if ((c->in = (char *) realloc(c->in, c->insize)) == NULL)
+            app_error("serve: out of memory");
+    }
+    if ((n = read(fd, c->in + c->inlen, c->insize - c->inlen)) <= 0) {
+        if (n == 0 || (errno != EAGAIN && errno != EINTR))
+            serve_close(c);
+        return;
+    }
+    c->inlen += n;
+
+    while (c->inlen - off >= sizeof(f)) {
+        memcpy(&f, c->in + off, sizeof(f));
+        if (f.len > SERVE_MAXFRAME) {
+            if (verbose)
+                printf("serve: frame of %u bytes, closing the client\n", f.len);
+            serve_close(c);
+            return;
+        }
+        if (c->inlen - off < sizeof(f) + f.len)
+            break;
+        serve_frame(c, &f, c->in + off + sizeof(f));
+        off += sizeof(f) + f.len;
+    }
+    memmove(c->in, c->in + off, c->inlen - off);
+    c->inlen -= off;
+}
+
+/*
+ * serve_frame - Handle a frame of a client
+ */
+void serve_frame(struct conn_t *c, struct frame_t *f, char *data) {
+    struct req_t *r;
+
+    for (r = c->req; r != NULL; r = r->next)
+        if (r->id == f->id && r->pid == 0)
+            break;
+    if (r == NULL) {
+        if ((r = (struct req_t *) calloc(1, sizeof(struct req_t))) == NULL)
+            app_error("serve: out of memory");
+        r->conn = c;
+        r->id = f->id;
+        r->out = r->err = -1;
+        r->next = c->req;
+        c->req = r;
+    }
+
+    switch (f->type) {
+        case SERVE_ENV:
+            r->env = (char **) realloc(r->env, (r->nenv + 1) * sizeof(char *));
+            r->env[r->nenv++] = strndup(data, f->len);
+            break;
+        case SERVE_CWD:
+            free(r->cwd);
+            r->cwd = strndup(data, f->len);
+            break;
+        case SERVE_CMD:
+            serve_start(r, data, f->len);
+            break;
+        default:
+            if (verbose)
+                printf("serve: unknown frame type %u\n", f->type);
+    }
+}
+
+/*
+ * serve_start - Fork the worker of a request
+ */
+void serve_start(struct req_t *r, char *cmd, size_t len) {
+    int out[2] = {-1, -1}, err[2] = {-1, -1}, null;
+    struct job_t *job;
+    char *cmdline;
+
+    clock_gettime(CLOCK_MONOTONIC, &r->start);
+    if (pipe2(out, O_CLOEXEC) < 0 || pipe2(err, O_CLOEXEC) < 0 || (r->pid = fork()) < 0) {
+        char msg[128];
+        int n = snprintf(msg, sizeof(msg), "serve: %s\n", strerror(errno));
+
+        serve_queue(r->conn, SERVE_ERR, r->id, msg, n);
+        r->pid = -1;
+        r->status = 126;
+        for (int i = 0; i < 2; i++) {
+            if (out[i] >= 0)
+                close(out[i]);
+            if (err[i] >= 0)
+                close(err[i]);
+        }
+        serve_finish(r);
+        return;
+    }
+
+    if (r->pid == 0) { /* the worker: a shell of its own */
+        setpgid(0, 0);
+        close(serve_fd);
+        for (struct conn_t *p = serve_conns; p != NULL; p = p->next)
+            if (p->fd >= 0)
+                close(p->fd);
+        if (inotify_fd >= 0) { /* its events belong to the server */
+            close(inotify_fd);
+            inotify_fd = -1;
+        }
+        if ((null = open("/dev/null", O_RDONLY)) >= 0 && null != STDIN_FILENO) {
+            dup2(null, STDIN_FILENO);
+            close(null);
+        }
+        dup2(out[1], STDOUT_FILENO);
+        dup2(err[1], STDERR_FILENO);
+        events_reset();
+
+        for (int i = 0; i < r->nenv; i++)
+            var_assign(r->env[i], VAR_EXPORT);
+        if (r->cwd != NULL && chdir(r->cwd) < 0) {
+            fprintf(stderr, "%s: %s\n", r->cwd, strerror(errno));
+            _exit(1);
+        }
+        eval_lines(cmd, len);
+        fflush(stdout);
+        _exit(last_status);
+    }
+
+    setpgid(r->pid, r->pid);
+    close(out[1]);
+    close(err[1]);
+    r->out = out[0];
+    r->err = err[0];
+    fcntl(r->out, F_SETFL, O_NONBLOCK);
+    fcntl(r->err, F_SETFL, O_NONBLOCK);
+    if (!r->paused) {
+        watchfd(r->out, serve_output, r);
+        watchfd(r->err, serve_output, r);
+    }
+
+    cmdline = strndup(cmd, len);
+    addjob(r->pid, r->pid, BG, cmdline);
+    free(cmdline);
+    if ((job = getjobpgid(r->pid)) != NULL) {
+        job->ondone = serve_done;
+        job->arg = r;
+    }
+}
+
+/*
+ * serve_output - Pass on what a worker wrote, a read at a time so all
+ *     the workers get their turn
+ */
+void serve_output(int fd, void *arg) {
+    struct req_t *r = (struct req_t *) arg;
+    char buf[65536];
+    ssize_t n;
+
+    if ((n = read(fd, buf, sizeof(buf))) > 0) {
+        serve_queue(r->conn, (fd == r->out) ? SERVE_OUT : SERVE_ERR, r->id, buf, n);
+        return;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    unwatchfd(fd);
+    close(fd);
+    if (fd == r->out)
+        r->out = -1;
+    else
+        r->err = -1;
+    serve_finish(r);
+}
+
+/*
+ * serve_done - The worker of a request was reaped
+ */
+void serve_done(struct job_t *job) {
+    struct req_t *r = (struct req_t *) job->arg;
+
+    r->status = job->status;
+    r->ru = job->ru;
+    r->pid = -1;
+    serve_finish(r);
+}
+
+/* serve_free - Free a request */
+static void serve_free(struct req_t *r) {
+    for (int i = 0; i < r->nenv; i++)
+        free(r->env[i]);
+    free(r->env);
+    free(r->cwd);
+    free(r);
+}
+
+/* serve_drop - Free a client that is gone once nothing runs for it */
+static void serve_drop(struct conn_t *c) {
+    if (c->fd >= 0 || c->req != NULL)
+        return;
+    for (struct conn_t **cp = &serve_conns; *cp != NULL; cp = &(*cp)->next)
+        if (*cp == c) {
+            *cp = c->next;
+            break;
+        }
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+/*
+ * serve_finish - Answer the last frame of a request once its worker is
+ *     reaped and its output read, and drop it
+ */
+void serve_finish(struct req_t *r) {
+    struct conn_t *c = r->conn;
+    struct serve_exit_t e;
+    struct timespec now;
+    struct req_t **pp;
+
+    if (r->pid >= 0 || r->out >= 0 || r->err >= 0)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    memset(&e, 0, sizeof(e));
+    e.status = r->status;
+    e.real_us = (int64_t) (timespec_diff(&now, &r->start) * 1e6);
+    e.user_us = r->ru.ru_utime.tv_sec * 1000000LL + r->ru.ru_utime.tv_usec;
+    e.sys_us = r->ru.ru_stime.tv_sec * 1000000LL + r->ru.ru_stime.tv_usec;
+    e.maxrss_kb = r->ru.ru_maxrss;
+    e.minflt = r->ru.ru_minflt;
+    e.majflt = r->ru.ru_majflt;
+    e.nvcsw = r->ru.ru_nvcsw;
+    e.nivcsw = r->ru.ru_nivcsw;
+    serve_queue(c, SERVE_EXIT, r->id, &e, sizeof(e));
+
+    for (pp = &c->req; *pp != NULL; pp = &(*pp)->next)
+        if (*pp == r) {
+            *pp = r->next;
+            break;
+        }
+    serve_free(r);
+    serve_drop(c);
+}
+
+/*
+ * serve_queue - Send a frame to a client, keeping what the socket does
+ *     not take yet
+ */
+void serve_queue(struct conn_t *c, uint32_t type, uint32_t id, const void *data, size_t len) {
+    struct frame_t f = {type, id, (uint32_t) len};
+
+    if (c->fd < 0)
+        return;
+    if (c->outsize - c->outlen < sizeof(f) + len) {
+        while (c->outsize - c->outlen < sizeof(f) + len)
+            c->outsize = c->outsize ? 2 * c->outsize : 65536;
+        if ((c->out = (char *) realloc(c->out, c->outsize)) == NULL)
+            app_error("serve: out of memory");
     }
-
-    return 0;     /* not a builtin command */
+    memcpy(c->out + c->outlen, &f, sizeof(f));
+    memcpy(c->out + c->outlen + sizeof(f), data, len);
+    c->outlen += sizeof(f) + len;
+    serve_flush(c);
 }
 
-/* 
- * alias_add - add the rename command
+/*
+ * serve_flush - Send what is queued for a client. Its workers wait
+ *     while too much is queued.
  */
-void alias_add(char **argv) {
-    struct alias_t *p;
-    char *delim;
-
-    /* if (argv[2] == NULL) {
-         if ((delim = strchr(argv[1], '=')) && delim[1] != '\'') {
-             fprintf(stderr, "Error command of alias\n");
-             return;
-         } else {
-
-             *delim = '\0';
-             delim += 2;
-             argv[3] = delim;
-             delim = strchr(argv[3], '\'');
-             *delim = '\0';
-
-         }
-     } else if (argv[3] == NULL) {
-         if (argv[2][0] != '=' && argv[2][1] != '\'') {
-             fprintf(stderr, "Error command of alias\n");
-             return;
-         } else {
-             delim = &argv[2][2];
-             argv[3] = delim;
-             delim = strchr(argv[3], '\'');
-             *delim = '\0';
-         }
-     }else*/ if (argv[4] != NULL) {
-        fprintf(stderr, "Error command of alias\n");
-        return;
-    } else if (argv[2][1] == '\'') {
-        fprintf(stderr, "Error command of alias\n");
+void serve_flush(struct conn_t *c) {
+    size_t off = 0;
+    ssize_t n;
+
+    if (c->fd < 0)
         return;
+    while (off < c->outlen) {
+        if ((n = send(c->fd, c->out + off, c->outlen - off, MSG_NOSIGNAL | MSG_DONTWAIT)) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN) /* gone, serve_conn() reads the end */
+                off = c->outlen;
+            break;
+        }
+        off += n;
+    }
+    if (off > 0) {
+        memmove(c->out, c->out + off, c->outlen - off);
+        c->outlen -= off;
     }
 
+    watchfd_write(c->fd, c->outlen > 0);
+    serve_pause(c, c->outlen >= SERVE_MAXOUT);
+}
 
-    p = alias_p;
-    while (p != NULL) {
-        if (!strcmp(p->new_command, argv[1])) {
-
-            strcpy(p->old_command, argv[3]);
-
-            return;
-        } else
-            p = p->next;
+/*
+ * serve_pause - Stop (pause) or go on reading the output of the
+ *     workers of a client
+ */
+void serve_pause(struct conn_t *c, int pause) {
+    for (struct req_t *r = c->req; r != NULL; r = r->next) {
+        if (r->paused == pause)
+            continue;
+        r->paused = pause;
+        for (int i = 0; i < 2; i++) {
+            int fd = i ? r->err : r->out;
+            if (fd < 0)
+                continue;
+            if (pause)
+                unwatchfd(fd);
+            else
+                watchfd(fd, serve_output, r);
+        }
     }
+}
 
-    p = (struct alias_t *) malloc(sizeof(struct alias_t));
-
-    strcpy(p->new_command, argv[1]);
-    strcpy(p->old_command, argv[3]);
+/*
+ * serve_close - A client went away: stop its workers, their output goes
+ *     nowhere from now on
+ */
+void serve_close(struct conn_t *c) {
+    struct req_t **pp = &c->req, *r;
+
+    unwatchfd(c->fd);
+    close(c->fd);
+    c->fd = -1;
+    c->outlen = 0;
+    serve_pause(c, 0);
+    while ((r = *pp) != NULL) {
+        if (r->pid == 0) { /* never started */
+            *pp = r->next;
+            serve_free(r);
+            continue;
+        }
+        if (r->pid > 0)
+            kill(-r->pid, SIGTERM);
+        pp = &r->next;
+    }
+    serve_drop(c);
+}
 
+/**************
+ * Tracing
+ *
+ * trace on records what the shell does to run a job: parsing, alias
+ * expansion, PATH resolution, fork or posix_spawn, the exec of a forked
+ * child, stops, continues, reaps and the time a job holds the
+ * foreground, with CLOCK_MONOTONIC timestamps. The events go into a
+ * ring of TRACE_EVENTS slots in a shared mapping, so the children
+ * forked by the shell record into it too; a writer takes a slot with
+ * an atomic add on the head and publishes it by storing its sequence
+ * number last, so nothing is locked and a slot being written is never
+ * read. When the ring is full the oldest events are overwritten.
+ * trace dump writes the ring in the Chrome trace format, which
+ * chrome://tracing and Perfetto open, with a track per process. While
+ * tracing is off, an event costs a test of tracing.
+ **************/
+
+/* trace_now - CLOCK_MONOTONIC in ns when tracing, else 0 */
+uint64_t trace_now(void) {
+    struct timespec ts;
+
+    if (!tracing)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-    p->next = alias_p;
-    alias_p = p;
-    return;
+/* trace_put - Record an event, an instant if dur is -1 */
+static void trace_put(const char *name, uint64_t ts, int64_t dur, pid_t pid, int jid, const char *arg) {
+    uint64_t seq = __atomic_fetch_add(&trace_buf->head, 1, __ATOMIC_RELAXED);
+    struct trace_t *e = &trace_buf->ev[seq & (TRACE_EVENTS - 1)];
+
+    __atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED); /* unpublished while it is written */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    e->ts = ts;
+    e->dur = dur;
+    e->name = name;
+    e->pid = pid;
+    e->jid = jid;
+    snprintf(e->arg, sizeof(e->arg), "%s", (arg != NULL) ? arg : "");
+    __atomic_store_n(&e->seq, seq + 1, __ATOMIC_RELEASE);
 }
 
 /*
- * alias_free - free the memory of all rename command
+ * trace_span - Record an event from start, a trace_now(), until now.
+ *     pid is the process it is about, 0 for the shell.
  */
-void alias_free(void) {
-    while (alias_p != NULL) {
-        struct alias_t *p = alias_p->next;
-        free(alias_p);
-        alias_p = p;
+void trace_span(const char *name, uint64_t start, pid_t pid, int jid, const char *arg) {
+    uint64_t now;
 
-    }
-    return;
+    if (start == 0 || (now = trace_now()) == 0)
+        return;
+    trace_put(name, start, now - start, pid, jid, arg);
 }
 
-/* 
- * do_bgfg - Execute the builtin bg and fg commands
- */
-void do_bgfg(char **argv) {
-
-    struct job_t *job;
+/* trace_mark - Record an instant event */
+void trace_mark(const char *name, pid_t pid, int jid, const char *arg) {
+    uint64_t now = trace_now();
 
+    if (now != 0)
+        trace_put(name, now, -1, pid, jid, arg);
+}
 
-    /* have no argument */
-    if (argv[1] == NULL) {
-        printf("%s command requires PID or %%jobid argument\n", argv[0]);
-        return;
+/* trace_json - Write s as a JSON string */
+static void trace_json(FILE *f, const char *s) {
+    putc('"', f);
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(f, "\\%c", *s);
+        else if ((unsigned char) *s < 0x20)
+            fprintf(f, "\\u%04x", *s);
+        else
+            putc(*s, f);
     }
+    putc('"', f);
+}
 
-    /* job id */
-    if (argv[1][0] == '%') {
-        int jid = atoi(&argv[1][1]);
-        job = getjobjid(jid);
-        if (job == NULL) {
-            printf("%%%d: no such job\n", jid);
-            return;
-        }
-    } else if (isdigit(argv[1][0])) {//pid
-        int pid = atoi(argv[1]);
-        job = getjobpid(pid);
-        if (job == NULL) {
-            printf("(%d): no such process\n", pid);
-            return;
+/*
+ * trace_dump - Write the events in the ring to file in the Chrome trace
+ *     format. Returns the number of events, -1 on failure.
+ */
+long trace_dump(char *file) {
+    uint64_t head = __atomic_load_n(&trace_buf->head, __ATOMIC_ACQUIRE);
+    uint64_t first = (head > TRACE_EVENTS) ? head - TRACE_EVENTS : 0;
+    pid_t self = getpid();
+    struct trace_t e;
+    long n = 0;
+    FILE *f;
+
+    if ((f = fopen(file, "w")) == NULL)
+        return -1;
+    fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    fprintf(f, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"args\": {\"name\": \"CaiShell\"}}", self);
+    fprintf(f, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, \"args\": {\"name\": \"shell\"}}",
+            self, self);
+    for (uint64_t seq = first; seq < head; seq++) {
+        struct trace_t *p = &trace_buf->ev[seq & (TRACE_EVENTS - 1)];
+
+        if (__atomic_load_n(&p->seq, __ATOMIC_ACQUIRE) != seq + 1)
+            continue; /* still being written, or already overwritten */
+        e = *p;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&p->seq, __ATOMIC_RELAXED) != seq + 1)
+            continue;
+        /* name the track of a child after its program */
+        if (e.pid != 0 && (!strcmp(e.name, "spawn") || !strcmp(e.name, "fork"))) {
+            fprintf(f, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, \"args\": {\"name\": ",
+                    self, e.pid);
+            trace_json(f, e.arg);
+            fprintf(f, "}}");
         }
-    } else {
-        printf("%s: argument must be a PID or %%jobid\n", argv[0]);
-        return;
+        fprintf(f, ",\n{\"name\": \"%s\", \"cat\": \"job\", \"ts\": %.3f, ", e.name, e.ts / 1e3);
+        if (e.dur < 0)
+            fprintf(f, "\"ph\": \"i\", \"s\": \"t\", ");
+        else
+            fprintf(f, "\"ph\": \"X\", \"dur\": %.3f, ", e.dur / 1e3);
+        fprintf(f, "\"pid\": %d, \"tid\": %d, \"args\": {", self, e.pid ? e.pid : self);
+        if (e.jid > 0)
+            fprintf(f, "\"jid\": %d, ", e.jid);
+        fprintf(f, "\"arg\": ");
+        trace_json(f, e.arg);
+        fprintf(f, "}}");
+        n++;
     }
+    fprintf(f, "\n]}\n");
+    if (fclose(f) == EOF)
+        return -1;
+    return n;
+}
 
-    kill(-(job->pgid), SIGCONT);
+/*
+ * do_trace - Execute the builtin trace command
+ *     trace             tell whether tracing is on and the events kept
+ *     trace on|off      start or stop recording
+ *     trace dump file   write the events to file as Chrome trace JSON
+ */
+int do_trace(char **argv) {
+    uint64_t head = (trace_buf != NULL) ? __atomic_load_n(&trace_buf->head, __ATOMIC_RELAXED) : 0;
+    long n;
 
-    if (!strcmp(argv[0], "bg")) {
-        job->state = BG;
-        printf("[%d] (%d) %s", job->jid, job->pgid, job->cmdline);
-    } else {
-        job->state = FG;
-        waitfg(job->pgid);
+    if (argv[1] == NULL) {
+        printf("trace: %s, %lu events\n", tracing ? "on" : "off",
+               (unsigned long) ((head > TRACE_EVENTS) ? TRACE_EVENTS : head));
+        return 0;
     }
-    return;
-
+    if (!strcmp(argv[1], "on") && argv[2] == NULL) {
+        if (trace_buf == NULL) {
+            void *p = mmap(NULL, sizeof(struct tracebuf_t), PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) {
+                builtin_error("trace: %s\n", strerror(errno));
+                return 1;
+            }
+            trace_buf = (struct tracebuf_t *) p;
+        }
+        tracing = 1;
+        return 0;
+    }
+    if (!strcmp(argv[1], "off") && argv[2] == NULL) {
+        tracing = 0;
+        return 0;
+    }
+    if (!strcmp(argv[1], "dump") && argv[2] != NULL && argv[3] == NULL) {
+        if (trace_buf == NULL) {
+            builtin_error("trace: nothing traced\n");
+            return 1;
+        }
+        if ((n = trace_dump(argv[2])) < 0) {
+            builtin_error("trace: %s: %s\n", argv[2], strerror(errno));
+            return 1;
+        }
+        if (verbose)
+            printf("trace: %ld events written to %s\n", n, argv[2]);
+        return 0;
+    }
+    builtin_error("Usage: trace [on | off | dump file]\n");
+    return 2;
 }
 
-/* 
- * waitfg - Block until process pid is no longer the foreground process 不推荐使用 waitpid 函数
- */
-void waitfg(pid_t pgid) {
-    if (pgid == 0) 
-        return;
+/**************
+ * Event loop
+ *
+ * SIGCHLD stays blocked in the shell and is read from a signalfd, and
+ * every started process has a pidfd, all in one epoll set together
+ * with stdin. Children are reaped in batches on the main thread, so
+ * no job list code runs in signal context and no wakeup can be lost
+ * between checking the job list and going to sleep.
+ **************/
 
+/*
+ * events_init - Block SIGCHLD and create the epoll set with the
+ *     signalfd and stdin in it
+ */
+void events_init(void) {
+    struct epoll_event ev;
     sigset_t mask;
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGINT);
-    sigaddset(&mask, SIGTSTP);
-    sigaddset(&mask, SIGQUIT);
-    while (pgid==fgpgid()) 
-        sigsuspend(&mask);
-    
-    return;
 
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &child_mask); /* children get the old mask back */
+    sigdelset(&child_mask, SIGCHLD);
+
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        unix_error("epoll_create1 error");
+    if ((sigchld_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+        unix_error("signalfd error");
+
+    ev.events = EPOLLIN;
+    ev.data.u64 = EV_TAG(EV_SIGCHLD, sigchld_fd);
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sigchld_fd, &ev) < 0)
+        unix_error("epoll_ctl error");
+
+    ev.events = 0; /* armed by event_wait() while input is wanted */
+    ev.data.u64 = EV_TAG(EV_INPUT, STDIN_FILENO);
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) < 0)
+        input_ready = 1; /* a regular file cannot be polled, it is always ready */
 }
 
-/***********************************************
- * Helper routines that manipulate the job list
- **********************************************/
-
-/* clearjob - Clear the entries in a job struct */
-void clearjob(struct job_t *job) {
-    memset(job->pid, 0, sizeof(pid_t) * MAXJOBPS);
-    job->pgid = 0;
-    job->jid = 0;
-    job->state = UNDEF;
-    job->cmdline[0] = '\0';
-    return;
+/*
+ * events_reset - Give a forked child that runs a builtin an event loop
+ *     and a job list of its own, the epoll set is shared with the shell
+ */
+void events_reset(void) {
+    close(epoll_fd);
+    close(sigchld_fd);
+    free(fd_watch);
+    fd_watch = NULL;
+    nfd_watch = 0;
+    input_ready = input_armed = 0;
+    njobs = npids = topjid = 0;
+    fgjob = NULL;
+    initjobs(); /* the old jobs are not children of this process */
+    events_init();
 }
 
-/* initjobs - Initialize the job list */
-void initjobs(void) {
-    int i;
+/*
+ * watchpid - Open a pidfd for a new process and add it to the epoll
+ *     set. Returns the pidfd, -1 if the kernel has no pidfds (SIGCHLD
+ *     still covers the process then).
+ */
+int watchpid(pid_t pid) {
+    struct epoll_event ev;
+    int fd;
 
-    for (i = 0; i < MAXJOBS; i++)
-        clearjob(&jobs[i]);
-    return;
+    if ((fd = syscall(SYS_pidfd_open, pid, 0)) < 0)
+        return -1;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    ev.events = EPOLLIN;
+    ev.data.u64 = EV_TAG(EV_PIDFD, pid);
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
 }
 
-/* maxjid - Returns largest allocated job ID */
-int maxjid(void) {
-    int i, max = 0;
+/*
+ * watchfd - Call func from the event loop whenever fd has input
+ */
+void watchfd(int fd, void (*func)(int fd, void *arg), void *arg) {
+    struct epoll_event ev;
+
+    if (fd >= nfd_watch) {
+        int n = nfd_watch ? nfd_watch : 64;
+        while (n <= fd)
+            n *= 2;
+        fd_watch = (struct fdwatch_t *) realloc(fd_watch, n * sizeof(struct fdwatch_t));
+        memset(fd_watch + nfd_watch, 0, (n - nfd_watch) * sizeof(struct fdwatch_t));
+        nfd_watch = n;
+    }
+    fd_watch[fd].func = func;
+    fd_watch[fd].arg = arg;
 
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].jid > max)
-            max = jobs[i].jid;
-    return max;
+    ev.events = EPOLLIN;
+    ev.data.u64 = EV_TAG(EV_FD, fd);
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        unix_error("epoll_ctl error");
 }
 
-/* addjob - Add a job to the job list */
-int addjob(pid_t pid, pid_t pgid, int state, char *cmdline) {
-    int i,j;
+/*
+ * watchfd_write - Also call the func of a watched fd when it can be
+ *     written (on), or stop that
+ */
+void watchfd_write(int fd, int on) {
+    struct epoll_event ev;
 
-    if (pid < 1)
-        return 0;
+    ev.events = EPOLLIN | (on ? EPOLLOUT : 0);
+    ev.data.u64 = EV_TAG(EV_FD, fd);
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+}
 
-    for (i = 0; i < MAXJOBS; i++) {
-        if (jobs[i].pgid == pgid) {
-			for (j = 0; j < MAXJOBPS; j++) {
-				if(jobs[i].pid[j] == 0)
-				{
-					jobs[i].pid[j] = pid;
-					jobs[i].state = state;
-					jobs[i].jid = nextjid++;
-					if (nextjid > MAXJOBS)
-						nextjid = 1;
-					strcpy(jobs[i].cmdline, cmdline);
-					if (verbose) {
-						printf("Added job [%d] %d %s\n", jobs[i].jid, jobs[i].pid[j], jobs[i].cmdline);
-					}
-					return 1;
-				}
-			}
-        }
-    }
-	
-	for (i = 0; i < MAXJOBS; i++) {
-        if (jobs[i].pgid == 0) {
-			for (j = 0; j < MAXJOBPS; j++) {
-				if(jobs[i].pid[j] == 0)
-				{
-					jobs[i].pid[j] = pid;
-					jobs[i].state = state;
-					jobs[i].jid = nextjid++;
-					if (nextjid > MAXJOBS)
-						nextjid = 1;
-					strcpy(jobs[i].cmdline, cmdline);
-					if (verbose) {
-						printf("Added job [%d] %d %s\n", jobs[i].jid, jobs[i].pid[j], jobs[i].cmdline);
-					}
-					return 1;
-				}
-			}
-        }
-    }
-    printf("Tried to create too many jobs\n");
-    return 0;
+/*
+ * unwatchfd - Stop watching fd, before it is closed
+ */
+void unwatchfd(int fd) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    fd_watch[fd].func = NULL;
 }
 
-/* deletejob - Delete a job whose PID=pid from the job list */
-int deletejob(pid_t pgid) {
-    int i;
+/*
+ * event_wait - Wait for the next batch of events and reap the children
+ *     they report. Returns 1 if stdin has input, 0 otherwise. If input
+ *     is false, stdin is not waited for.
+ */
+int event_wait(int input) {
+    struct epoll_event ev[64];
+    struct signalfd_siginfo si;
+    int n, ready = 0, chld = 0;
 
-    if (pgid < 1)
-        return 0;
+    if (input && input_ready)
+        return 1;
+    if (input != input_armed && !input_ready) { /* else pending input would wake every wait */
+        struct epoll_event iev;
+        iev.events = input ? EPOLLIN : 0;
+        iev.data.u64 = EV_TAG(EV_INPUT, STDIN_FILENO);
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, STDIN_FILENO, &iev);
+        input_armed = input;
+    }
 
-    for (i = 0; i < MAXJOBS; i++) {
-        if (jobs[i].pgid == pgid) {
-            clearjob(&jobs[i]);
-            nextjid = maxjid() + 1;
-            return 1;
+    if ((n = epoll_wait(epoll_fd, ev, 64, -1)) < 0) {
+        if (errno == EINTR)
+            return 0;
+        unix_error("epoll_wait error");
+    }
+    for (int i = 0; i < n; i++) {
+        switch (EV_TYPE(ev[i].data.u64)) {
+            case EV_INPUT:
+                ready = 1;
+                break;
+            case EV_SIGCHLD:
+                while (read(sigchld_fd, &si, sizeof(si)) == sizeof(si))
+                    ;
+                chld = 1;
+                break;
+            case EV_PIDFD:
+                chld = 1;
+                break;
+            case EV_FD: {
+                int fd = (uint32_t) ev[i].data.u64;
+                if (fd < nfd_watch && fd_watch[fd].func != NULL)
+                    fd_watch[fd].func(fd, fd_watch[fd].arg);
+                break;
+            }
         }
     }
-    return 0;
-}
-
-/* fgpgid - Return PID of current foreground job, 0 if no such job */
-int fgpgid(void) {
-    int i;
-
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].state == FG)
-	    return jobs[i].pgid;
-    return 0;
+    if (chld)
+        reap();
 
+    return input && ready;
 }
 
-/* getjobpid  - Find a job (by PID) on the job list */
-struct job_t *getjobpid(pid_t pid) {
-    int i, j;
+/*
+ * reap - Reap all available zombie children, and note the ones that
+ *     stopped because they received a SIGSTOP or SIGTSTP signal, but
+ *     don't wait for any other currently running children.
+ */
+void reap(void) {
+    int status;
+    pid_t pid;
+    struct rusage ru;
 
-    if (pid < 1)
-        return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].pgid != 0)
-            for (j = 0; j < MAXJOBPS; j++)
-            {
-                if (jobs[i].pid[j] == 0)
-                    break;
-                if (jobs[i].pid[j] == pid)
-                    return &jobs[i];
-            }
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED, &ru)) > 0) {
+        struct job_t *job = getjobpid(pid);
+        char arg[24];
 
-    return NULL;
+        if (tracing) {
+            if (WIFEXITED(status))
+                snprintf(arg, sizeof(arg), "exit %d", WEXITSTATUS(status));
+            else
+                snprintf(arg, sizeof(arg), "signal %d", WIFSIGNALED(status) ? WTERMSIG(status) : WSTOPSIG(status));
+            trace_mark(WIFSTOPPED(status) ? "stop" : "reap", pid, job ? job->jid : 0, arg);
+        }
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            if (job != NULL)
+                rusage_add(&job->ru, &ru);
+            if (job != NULL && job->times != NULL)
+                for (int i = 0; i < job->npid; i++)
+                    if (job->pid[i] == pid) {
+                        job->times[i].ru = ru;
+                        clock_gettime(CLOCK_MONOTONIC, &job->times[i].end);
+                        break;
+                    }
+            if (WIFSIGNALED(status))
+                printf("Job [%d] (%d) terminated by signal %d\n", pid2jid(pid), pid, WTERMSIG(status));
+            if (job != NULL && pid == job->pid[job->npid - 1]) /* the status of a pipeline */
+                job->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            /* a pipeline is done when its last stage is reaped */
+            deletepid(pid);
+        } else if (WIFSTOPPED(status)) {
+            printf("Job [%d] (%d) stopped by signal %d\n", pid2jid(pid), pid, WSTOPSIG(status));
+            if (job != NULL) {
+                setjobstate(job, ST);
+            }
+        }
+    }
+    if (pid < 0 && errno != ECHILD) { /* 0 only means other children still run */
+        unix_error("waitpid error");
+    }
 }
 
-/* getjobjid  - Find a job (by JID) on the job list */
-struct job_t *getjobjid(int jid) {
-    int i;
-
-    if (jid < 1)
-        return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].jid == jid)
-            return &jobs[i];
-    return NULL;
+/* timespec_diff - Seconds from b to a */
+double timespec_diff(struct timespec *a, struct timespec *b) {
+    return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) / 1e9;
 }
 
-/* pid2jid - Map process ID to job ID */
-int pid2jid(pid_t pid) {
-    int i, j;
+/* timeval_sec - A timeval in seconds */
+double timeval_sec(struct timeval *tv) {
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
 
-    if (pid < 1)
-        return 0;
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].pgid != 0)
-            for (j = 0; j < MAXJOBPS; j++)
-            {
-                if (jobs[i].pid[j] == 0)
-                    break;
-                if (jobs[i].pid[j] == pid)
-                    return jobs[i].jid;
-            }
+/* rusage_add - Add the counters of b to a, maxrss is the larger one */
+void rusage_add(struct rusage *a, struct rusage *b) {
+    timeradd(&a->ru_utime, &b->ru_utime, &a->ru_utime);
+    timeradd(&a->ru_stime, &b->ru_stime, &a->ru_stime);
+    if (b->ru_maxrss > a->ru_maxrss)
+        a->ru_maxrss = b->ru_maxrss;
+    a->ru_nvcsw += b->ru_nvcsw;
+    a->ru_nivcsw += b->ru_nivcsw;
+    a->ru_minflt += b->ru_minflt;
+    a->ru_majflt += b->ru_majflt;
+}
 
-    return 0;
+/* rusage_sub - Subtract the counters of b from a, maxrss is kept */
+void rusage_sub(struct rusage *a, struct rusage *b) {
+    timersub(&a->ru_utime, &b->ru_utime, &a->ru_utime);
+    timersub(&a->ru_stime, &b->ru_stime, &a->ru_stime);
+    a->ru_nvcsw -= b->ru_nvcsw;
+    a->ru_nivcsw -= b->ru_nivcsw;
+    a->ru_minflt -= b->ru_minflt;
+    a->ru_majflt -= b->ru_majflt;
 }
 
-/* listjobs - Print the job list */
-void listjobs(void) {
-    int i, j;
+/*
+ * print_time - Print one line of the time report on stderr, the header
+ *     if label is NULL
+ */
+void print_time(char *label, double real, struct rusage *ru, char *name) {
+    fflush(stdout);
+    if (label == NULL) {
+        fprintf(stderr, "%-6s %10s %10s %10s %10s %8s %8s %8s %8s\n", "stage", "real", "user",
+                "sys", "maxrss", "vcsw", "ivcsw", "minflt", "majflt");
+        return;
+    }
+    fprintf(stderr, "%-6s %9.3fs %9.3fs %9.3fs %9ldk %8ld %8ld %8ld %8ld  %s\n", label, real,
+            timeval_sec(&ru->ru_utime), timeval_sec(&ru->ru_stime), ru->ru_maxrss,
+            ru->ru_nvcsw, ru->ru_nivcsw, ru->ru_minflt, ru->ru_majflt, name ? name : "");
+}
 
-    for (i = 0; i < MAXJOBS; i++) {
-        if (jobs[i].pgid != 0) {
-            for (j = 0; j < MAXJOBPS; j++) {
-                if (jobs[i].pid[j] == 0)
-                    break;
-                printf("[%d] (%d) (%d)", jobs[i].jid, jobs[i].pid[j], jobs[i].pgid);
-				
-                switch (jobs[i].state) {
-                    case BG:
-                        printf("Running ");
-                        break;
-                    case FG:
-                        printf("Foreground ");
-                        break;
-                    case ST:
-                        printf("Stopped ");
-                        break;
-                    default:
-                        printf("listjobs: Internal error: job[%d].state=%d ",
-                               i, jobs[i].state);
-                }
-                printf("%s", jobs[i].cmdline);
-            }
+/*
+ * report_time - Print the time report of a finished job: one line per
+ *     stage, so the slow stage of a pipeline stands out, and the total.
+ *     The total real time ends with the last stage reaped, the counters
+ *     are summed, and maxrss is the largest of the stages.
+ */
+void report_time(struct job_t *job) {
+    struct rusage total;
+    struct timespec *last = &job->start;
+    char label[16];
+
+    memset(&total, 0, sizeof(total));
+    print_time(NULL, 0, NULL, NULL);
+    for (int i = 0; i < job->npid; i++) {
+        struct stagetime_t *t = &job->times[i];
+
+        if (t->end.tv_sec == 0 && t->end.tv_nsec == 0) /* not reaped: killed with the job */
+            continue;
+        if (timespec_diff(&t->end, last) > 0)
+            last = &t->end;
+        snprintf(label, sizeof(label), "%d", i + 1);
+        print_time(label, timespec_diff(&t->end, &job->start), &t->ru, t->name);
+        rusage_add(&total, &t->ru);
+    }
+    if (job->npid > 1)
+        print_time("total", timespec_diff(last, &job->start), &total, NULL);
+}
 
+/*
+ * getcmdline - Read the next command line from stdin
+ *
+ * stdin is read in large blocks only when epoll says it has input, so
+ * jobs finishing while the shell sits at the prompt are reaped right
+ * away. The line is returned with its '\n', NULL at end of file.
+ */
+char *getcmdline(void) {
+    static char *buf, *line;
+    static size_t size, start, end, linesize;
+    char *nl;
+    size_t len;
+    ssize_t n;
+
+    while (buf == NULL || (nl = memchr(buf + start, '\n', end - start)) == NULL) {
+        if (start > 0) { /* keep the partial line at the head of buf */
+            memmove(buf, buf + start, end - start);
+            end -= start;
+            start = 0;
+        }
+        if (size - end < INBUF) {
+            size = size ? 2 * size : 4 * INBUF;
+            if ((buf = (char *) realloc(buf, size)) == NULL)
+                app_error("getcmdline: out of memory");
+        }
+        while (!event_wait(1))
+            ;
+        if ((n = read(STDIN_FILENO, buf + end, size - end)) < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            app_error("read error");
+        }
+        if (n == 0) { /* End of file (ctrl-d), a last line may miss its '\n' */
+            if (end == start)
+                return NULL;
+            buf[end++] = '\n';
+            continue;
         }
+        end += n;
     }
+
+    len = nl + 1 - (buf + start);
+    if (len + 1 > linesize) {
+        linesize = len + 1;
+        if ((line = (char *) realloc(line, linesize)) == NULL)
+            app_error("getcmdline: out of memory");
+    }
+    memcpy(line, buf + start, len);
+    line[len] = '\0';
+    start += len;
+    return line;
 }
-/******************************
- * end job list helper routines
- ******************************/
 
 /*****************
  * Signal handlers
@@ -1161,42 +7566,6 @@ handler_t *Signal(int signum, handler_t *handler) {
     return (old_action.sa_handler);
 }
 
-/*
- * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
- *     a child job terminates (becomes a zombie), or stops because it
- *     received a SIGSTOP or SIGTSTP signal. The handler reaps all
- *     available zombie children, but doesn't wait for any other
- *     currently running children to terminate.
- */
-void sigchld_handler(int sig) {
-
-    int status;
-    //   int test = ECHILD;
-    pid_t pid;
-    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) { //WNOHANG不打算阻塞等待子进程返回时，可以这样使用。
-        // printf("1");
-        if (WIFEXITED(status)) /* returns true if the child terminated normally */
-        {
-            deletejob(pid);
-        } else if (WIFSIGNALED(status)) {
-            printf("Job [%d] (%d) terminated by signal %d\n", pid2jid(pid), pid, WTERMSIG(status));
-            deletejob(pid);
-        } else if (WIFSTOPPED(status)) {
-            printf("Job [%d] (%d) stopped by signal %d\n", pid2jid(pid), pid, WSTOPSIG(status));
-            struct job_t *job = getjobpid(pid);
-            if (job != NULL) {
-                job->state = ST;
-            }
-        }
-    }
-    if (errno != ECHILD) {
-        unix_error("waitpid error");
-    }
-
-
-    return;
-}
-
 /*
  * sigint_handler - The kernel sends a SIGINT to the shell whenver the
  *    user types ctrl-c at the keyboard.  Catch it and send it along
@@ -1259,10 +7628,14 @@ void sigquit_handler(int sig) {
  * usage - print a help message
  */
 void usage(void) {
-    printf("Usage: shell [-hvp]\n");
+    printf("Usage: shell [-hvp] [-f config] [-c commands | script | --serve path.sock]\n");
     printf("   -h   print this message\n");
     printf("   -v   print additional diagnostic information\n");
     printf("   -p   do not emit a command prompt\n");
+    printf("   -c   run the commands and exit\n");
+    printf("   -f   read the config from this file instead of myconf\n");
+    printf("   script  run the commands of the file and exit\n");
+    printf("   --serve run the requests of clients on a Unix domain socket\n");
     exit(1);
 }
 